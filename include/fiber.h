@@ -25,6 +25,27 @@ struct fiber_manager;
 #define FIBER_DETACH_WAIT_TO_JOIN (2)
 #define FIBER_DETACH_DETACHED (3)
 
+// priority classes, highest first. a manager runs the highest class it has
+// queued, but a lower class still gets a turn after
+// FIBER_SCHEDULER_PRIORITY_AGING fibers of higher classes ran ahead of it.
+typedef int fiber_priority_t;
+
+#define FIBER_PRIORITY_LATENCY (0)
+#define FIBER_PRIORITY_NORMAL (1)
+#define FIBER_PRIORITY_BACKGROUND (2)
+#define FIBER_PRIORITY_CLASSES (3)
+
+// where a fiber's time goes, see fiber_get_times()
+typedef int fiber_time_kind_t;
+
+#define FIBER_TIME_RUNNING (0)
+#define FIBER_TIME_READY (1)  // scheduled, waiting for a manager to run it
+#define FIBER_TIME_LOCK (2)   // blocked on a fiber_mutex_t or fiber_rwlock_t
+#define FIBER_TIME_IO (3)     // blocked in fiber_wait_for_event()
+#define FIBER_TIME_SLEEP (4)  // in fiber_sleep()
+#define FIBER_TIME_WAIT (5)   // blocked on anything else
+#define FIBER_TIME_KINDS (6)
+
 typedef struct fiber {
   volatile fiber_state_t state;
   fiber_run_function_t run_function;
@@ -40,6 +61,16 @@ typedef struct fiber {
                            // mechanisms do not conflict! (ie. only use scratch
                            // while a fiber is sleeping/waiting)
   lock_stats_t* fiber_stats;
+  fiber_priority_t priority;
+  uint64_t ready_since;  // when the fiber was last scheduled, 0 if it wasn't
+  uint64_t deadline;     // see fiber_set_deadline(), 0 if there is none
+  int home_manager;      // see fiber_set_home_manager(), -1 if there is none
+  // time accounting, see fiber_get_times(). the fiber has been doing
+  // time_kind since time_since; wait_kind is what its next wait is for.
+  uint64_t times[FIBER_TIME_KINDS];
+  uint64_t time_since;
+  fiber_time_kind_t time_kind;
+  fiber_time_kind_t wait_kind;
 } fiber_t;
 
 #ifdef __cplusplus
@@ -49,14 +80,35 @@ extern "C" {
 #define FIBER_DEFAULT_STACK_SIZE (102400)
 #define FIBER_MIN_STACK_SIZE (1024)
 
+// may be called from threads which aren't fiber managers, in which case the
+// new fiber goes through fiber_manager_inject()
 extern fiber_t* fiber_create(size_t stack_size, fiber_run_function_t run,
                              void* param);
 
 extern fiber_t* fiber_create_no_sched(size_t stack_size,
                                       fiber_run_function_t run, void* param);
 
+// like fiber_create(), in the given priority class. returns NULL with errno set
+// to EINVAL if priority isn't a valid class.
+extern fiber_t* fiber_create_with_priority(size_t stack_size,
+                                           fiber_run_function_t run,
+                                           void* param,
+                                           fiber_priority_t priority);
+
 extern fiber_t* fiber_create_from_thread();
 
+// creates a fiber which runs on the calling manager's shared stack rather
+// than a stack of its own. while it's switched out only the part of the stack
+// it was using is kept, copied to the heap, which suits large numbers of
+// mostly idle fibers; each switch to it may cost a copy. the fiber is pinned
+// to the calling manager, and mustn't hand pointers to its locals to other
+// fibers or threads which use them while it's switched out. returns NULL with
+// errno set: to EINVAL if the caller isn't a fiber, EAGAIN if the manager is
+// being retired, or ENOTSUP if shared stacks aren't supported by this build
+// (see fiber_shared_stack_t).
+extern fiber_t* fiber_create_shared(fiber_run_function_t run_function,
+                                    void* param);
+
 extern int fiber_join(fiber_t* f, void** result);
 
 extern int fiber_tryjoin(fiber_t* f, void** result);
@@ -65,9 +117,55 @@ extern int fiber_yield();
 
 extern int fiber_detach(fiber_t* f);
 
-extern lock_stats_t* get_lock_stats(fiber_t* f); 
+// gives the pages of the calling fiber's stack below its current depth back
+// to the kernel, returning how many bytes were released. worth calling after
+// a deep call chain returns and before a long wait. only stacks allocated
+// with FIBER_STACK_MMAP can be trimmed; returns 0 for any other stack.
+extern size_t fiber_trim_stack();
+
+// moves f to another priority class, starting the next time it's scheduled.
+// returns FIBER_ERROR with errno set to EINVAL if priority isn't a valid class.
+extern int fiber_set_priority(fiber_t* f, fiber_priority_t priority);
+
+extern fiber_priority_t fiber_get_priority(fiber_t* f);
+
+// "latency", "normal" or "background"
+extern const char* fiber_priority_name(fiber_priority_t priority);
+
+// deadline is an absolute time in nanoseconds on the fiber_manager_read_clock()
+// clock, or 0 for none. fibers inherit the deadline of the fiber creating them.
+// the "edf" scheduler runs fibers with the earliest deadlines first, starting
+// the next time f is scheduled; other schedulers only count the misses.
+extern void fiber_set_deadline(fiber_t* f, uint64_t deadline);
+
+extern uint64_t fiber_get_deadline(fiber_t* f);
+
+// pins f to the manager with the given index (0 up to the kernel thread count),
+// so only that manager runs it and it's never stolen. -1 lets any manager run
+// it again. takes effect the next time f is scheduled; to start a fiber on its
+// home manager, set it between fiber_create_no_sched() and
+// fiber_manager_schedule(). returns FIBER_ERROR with errno set to EINVAL if
+// there is no such manager, or if f runs on a shared stack (see
+// fiber_create_shared()) and can't move.
+extern int fiber_set_home_manager(fiber_t* f, int manager);
+
+extern int fiber_get_home_manager(fiber_t* f);
+
+// copies the nanoseconds f spent in each fiber_time_kind_t into times, which
+// has FIBER_TIME_KINDS entries. time is only accounted while
+// fiber_manager_options_t.account_time is on. the time since f last switched
+// is left out unless f is the calling fiber, and times for a fiber running
+// on another manager are only roughly right.
+extern void fiber_get_times(fiber_t* f, uint64_t* times);
+
+// "running", "ready", "lock", "io", "sleep" or "wait"
+extern const char* fiber_time_kind_name(fiber_time_kind_t kind);
+
+extern lock_stats_t* get_lock_stats(fiber_t* f);
 
-extern void set_lock_stats(fiber_t* fiber, struct timeval* banned_until, struct timeval* slice_size);
+// banned_until and slice_size are in nanoseconds; NULL leaves a value as is
+extern void set_lock_stats(fiber_t* fiber, const uint64_t* banned_until,
+                           const uint64_t* slice_size);
 
 #ifdef __cplusplus
 }
@@ -5,6 +5,7 @@
 #define _FIBER_CONTEXT_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define FIBER_ERROR (0)
 #define FIBER_SUCCESS (1)
@@ -15,6 +16,8 @@ typedef void* (*fiber_run_function_t)(void*);
 typedef void* splitstack_context_t[10];
 #endif
 
+struct fiber_shared_stack;
+
 typedef struct fiber_context {
   void* ctx_stack;
   size_t ctx_stack_size;
@@ -30,8 +33,50 @@ typedef struct fiber_context {
 #if __SANITIZE_THREAD__
   void* tsan_fiber;
 #endif
+  // contexts on a shared stack (see fiber_context_init_shared()) keep their
+  // frames in saved_stack while another context's frames are on it
+  struct fiber_shared_stack* shared_stack;
+  void* saved_stack;
+  size_t saved_size;
+  size_t saved_capacity;
+  int has_canary;  // see fiber_context_fill_canary()
 } fiber_context_t;
 
+// what fiber_context_fill_canary() fills unused stack with
+#define FIBER_CONTEXT_CANARY ((uintptr_t)0xfdfdfdfdfdfdfdfdULL)
+
+/*
+    Description: one execution stack which many contexts take turns running
+                 on. the context whose frames are on the stack is the
+                 occupant. switching to any other context on the stack goes
+                 through the copier, a small context with a stack of its own:
+                 it copies the used part of the occupant's stack (from its
+                 saved stack pointer up) into a buffer of just that size, then
+                 copies the new context's frames back to the same addresses
+                 and switches to it. a context which is switched away from
+                 and back to without another on the stack in between isn't
+                 copied at all.
+
+                 frames are always copied back to where they were, so the
+                 contexts on a shared stack must all be run by the same
+                 thread. other threads mustn't be handed pointers into a
+                 context's stack while it's switched out, since the memory
+                 will hold some other context's frames.
+
+                 only supported where context switching is done in assembly
+                 (FIBER_FAST_SWITCHING on x86 or x86_64) and stacks aren't
+                 split.
+*/
+typedef struct fiber_shared_stack {
+  fiber_context_t region;  // owns the memory the contexts run on
+  char* top;  // the aligned top of the stack, where every context starts
+  fiber_context_t* occupant;
+  fiber_context_t copier;
+  fiber_context_t* copy_to;  // the context the copier switches to next
+  uint64_t copy_count;    // contexts copied back onto the stack
+  uint64_t copied_bytes;  // bytes copied off of and back onto the stack
+} fiber_shared_stack_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -46,6 +91,36 @@ extern void fiber_context_swap(fiber_context_t* from_context,
 
 extern void fiber_context_destroy(fiber_context_t* context);
 
+// fills the part of a new context's stack below its first frame with
+// FIBER_CONTEXT_CANARY, so fiber_context_stack_depth() can tell how much of
+// it was used. does nothing for contexts on a thread's or a shared stack, or
+// where context switching isn't done in assembly.
+extern void fiber_context_fill_canary(fiber_context_t* context);
+
+// the deepest context's stack has reached, in bytes from its top, judged by
+// the canary fill. 0 if the stack wasn't filled. with split stacks only the
+// first segment is measured, and pages released by fiber_context_trim_stack()
+// count as used.
+extern size_t fiber_context_stack_depth(const fiber_context_t* context);
+
+// returns NULL with errno set if the stack can't be allocated, or to ENOTSUP
+// if shared stacks aren't supported by this build
+extern fiber_shared_stack_t* fiber_shared_stack_create(size_t stack_size);
+
+// every context on shared must have been destroyed
+extern void fiber_shared_stack_destroy(fiber_shared_stack_t* shared);
+
+// like fiber_context_init(), but context runs on shared. its first frame is
+// kept in its saved stack until it's switched to.
+extern int fiber_context_init_shared(fiber_context_t* context,
+                                     fiber_shared_stack_t* shared,
+                                     fiber_run_function_t run_function,
+                                     void* param);
+
+// releases the pages of context's stack below the caller's stack frame (see
+// fiber_trim_stack()). context must be the running context.
+extern size_t fiber_context_trim_stack(fiber_context_t* context);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,8 +28,11 @@ extern void fiber_event_shutdown();
 
 /* ABOUT EVENTS
 When a fiber manager thread is out of fibers to schedule, it will poll for
-events by calling fiber_poll_events(). if zero events are returned, it will
-enter a blocking poll by calling fiber_poll_events_blocking()
+events by calling fiber_poll_events(). if zero events are returned, one idle
+thread at a time enters a blocking poll by calling
+fiber_poll_events_blocking(), while the other idle threads sleep until they're
+woken for new work. fiber_event_wake() interrupts the blocking poll when the
+polling thread is needed to run fibers.
 */
 
 // called when a fiber manager thread is looking for events. returns the number
@@ -43,6 +46,16 @@ extern int fiber_poll_events();
 // triggered.
 extern size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds);
 
+// pass as the seconds to fiber_poll_events_blocking() to wait until an event
+// arrives or fiber_event_wake() is called
+#define FIBER_POLL_FOREVER (UINT32_MAX)
+
+// makes a thread blocked in fiber_poll_events_blocking() return. safe to call
+// from any thread; a wake with no thread blocked makes the next blocking poll
+// return immediately. returns FIBER_ERROR if the event system isn't
+// initialized.
+extern int fiber_event_wake();
+
 #define FIBER_POLL_IN (0x1)
 #define FIBER_POLL_OUT (0x2)
 
@@ -1,15 +1,38 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
 #ifndef _FIBER_LOCK_STATS_H_
 #define _FIBER_LOCK_STATS_H_
 
-#include <time.h>
-#include <sys/time.h>
+#include <stdint.h>
+
+#include "machine_specific.h"
 
 /*
-It is just supporting one lock for now, we will change it to support Many locks using a hash table
+    Description: Per-fiber state for scheduler-cooperative locks. A fiber is
+                 banned from at most one lock at a time: banned_until only
+                 applies to banned_lock. contending is set while the fiber
+                 waits out its ban so the scheduler knows to hold it back. See
+                 schedule_lock.h for the per-lock side of the accounting. Times
+                 are CLOCK_MONOTONIC nanoseconds. A slice_size of 0 uses the
+                 lock's adaptive slice.
+
+                 read_usage and write_usage total the time the fiber spent
+                 holding at least one shared lock and holding exclusive locks
+                 (mutexes and write locks) respectively.
 */
-typedef struct lock_stats{
-    struct timeval banned_until;
-    struct timeval slice_size;
+
+struct schedule_lock_entry;
+
+typedef struct lock_stats {
+  _Atomic uint64_t banned_until;
+  uint64_t slice_size;
+  void* volatile banned_lock;
+  struct schedule_lock_entry* volatile contending;
+  uint64_t read_usage;
+  uint64_t write_usage;
+  uint64_t read_acquired_at;
+  unsigned int read_depth;
 } lock_stats_t;
 
-#endif
\ No newline at end of file
+#endif
@@ -4,14 +4,23 @@
 #ifndef _FIBER_MANAGER_H_
 #define _FIBER_MANAGER_H_
 
+#include <signal.h>
+#include <sys/types.h>
+#include <time.h>
+
 #include "fiber.h"
 #include "fiber_mutex.h"
 #include "fiber_scheduler.h"
 #include "fiber_spinlock.h"
 #include "mpmc_fifo.h"
 #include "mpsc_fifo.h"
+#include "spsc_fifo.h"
 #include "work_stealing_deque.h"
 
+// a fiber_t and its lock stats, allocated together (see
+// fiber_manager_alloc_fiber())
+struct fiber_block;
+
 typedef struct fiber_mpsc_to_push {
   mpsc_fifo_t* fifo;
   mpsc_fifo_node_t* node;
@@ -22,6 +31,20 @@ typedef struct fiber_mpmc_to_push {
   mpmc_fifo_node_t* node;
 } fiber_mpmc_to_push_t;
 
+// a fiber parked until its lock ban expires
+typedef struct fiber_manager_parked {
+  uint64_t until;
+  fiber_t* fiber;
+} fiber_manager_parked_t;
+
+// run lengths and scheduling latencies are counted in power of two buckets of
+// microseconds: bucket 0 holds times under 1us, bucket i times in
+// [2^(i-1), 2^i) us and the last bucket everything longer
+#define FIBER_MANAGER_HISTOGRAM_BUCKETS (24)
+
+// sent by each manager's preemption timer, see fiber_manager_set_preemption()
+#define FIBER_PREEMPT_SIGNAL (SIGURG)
+
 typedef struct fiber_manager {
   fiber_t* maintenance_fiber;
   fiber_t* volatile current_fiber;
@@ -47,26 +70,366 @@ typedef struct fiber_manager {
   uint64_t poll_count;
   uint64_t event_wait_count;
   uint64_t lock_contention_count;
+  uint64_t clock_ns;
+  uint64_t clock_yield_count;  // yield_count when clock_ns was read
+  fiber_manager_parked_t* parked;  // min-heap ordered by 'until'
+  size_t parked_count;
+  size_t parked_capacity;
+  uint64_t park_count;
+  // a woken fiber which runs before anything in the scheduler. other managers
+  // may steal it while they are idle.
+  _Atomic(fiber_t*) runnext;
+  unsigned int runnext_streak;  // consecutive fibers taken from runnext
+  uint64_t runnext_count;
+  uint64_t runnext_steal_count;
+  // 1 while the manager is idle. whoever clears it wakes the manager.
+  _Atomic uint32_t idle;
+  uint64_t sleep_count;  // times this manager went idle
+  uint64_t wake_count;   // idle managers woken by this manager
+  // per priority class, indexed by fiber_priority_t. latency is the time from
+  // a fiber being scheduled until it runs, in nanoseconds.
+  uint64_t class_run_count[FIBER_PRIORITY_CLASSES];
+  uint64_t class_latency_sum[FIBER_PRIORITY_CLASSES];
+  uint64_t class_latency_max[FIBER_PRIORITY_CLASSES];
+  uint64_t latency_histogram[FIBER_MANAGER_HISTOGRAM_BUCKETS];  // all classes
+  uint64_t deadline_miss_count;  // fibers which finished after their deadline
+  // preemption, see fiber_manager_set_preemption(). tid is 0 until the
+  // manager's thread is running.
+  _Atomic pid_t tid;
+  timer_t preempt_timer;
+  int has_preempt_timer;
+  uint64_t switch_count;
+  volatile uint64_t preempt_switch_count;  // switch_count at the last signal
+  volatile sig_atomic_t preempt_requested;
+  uint64_t preempt_count;
+  uint64_t run_started;  // when the current fiber was switched in
+  uint64_t run_length_histogram[FIBER_MANAGER_HISTOGRAM_BUCKETS];
+  int cpu;  // the CPU this manager's thread is pinned to, -1 if it isn't
+  uint64_t sent_home_count;  // fibers handed to their home manager
+  // fibers which other managers sent here because this is their home manager
+  mpsc_fifo_t inbox;
+  // thread-per-core mode: the fibers sent here by manager i arrive in
+  // mailboxes[i], so every pair of managers has its own SPSC FIFO. nodes are
+  // recycled through free_nodes.
+  spsc_fifo_t* mailboxes;
+  spsc_node_t* free_nodes;
+  size_t free_node_count;
+  // non-zero once the manager was retired by fiber_manager_set_thread_count()
+  _Atomic uint32_t retiring;
+  uint64_t retire_count;  // times this manager was retired
+  unsigned int hand_over_turn;  // the next active manager to hand fibers to
+  // time spent blocked while idle, in nanoseconds. idle_since is when the
+  // manager last went to sleep, or 0 while it's awake.
+  uint64_t idle_ns;
+  _Atomic uint64_t idle_since;
+  uint64_t injected_count;  // fibers taken from the injection queue
+  // fiber blocks this manager allocated, kept for reuse once they're freed.
+  // blocks freed by other managers come back through returned_fibers, which
+  // any manager pushes batches onto and only this one takes from.
+  struct fiber_block* free_fibers;
+  size_t free_fiber_count;
+  _Atomic(struct fiber_block*) returned_fibers;
+  // blocks this manager freed which belong to another manager, sent back to
+  // it once there are enough of them
+  struct fiber_block* return_batch;
+  struct fiber_block* return_batch_tail;
+  size_t return_batch_count;
+  int return_batch_owner;
+  uint64_t reused_fiber_count;    // fibers allocated from free_fibers
+  uint64_t returned_fiber_count;  // blocks sent back to other managers
+  // created the first time one of this manager's fibers calls
+  // fiber_create_shared(). the manager isn't retired while shared_fiber_count
+  // fibers are on it.
+  fiber_shared_stack_t* shared_stack;
+  _Atomic size_t shared_fiber_count;
 } fiber_manager_t;
 
+// after this many consecutive runnext fibers the scheduler gets a turn, so a
+// pair of fibers waking each other can't starve the rest of the queue
+#define FIBER_MANAGER_RUNNEXT_LIMIT (64)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// returns CLOCK_MONOTONIC in nanoseconds
+static inline uint64_t fiber_manager_read_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// returns CLOCK_MONOTONIC in nanoseconds, read at most once per scheduling
+// round. this is meant for the yield path - use fiber_manager_read_clock() to
+// time anything shorter than a round.
+static inline uint64_t fiber_manager_clock(fiber_manager_t* manager) {
+  if (manager->clock_yield_count != manager->yield_count) {
+    manager->clock_ns = fiber_manager_read_clock();
+    manager->clock_yield_count = manager->yield_count;
+  }
+  return manager->clock_ns;
+}
+
+// re-reads the cached clock regardless of the scheduling round
+static inline uint64_t fiber_manager_refresh_clock(fiber_manager_t* manager) {
+  manager->clock_ns = fiber_manager_read_clock();
+  manager->clock_yield_count = manager->yield_count;
+  return manager->clock_ns;
+}
+
+// the number of idle managers, and whether one of them was woken and hasn't
+// looked for work yet. only one wake is in flight at a time; a woken manager
+// which finds work passes the wake on (see fiber_manager_wake_idle()).
+extern _Atomic int fiber_manager_idle_count;
+extern _Atomic int fiber_manager_waking;
+
+// non-zero when fibers are stamped as they become runnable, which the latency
+// stats and the time accounting need (see fiber_manager_options_t)
+extern int fiber_manager_stamp_ready;
+
+// non-zero in thread-per-core mode (see fiber_manager_options_t)
+extern int fiber_manager_thread_per_core;
+
+// wakes one idle manager, preferring those which aren't blocked polling for
+// events. manager is the caller's manager, or NULL outside of a manager thread.
+extern void fiber_manager_wake(fiber_manager_t* manager);
+
+// wakes an idle manager to pick up new work, unless a wake is in flight
+static inline void fiber_manager_wake_idle(fiber_manager_t* manager) {
+  if (fiber_unlikely(atomic_load_explicit(&fiber_manager_idle_count,
+                                          memory_order_relaxed)) &&
+      !atomic_load_explicit(&fiber_manager_waking, memory_order_relaxed)) {
+    fiber_manager_wake(manager);
+  }
+}
+
+static inline int fiber_manager_histogram_bucket(uint64_t ns) {
+  const uint64_t us = ns / 1000;
+  if (!us) {
+    return 0;
+  }
+  const int bucket = 64 - __builtin_clzll(us);
+  return bucket < FIBER_MANAGER_HISTOGRAM_BUCKETS
+             ? bucket
+             : FIBER_MANAGER_HISTOGRAM_BUCKETS - 1;
+}
+
+// records when the_fiber became runnable, for the latency stats and the time
+// accounting. the clock is read afresh: the caller is usually a fiber which
+// woke the_fiber after running since the round's clock was read, and that
+// run isn't the_fiber's latency. does nothing unless one of those is on.
+static inline void fiber_manager_mark_ready(fiber_manager_t* manager,
+                                            fiber_t* the_fiber) {
+  if (fiber_unlikely(fiber_manager_stamp_ready) && !the_fiber->ready_since) {
+    the_fiber->ready_since = fiber_manager_refresh_clock(manager);
+  }
+}
+
+// notes what the running fiber's next wait is for, for the time accounting.
+// waits which don't say are counted as FIBER_TIME_WAIT.
+static inline void fiber_manager_set_wait_kind(fiber_manager_t* manager,
+                                               fiber_time_kind_t kind) {
+  manager->current_fiber->wait_kind = kind;
+}
+
+// returns non-zero if the_fiber has to run on a manager other than this one
+static inline int fiber_manager_is_away(fiber_manager_t* manager,
+                                        fiber_t* the_fiber) {
+  return the_fiber->home_manager >= 0 && the_fiber->home_manager != manager->id;
+}
+
+// hands the_fiber over to its home manager, waking that manager if it's idle.
+// the_fiber must be away from manager.
+extern void fiber_manager_send_home(fiber_manager_t* manager,
+                                    fiber_t* the_fiber);
+
+// schedules the_fiber from a thread which isn't a manager. it goes into a
+// global injection queue which managers drain between fibers, and an idle
+// manager is woken to pick it up.
+extern void fiber_manager_inject(fiber_t* the_fiber);
+
+// returns a zeroed fiber with its lock stats, or NULL with errno set. the
+// fiber and its stats share one cache-aligned block, taken from manager's
+// free blocks when it has any. manager may be NULL outside of a manager
+// thread, in which case the block is always allocated and freed with the
+// system allocator.
+extern fiber_t* fiber_manager_alloc_fiber(fiber_manager_t* manager);
+
+// frees a fiber from fiber_manager_alloc_fiber() and its mpsc node. its
+// context must already be destroyed. the block goes back to the manager which
+// allocated it: straight into manager's free blocks if that's manager itself,
+// otherwise in a batch with other blocks freed by manager.
+extern void fiber_manager_free_fiber(fiber_manager_t* manager,
+                                     fiber_t* the_fiber);
+
+// returns manager's shared stack, creating it if need be, and counts one more
+// fiber on it. returns NULL with errno set if it can't be created, or to
+// EAGAIN if manager is being retired.
+extern fiber_shared_stack_t* fiber_manager_use_shared_stack(
+    fiber_manager_t* manager);
+
+// counts one less fiber on manager's shared stack
+extern void fiber_manager_release_shared_stack(fiber_manager_t* manager);
+
+// whatever other threads use while a fiber waits can't be on its stack if
+// it's a shared one, since the stack holds other fibers' frames by then.
+// returns on_stack, or for a fiber on a shared stack a zeroed allocation of
+// size bytes (NULL if out of memory). give it back with
+// fiber_manager_free_wait_record().
+static inline void* fiber_manager_wait_record(fiber_t* the_fiber,
+                                              void* on_stack, size_t size) {
+  if (fiber_likely(!the_fiber->context.shared_stack)) {
+    return on_stack;
+  }
+  return calloc(1, size);
+}
+
+static inline void fiber_manager_free_wait_record(void* record,
+                                                  void* on_stack) {
+  if (record != on_stack) {
+    free(record);
+  }
+}
+
+// manager is NULL outside of a manager thread
 static inline void fiber_manager_schedule(fiber_manager_t* manager,
                                           fiber_t* the_fiber) {
-  assert(manager);
   assert(the_fiber);
+  if (fiber_unlikely(!manager)) {
+    fiber_manager_inject(the_fiber);
+    return;
+  }
+  if (fiber_unlikely(fiber_manager_thread_per_core) &&
+      the_fiber->home_manager < 0) {
+    // fibers stay with the manager which first schedules them
+    the_fiber->home_manager = manager->id;
+  }
+  fiber_manager_mark_ready(manager, the_fiber);
+  if (fiber_unlikely(fiber_manager_is_away(manager, the_fiber))) {
+    fiber_manager_send_home(manager, the_fiber);
+    return;
+  }
   fiber_scheduler_schedule(manager->scheduler, the_fiber);
+  // pairs with going idle: either the idle manager finds the fiber or we see
+  // that it's idle
+  atomic_thread_fence(memory_order_seq_cst);
+  fiber_manager_wake_idle(manager);
+}
+
+// schedules a fiber which was just woken by the current fiber (ie. through a
+// signal or wait queue) to run next on this manager, keeping the waker and the
+// woken fiber on the same core. a fiber already in the slot is scheduled
+// normally. background fibers and fibers with a home elsewhere don't jump the
+// queue.
+static inline void fiber_manager_schedule_next(fiber_manager_t* manager,
+                                               fiber_t* the_fiber) {
+  assert(the_fiber);
+  if (fiber_unlikely(!manager || the_fiber->priority > FIBER_PRIORITY_NORMAL ||
+                     fiber_manager_is_away(manager, the_fiber))) {
+    fiber_manager_schedule(manager, the_fiber);
+    return;
+  }
+  fiber_manager_mark_ready(manager, the_fiber);
+  fiber_t* const old = atomic_exchange_explicit(&manager->runnext, the_fiber,
+                                                memory_order_acq_rel);
+  if (old) {
+    fiber_manager_schedule(manager, old);
+  }
+  // the slot is stealable: an idle manager takes the fiber if this one keeps
+  // running (see fiber_manager_schedule())
+  atomic_thread_fence(memory_order_seq_cst);
+  fiber_manager_wake_idle(manager);
 }
 
 extern void fiber_manager_yield(fiber_manager_t* manager);
 
 extern fiber_manager_t* fiber_manager_get();
 
+// preempts fibers which run for quantum_ns of CPU time without entering the
+// scheduler; 0 turns preemption off. call it after fiber_manager_init().
+//
+// each manager gets a timer on its thread's CPU clock which sends it
+// FIBER_PREEMPT_SIGNAL every quantum_ns. if the manager hasn't switched fibers
+// since the previous signal, the running fiber is marked and switched out at
+// its next safe point: fiber_preempt_point() or anything which yields. this is
+// cooperative - fibers are never switched from inside the signal handler,
+// since they could be holding locks inside libc, so a fiber which reaches no
+// safe point keeps running however long it takes.
+//
+// the first call which turns preemption on replaces any process-wide handler
+// for FIBER_PREEMPT_SIGNAL; it's restored by fiber_shutdown(). the handler is
+// installed with SA_RESTART, but calls which are never restarted (nanosleep,
+// epoll_wait, ...) can fail with EINTR on manager threads while preemption is
+// on. returns FIBER_ERROR with errno set if the timers can't be set up.
+extern int fiber_manager_set_preemption(uint64_t quantum_ns);
+
+// runs the_fiber, created with fiber_create_no_sched(), on the manager with the
+// given index by making that its home manager. may be called from any thread.
+// returns FIBER_ERROR with errno set to EINVAL if there is no such manager.
+extern int fiber_manager_submit_fiber(int manager, fiber_t* the_fiber);
+
+// like fiber_create(), but the new fiber runs on the manager with the given
+// index. returns NULL with errno set to EINVAL if there is no such manager.
+extern fiber_t* fiber_manager_submit(int manager, size_t stack_size,
+                                     fiber_run_function_t run, void* param);
+
+// yields the fiber marked by the preemption timer
+extern void fiber_manager_preempt(fiber_manager_t* manager);
+
+// a safe point for preemption. loops which can run for a long time without
+// yielding should call this now and then; it's a load and a branch unless the
+// running fiber was marked.
+static inline void fiber_preempt_point() {
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (fiber_unlikely(manager && manager->preempt_requested)) {
+    fiber_manager_preempt(manager);
+  }
+}
+
 /* this should be called immediately when the applicaion starts */
 extern int fiber_manager_init(size_t num_threads);
 
+/* like fiber_manager_init(), using the scheduler backend called scheduler
+   (see fiber_scheduler.h). if scheduler is NULL the FIBER_SCHEDULER
+   environment variable is used, falling back to the default backend. */
+extern int fiber_manager_init_with_scheduler(size_t num_threads,
+                                             const char* scheduler);
+
+typedef struct fiber_manager_options {
+  // see fiber_manager_init_with_scheduler()
+  const char* scheduler;
+  // the most managers fiber_manager_set_thread_count() can grow to. 0 (or
+  // anything less than num_threads) means num_threads.
+  size_t max_threads;
+  // pins manager i's thread (manager 0 being the calling thread) to the i-th
+  // CPU the process may run on, wrapping around if there are more managers
+  int pin_threads;
+  // shared-nothing scheduling: nothing is stolen and every fiber stays with
+  // the manager which first scheduled it (or its home manager, see
+  // fiber_set_home_manager()). fibers woken or submitted by other managers
+  // arrive through a SPSC mailbox per pair of managers, which each manager
+  // polls between fibers. uses the "tpc" scheduler unless another is named.
+  int thread_per_core;
+  // accounts each fiber's time by state at every switch (see
+  // fiber_get_times()), using the scheduling round's clock
+  int account_time;
+  // records how long fibers wait between becoming runnable and running: the
+  // class_latency_* and latency_histogram stats and
+  // fiber_manager_latency_percentile(). stamping a fiber reads the clock each
+  // time it's scheduled, so this is off by default.
+  int track_latency;
+  // the size of each manager's shared stack (see fiber_create_shared()). 0
+  // means FIBER_MANAGER_SHARED_STACK_SIZE.
+  size_t shared_stack_size;
+} fiber_manager_options_t;
+
+#define FIBER_MANAGER_SHARED_STACK_SIZE (1024 * 1024)
+
+/* like fiber_manager_init(), with options. a NULL options uses the defaults,
+   which is what fiber_manager_init() does. */
+extern int fiber_manager_init_with_options(
+    size_t num_threads, const fiber_manager_options_t* options);
+
 extern void fiber_shutdown();
 
 #define FIBER_MANAGER_STATE_NONE (0)
@@ -75,8 +438,38 @@ extern void fiber_shutdown();
 
 extern int fiber_manager_get_state();
 
+// returns the number of active managers, see fiber_manager_set_thread_count()
 extern int fiber_manager_get_kernel_thread_count();
 
+/* Description: changes the number of managers running fibers to num_threads,
+   between 1 and the max_threads given to fiber_manager_init_with_options().
+   managers are numbered from 0, so growing activates the managers with the
+   next indices (starting their threads the first time) and shrinking retires
+   those with the highest indices. manager 0, the thread which called
+   fiber_manager_init(), always stays.
+
+   a retired manager finishes the fiber it's running, then hands every fiber
+   it has queued to the active managers and sleeps. its thread stays around to
+   forward fibers which still arrive later, and to be activated again. fibers
+   whose home manager is retired lose their home manager; in thread-per-core
+   mode they are re-homed on the manager they are handed to.
+
+   returns FIBER_ERROR with errno set to EINVAL if num_threads is out of range
+   or the managers aren't started, or with the error from pthread_create() if
+   a thread can't be started (in which case the managers started so far are
+   active). */
+extern int fiber_manager_set_thread_count(size_t num_threads);
+
+/* Description: starts a thread which adjusts the number of active managers
+   every interval_ns. a manager is added when more fibers are queued than
+   there are active managers and the managers were hardly ever idle; one is
+   retired when the managers spent most of the interval idle, keeping at least
+   min_threads. calling it again changes the settings; an interval_ns of 0
+   stops the auto-scaler. fiber_shutdown() stops it too. returns FIBER_ERROR
+   with errno set if the thread can't be started, or to EINVAL if the
+   managers aren't started. */
+extern int fiber_manager_autoscale(size_t min_threads, uint64_t interval_ns);
+
 extern void fiber_manager_do_maintenance();
 
 extern void fiber_manager_wait_in_mpmc_queue(fiber_manager_t* manager,
@@ -123,6 +516,44 @@ typedef struct fiber_manager_stats {
   uint64_t poll_count;
   uint64_t event_wait_count;
   uint64_t lock_contention_count;
+  uint64_t park_count;
+  uint64_t runnext_count;
+  uint64_t runnext_steal_count;
+  uint64_t sleep_count;
+  uint64_t wake_count;
+  // steals by distance to the victim, indexed by fiber_topology_level_t
+  uint64_t level_steal_count[FIBER_TOPOLOGY_LEVELS];
+  // per priority class, indexed by fiber_priority_t. the queue depth is the
+  // number of fibers queued when the stats were taken. class_latency_max is
+  // the largest over all managers rather than a sum.
+  uint64_t class_queue_depth[FIBER_PRIORITY_CLASSES];
+  uint64_t class_run_count[FIBER_PRIORITY_CLASSES];
+  uint64_t class_latency_sum[FIBER_PRIORITY_CLASSES];
+  uint64_t class_latency_max[FIBER_PRIORITY_CLASSES];
+  // how long fibers waited between being scheduled and running, over all
+  // classes (see FIBER_MANAGER_HISTOGRAM_BUCKETS)
+  uint64_t latency_histogram[FIBER_MANAGER_HISTOGRAM_BUCKETS];
+  uint64_t deadline_miss_count;
+  // fibers switched out by preemption, and how long fibers ran each time they
+  // were switched in (see FIBER_MANAGER_HISTOGRAM_BUCKETS)
+  uint64_t preempt_count;
+  uint64_t run_length_histogram[FIBER_MANAGER_HISTOGRAM_BUCKETS];
+  uint64_t sent_home_count;
+  // nanoseconds managers spent blocked while idle, and how many times
+  // managers were retired (see fiber_manager_set_thread_count())
+  uint64_t idle_ns;
+  uint64_t retire_count;
+  // fibers managers took from the injection queue (see fiber_manager_inject())
+  uint64_t injected_count;
+  // fibers allocated from a manager's free blocks rather than the system
+  // allocator, and blocks sent back to the manager which allocated them (see
+  // fiber_manager_alloc_fiber())
+  uint64_t reused_fiber_count;
+  uint64_t returned_fiber_count;
+  // shared stack fibers copied back onto their manager's stack, and the bytes
+  // copied off of and onto the stacks (see fiber_create_shared())
+  uint64_t stack_copy_count;
+  uint64_t stack_copied_bytes;
 } fiber_manager_stats_t;
 
 // stats are *added* to the values currently in *out
@@ -132,6 +563,24 @@ extern void fiber_manager_stats(fiber_manager_t* manager,
 // stats are *added* to the values currently in *out
 extern void fiber_manager_all_stats(fiber_manager_stats_t* out);
 
+// returns the upper bound, in nanoseconds, of the bucket holding the given
+// percentile (0 to 100) of a histogram with FIBER_MANAGER_HISTOGRAM_BUCKETS
+// buckets. returns UINT64_MAX if that's the last bucket, and 0 if the
+// histogram is empty.
+extern uint64_t fiber_manager_histogram_percentile(const uint64_t* histogram,
+                                                   double percentile);
+
+// merges every manager's scheduling latency histogram into out, which has
+// FIBER_MANAGER_HISTOGRAM_BUCKETS buckets. managers update their histograms
+// without locking, so this is only roughly up to date while fibers run. the
+// histograms stay empty unless track_latency is set (see
+// fiber_manager_options_t).
+extern void fiber_manager_latency_histogram(uint64_t* out);
+
+// the given percentile of the scheduling latency over all managers, as
+// fiber_manager_histogram_percentile() returns it. ie. 99 for the p99.
+extern uint64_t fiber_manager_latency_percentile(double percentile);
+
 #ifdef __cplusplus
 }
 #endif
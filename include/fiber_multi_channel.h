@@ -72,7 +72,7 @@ static inline void fiber_multi_channel_internal_wake(
     channel->waiters = to_wake->scratch;
     to_wake->scratch = NULL;
     to_wake->state = FIBER_STATE_READY;
-    fiber_manager_schedule(fiber_manager_get(), to_wake);
+    fiber_manager_schedule_next(fiber_manager_get(), to_wake);
   }
 }
 
@@ -16,9 +16,12 @@
 
 #include "mpsc_fifo.h"
 
+struct schedule_lock_entry;
+
 typedef struct fiber_mutex {
   _Atomic int counter;
   mpsc_fifo_t waiters;
+  struct schedule_lock_entry* schedule_lock;  // see schedule_lock.h
 } fiber_mutex_t;
 
 #ifdef __cplusplus
@@ -17,10 +17,15 @@ typedef union {
   uint64_t blob;
 } __attribute__((packed)) fiber_rwlock_state_t;
 
+struct schedule_lock_entry;
+
 typedef struct fiber_rwlock {
   fiber_rwlock_state_t state;
   mpsc_fifo_t write_waiters;
   mpsc_fifo_t read_waiters;
+  // one per class (see schedule_lock.h)
+  struct schedule_lock_entry* write_schedule_lock;
+  struct schedule_lock_entry* read_schedule_lock;
 } fiber_rwlock_t;
 
 #ifdef __cplusplus
@@ -4,7 +4,40 @@
 #ifndef _FIBER_SCHEDULER_H_
 #define _FIBER_SCHEDULER_H_
 
+/*
+    Description: Scheduler backends are described by an ops table. The active
+                 backend is chosen once by fiber_scheduler_select() before
+                 fiber_scheduler_init() (fiber_manager_init() does this, see
+                 fiber_manager_init_with_scheduler()) and stays fixed until
+                 fiber_scheduler_shutdown(). The fiber_scheduler_*() functions
+                 dispatch to the active backend.
+
+                 Available backends:
+                   "wsd"  - two work stealing deques per thread (the default)
+                   "dist" - one distinguished FIFO per thread
+                   "edf"  - one locked heap per thread, earliest deadline first
+                   "tpc"  - one unsynchronized FIFO per thread and no stealing,
+                            for thread-per-core mode (see fiber_manager.h)
+
+                 pending() returns non-zero if next() left fibers queued because
+                 they were still switching out on another thread. they become
+                 runnable momentarily, so an idle thread shouldn't go to sleep
+                 on them.
+
+                 Each priority class is queued separately. next() picks from
+                 the classes with fiber_scheduler_priority_t and
+                 load_balance() steals from the highest classes first.
+
+                 stats() adds to the counters passed in. level_steal_count has
+                 FIBER_TOPOLOGY_LEVELS entries, counting fibers stolen from
+                 threads at each distance; backends that ignore topology leave
+                 it untouched. class_queue_depth has FIBER_PRIORITY_CLASSES
+                 entries, counting the fibers currently queued in each class;
+                 backends which can't count their queues leave it untouched.
+*/
+
 #include "fiber.h"
+#include "fiber_topology.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,20 +45,114 @@ extern "C" {
 
 typedef void* fiber_scheduler_t;
 
+typedef struct fiber_scheduler_ops {
+  const char* name;
+  int (*init)(size_t num_threads);
+  void (*shutdown)();
+  fiber_scheduler_t* (*for_thread)(size_t thread_id);
+  void (*schedule)(fiber_scheduler_t* scheduler, fiber_t* the_fiber);
+  fiber_t* (*next)(fiber_scheduler_t* scheduler);
+  void (*load_balance)(fiber_scheduler_t* scheduler);
+  int (*pending)(fiber_scheduler_t* scheduler);
+  void (*stats)(fiber_scheduler_t* scheduler, uint64_t* steal_count,
+                uint64_t* failed_steal_count, uint64_t* level_steal_count,
+                uint64_t* class_queue_depth);
+} fiber_scheduler_ops_t;
+
+// a lower priority class gets a turn after this many fibers from higher
+// classes ran ahead of it
+#define FIBER_SCHEDULER_PRIORITY_AGING (32)
+
+// tracks how long each priority class has been passed over
+typedef struct fiber_scheduler_priority {
+  unsigned int skipped[FIBER_PRIORITY_CLASSES];
+} fiber_scheduler_priority_t;
+
+// returns the lowest class whose turn it is regardless of higher classes, or
+// -1 to pick the highest class with something queued
+static inline int fiber_scheduler_priority_aged(
+    fiber_scheduler_priority_t* priority) {
+  int i;
+  for (i = FIBER_PRIORITY_CLASSES - 1; i > 0; --i) {
+    if (fiber_unlikely(priority->skipped[i] >=
+                       FIBER_SCHEDULER_PRIORITY_AGING)) {
+      // an empty class takes its turn too, which restarts its count
+      priority->skipped[i] = 0;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// records that a fiber from class picked is about to run
+static inline void fiber_scheduler_priority_ran(
+    fiber_scheduler_priority_t* priority, int picked) {
+  priority->skipped[picked] = 0;
+  int i;
+  for (i = picked + 1; i < FIBER_PRIORITY_CLASSES; ++i) {
+    ++priority->skipped[i];
+  }
+}
+
+#define FIBER_SCHEDULER_DEFAULT "wsd"
+#define FIBER_SCHEDULER_ENV "FIBER_SCHEDULER"
+
+extern const fiber_scheduler_ops_t fiber_scheduler_wsd_ops;
+extern const fiber_scheduler_ops_t fiber_scheduler_dist_ops;
+extern const fiber_scheduler_ops_t fiber_scheduler_edf_ops;
+extern const fiber_scheduler_ops_t fiber_scheduler_tpc_ops;
+
+// the active backend
+extern const fiber_scheduler_ops_t* fiber_scheduler_ops;
+
+// "wsd" only, and only from the thread which owns scheduler: rebuilds its
+// steal victim order and copies it, nearest first, into victims, with the CPU
+// each victim was sorted by in victim_cpus. both need room for every other
+// thread. sets *cpu to this thread's CPU and returns the number of victims.
+size_t fiber_scheduler_wsd_victims(fiber_scheduler_t* scheduler, int* cpu,
+                                   size_t* victims, int* victim_cpus);
+
+// returns the backend called name, or NULL if there is none
+const fiber_scheduler_ops_t* fiber_scheduler_find(const char* name);
+
+// makes the backend called name active. name may be NULL for the default.
+// returns FIBER_ERROR with errno set to EINVAL if the backend doesn't exist,
+// or to EBUSY if the scheduler is already initialized.
+int fiber_scheduler_select(const char* name);
+
 int fiber_scheduler_init(size_t num_threads);
 
 void fiber_scheduler_shutdown();
 
-fiber_scheduler_t* fiber_scheduler_for_thread(size_t thread_id);
+static inline fiber_scheduler_t* fiber_scheduler_for_thread(size_t thread_id) {
+  return fiber_scheduler_ops->for_thread(thread_id);
+}
+
+static inline void fiber_scheduler_schedule(fiber_scheduler_t* scheduler,
+                                            fiber_t* the_fiber) {
+  fiber_scheduler_ops->schedule(scheduler, the_fiber);
+}
 
-void fiber_scheduler_schedule(fiber_scheduler_t* scheduler, fiber_t* the_fiber);
+static inline fiber_t* fiber_scheduler_next(fiber_scheduler_t* scheduler) {
+  return fiber_scheduler_ops->next(scheduler);
+}
 
-fiber_t* fiber_scheduler_next(fiber_scheduler_t* scheduler);
+static inline void fiber_scheduler_load_balance(fiber_scheduler_t* scheduler) {
+  fiber_scheduler_ops->load_balance(scheduler);
+}
 
-void fiber_scheduler_load_balance(fiber_scheduler_t* scheduler);
+static inline int fiber_scheduler_pending(fiber_scheduler_t* scheduler) {
+  return fiber_scheduler_ops->pending(scheduler);
+}
 
-void fiber_scheduler_stats(fiber_scheduler_t* scheduler, uint64_t* steal_count,
-                           uint64_t* failed_steal_count);
+static inline void fiber_scheduler_stats(fiber_scheduler_t* scheduler,
+                                         uint64_t* steal_count,
+                                         uint64_t* failed_steal_count,
+                                         uint64_t* level_steal_count,
+                                         uint64_t* class_queue_depth) {
+  fiber_scheduler_ops->stats(scheduler, steal_count, failed_steal_count,
+                             level_steal_count, class_queue_depth);
+}
 
 #ifdef __cplusplus
 }
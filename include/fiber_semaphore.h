@@ -23,6 +23,7 @@ extern int fiber_semaphore_wait(fiber_semaphore_t* semaphore);
 
 extern int fiber_semaphore_trywait(fiber_semaphore_t* semaphore);
 
+// may be called from threads which aren't fiber managers
 extern int fiber_semaphore_post(fiber_semaphore_t* semaphore);
 
 extern int fiber_semaphore_getvalue(fiber_semaphore_t* semaphore);
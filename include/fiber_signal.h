@@ -70,7 +70,7 @@ static inline int fiber_signal_raise(fiber_signal_t* s) {
       manager->signal_spin_count += 1;
     }
     old->state = FIBER_STATE_READY;
-    fiber_manager_schedule(manager, old);
+    fiber_manager_schedule_next(manager, old);
     return 1;
   }
   return 0;
@@ -199,7 +199,7 @@ static inline int fiber_multi_signal_raise(fiber_multi_signal_t* s) {
           manager->multi_signal_spin_count += 1;
         }
         to_wake->state = FIBER_STATE_READY;
-        fiber_manager_schedule(manager, to_wake);
+        fiber_manager_schedule_next(manager, to_wake);
         return 1;
       }
     }
@@ -238,7 +238,7 @@ static inline void fiber_multi_signal_raise_strict(fiber_multi_signal_t* s) {
           manager->multi_signal_spin_count += 1;
         }
         to_wake->state = FIBER_STATE_READY;
-        fiber_manager_schedule(manager, to_wake);
+        fiber_manager_schedule_next(manager, to_wake);
         return;
       }
     }
@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _FIBER_STACK_POOL_H_
+#define _FIBER_STACK_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Description: mmap'd fiber stacks, each with a guard page at its low end.
+                 fiber_context_init() takes its stacks from here when fibers
+                 are built with FIBER_STACK_MMAP.
+
+                 Stacks come in FIBER_STACK_POOL_CLASSES size classes of 2,
+                 4, 8 ... 256 pages, and freed stacks are kept ready for
+                 reuse rather than unmapped. Each thread (ie. each fiber
+                 manager) has a cache per class which takes no locks. A
+                 thread which frees more stacks than its cache holds moves
+                 half of them to a global pool, which a thread that runs out
+                 refills from. Stacks which don't fit in the global pool
+                 either are unmapped. Stacks too large for any class are
+                 always mapped and unmapped.
+
+                 Stacks are mapped with MAP_NORESERVE, so a large stack only
+                 takes memory for the pages a fiber touches. With
+                 fiber_stack_pool_set_reclaim(), stacks also give pages back
+                 to the kernel when they're freed: each thread tracks how
+                 deep the stacks of each class usually get, and a stack that
+                 went deeper than that has the pages below the usual depth
+                 released with madvise(). A fiber which went deep and is
+                 about to wait for a long time can do the same for its own
+                 stack with fiber_trim_stack().
+*/
+
+#define FIBER_STACK_POOL_CLASSES (8)
+// the default limits, per class (see fiber_stack_pool_set_limits())
+#define FIBER_STACK_POOL_LOCAL_LIMIT (32)
+#define FIBER_STACK_POOL_GLOBAL_LIMIT (256)
+
+typedef struct fiber_stack_pool_stats {
+  uint64_t hit_count;         // stacks reused from the thread's own cache
+  uint64_t global_hit_count;  // stacks reused from the global pool
+  uint64_t miss_count;        // stacks mapped because no pool had one
+  uint64_t unmap_count;       // stacks unmapped because the pools were full
+  uint64_t cached_count;      // stacks held by the pools right now
+  uint64_t trim_count;        // stacks which released pages
+  uint64_t trimmed_bytes;     // bytes released by those stacks
+} fiber_stack_pool_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// returns a stack of at least stack_size usable bytes, setting *size to its
+// size including the guard page. returns NULL with errno set if mapping fails.
+extern void* fiber_stack_pool_get(size_t stack_size, size_t* size);
+
+// gives back a stack from fiber_stack_pool_get(), with the size it returned
+extern void fiber_stack_pool_put(void* stack, size_t size);
+
+// the most stacks each thread caches, and the most the global pool holds, per
+// size class. 0 turns that level of caching off. caches above the new limits
+// shrink the next time a stack is freed to them.
+extern void fiber_stack_pool_set_limits(size_t local_limit,
+                                        size_t global_limit);
+
+// turns reclaiming freed stacks' pages on or off (it's off by default). lazy
+// releases pages with MADV_FREE where it's available, which is cheaper but
+// leaves them counted in the process's RSS until the kernel needs them.
+extern void fiber_stack_pool_set_reclaim(int enabled, int lazy);
+
+// releases the pages of a stack from fiber_stack_pool_get() below its top
+// keep bytes, leaving the guard page alone. returns the number of bytes
+// released. the pages read as zeroes the next time they're touched.
+extern size_t fiber_stack_pool_trim(void* stack, size_t size, size_t keep);
+
+// stats are summed over all threads, including those which exited. threads
+// update their own counts without locking, so they're only roughly up to
+// date while fibers are being created.
+extern void fiber_stack_pool_stats(fiber_stack_pool_stats_t* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _FIBER_STACK_PROFILE_H_
+#define _FIBER_STACK_PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fiber_context.h"
+
+/*
+    Description: measures how deep fibers' stacks really get, and optionally
+                 sizes new stacks from that.
+
+                 While profiling is on, every new fiber's stack is filled
+                 with a canary pattern (see fiber_context_fill_canary()), and
+                 when the fiber is destroyed the depth it reached is added to
+                 a histogram for its creation site: the run function it was
+                 created with. With auto-sizing on too, fibers created with
+                 fiber_create() and friends get a stack of the site's 99th
+                 percentile depth plus a margin instead of the size they
+                 asked for, once the site has FIBER_STACK_PROFILE_MIN_SAMPLES
+                 samples.
+
+                 Filling a stack touches all of it, so profiling costs memory
+                 and time at every fiber creation; it's meant for finding
+                 the right sizes rather than for running with all the time.
+                 Only builds with assembly context switching can fill stacks.
+*/
+
+// the most sites which are told apart. fibers from any more aren't profiled.
+#define FIBER_STACK_PROFILE_SITES (64)
+// depths are counted in buckets of this many bytes. the last bucket also
+// counts anything deeper.
+#define FIBER_STACK_PROFILE_BUCKET_SIZE (1024)
+#define FIBER_STACK_PROFILE_BUCKETS (256)
+#define FIBER_STACK_PROFILE_MIN_SAMPLES (64)
+#define FIBER_STACK_PROFILE_MARGIN (16 * 1024)
+
+typedef struct fiber_stack_profile_stats {
+  uint64_t count;    // fibers measured
+  size_t max_depth;  // in bytes
+  // the upper bound of the bucket holding the 99th percentile depth
+  size_t p99_depth;
+  // the stack size auto-sizing gives the site's fibers, 0 until it has
+  // FIBER_STACK_PROFILE_MIN_SAMPLES samples
+  size_t auto_size;
+} fiber_stack_profile_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// turns profiling on or off for fibers created from now on
+extern void fiber_stack_profile_enable(int enabled);
+
+extern int fiber_stack_profile_enabled();
+
+// turns auto-sizing on or off. a 0 margin means FIBER_STACK_PROFILE_MARGIN.
+extern void fiber_stack_profile_auto_size(int enabled, size_t margin);
+
+// adds a fiber created at site which reached depth bytes
+extern void fiber_stack_profile_record(fiber_run_function_t site,
+                                       size_t depth);
+
+// the stack size to give a new fiber created at site which asked for
+// stack_size
+extern size_t fiber_stack_profile_size(fiber_run_function_t site,
+                                       size_t stack_size);
+
+// returns FIBER_ERROR if site has no samples
+extern int fiber_stack_profile_get(fiber_run_function_t site,
+                                   fiber_stack_profile_stats_t* out);
+
+// writes up to max sites with samples to sites, returning how many it wrote
+extern size_t fiber_stack_profile_sites(fiber_run_function_t* sites,
+                                        size_t max);
+
+// forgets every sample
+extern void fiber_stack_profile_reset();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
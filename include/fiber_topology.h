@@ -0,0 +1,48 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#ifndef _FIBER_TOPOLOGY_H_
+#define _FIBER_TOPOLOGY_H_
+
+/*
+    Description: The CPU topology as reported by sysfs
+                 (/sys/devices/system/cpu), read once by fiber_topology_init().
+                 Two CPUs are at the nearest level they share: the same core
+                 (SMT siblings), the same last level cache, the same NUMA node
+                 or nothing at all (remote). Without sysfs every pair of
+                 distinct CPUs is remote.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum fiber_topology_level {
+  FIBER_TOPOLOGY_SMT = 0,
+  FIBER_TOPOLOGY_LLC,
+  FIBER_TOPOLOGY_NODE,
+  FIBER_TOPOLOGY_REMOTE,
+  FIBER_TOPOLOGY_LEVELS,
+} fiber_topology_level_t;
+
+// safe to call more than once. returns FIBER_ERROR only if out of memory.
+extern int fiber_topology_init();
+
+extern void fiber_topology_shutdown();
+
+// the number of CPUs described, or 0 before fiber_topology_init()
+extern int fiber_topology_cpu_count();
+
+// the NUMA node of cpu, or -1 if unknown
+extern int fiber_topology_node(int cpu);
+
+// unknown CPUs (ie. -1) are remote to everything
+extern fiber_topology_level_t fiber_topology_distance(int cpu_a, int cpu_b);
+
+extern const char* fiber_topology_level_name(fiber_topology_level_t level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,13 +1,176 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
 #ifndef _SCHEDULER_LOCK_H_
 #define _SCHEDULER_LOCK_H_
 
-#include <stdlib.h>
+/*
+    Description: Scheduler-cooperative locks (SCL). Every lock gets an
+                 entry from schedule_lock_create(), which the lock keeps a
+                 pointer to. The entry tracks the lock's current owner, the
+                 lock slice of the most recent owner and how much of that
+                 slice was used. A fiber that releases a lock after its slice
+                 has expired while other fibers are waiting is banned from that
+                 lock for (slice usage * number of waiters). The ban only holds
+                 a fiber back while it contends on that same lock; fibers
+                 using other locks (or no lock at all) are never gated. Times
+                 are CLOCK_MONOTONIC nanoseconds.
+
+                 Each lock keeps an EWMA of its critical section lengths and
+                 sizes its slice to SCHEDULE_LOCK_SLICE_FACTOR hold times, so
+                 at most one in SCHEDULE_LOCK_SLICE_FACTOR acquisitions ends a
+                 slice regardless of how long the critical sections are. A
+                 fiber with a non-zero lock_stats_t slice_size overrides this.
+
+                 Nothing here slows down a lock nobody waits for: the fast path
+                 touches no shared counters, and a hold which starts with no
+                 fiber waiting is timed with the manager's cached clock (see
+                 fiber_manager_clock()). The clock is only read afresh once
+                 someone waits, and only holds which someone waited for, at
+                 either end, shape the slice.
+
+                 Reader-writer locks register one entry per class: the write
+                 class is keyed by the lock and behaves like a mutex, while the
+                 shared read class is keyed separately and linked to it as its
+                 peer. Readers run in parallel; their class is charged for the
+                 wall time during which any reader holds the lock. A writer
+                 whose slice expired while others wait is banned from writing
+                 only, with the waiting readers counting as one more waiter.
+                 When a read phase outlasts its slice while a writer waits,
+                 the whole read class is banned for as long as it held the
+                 lock, so writers get a bounded, fair share.
+*/
+
+#include <stdint.h>
+
+#include "fiber.h"
+#include "fiber_manager.h"
+#include "machine_specific.h"
+
+#define SCHEDULE_LOCK_SLICE_FACTOR (16)
+#define SCHEDULE_LOCK_MIN_SLICE (2000)     // 2us
+#define SCHEDULE_LOCK_MAX_SLICE (2000000)  // 2ms
+// weight of a new hold time sample is 1 / 2^SCHEDULE_LOCK_EWMA_SHIFT
+#define SCHEDULE_LOCK_EWMA_SHIFT (3)
+
+typedef struct schedule_lock_entry {
+  void* lock;  // what banned_lock in lock_stats_t refers to the lock by
+  _Atomic(fiber_t*) owner;
+  _Atomic int contenders;  // fibers trying to acquire, excluding the owner
+  _Atomic int holders;     // fibers holding a shared lock
+  _Atomic uint64_t banned_until;  // class-wide ban, only used when shared
+  struct schedule_lock_entry* peer;  // the other class of a reader-writer lock
+  int shared;
+  // the fields below are protected by the lock itself
+  fiber_t* slice_owner;
+  uint64_t acquired_at;
+  uint64_t slice_end;
+  uint64_t slice_usage;
+  uint64_t hold_ewma;
+  uint64_t slice_size;
+  int timed;  // whether the current hold was timed with a fresh clock read
+  _Atomic uint64_t acquire_count;
+  _Atomic uint64_t ban_count;
+} __attribute__((__aligned__(FIBER_CACHELINE_SIZE))) schedule_lock_entry_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// allocates lock's entry. returns NULL with errno set to ENOMEM if out of
+// memory.
+extern schedule_lock_entry_t* schedule_lock_create(void* lock);
+
+// creates the shared (read) class of a reader-writer lock whose write class
+// is peer. peer may be NULL.
+extern schedule_lock_entry_t* schedule_lock_create_shared(
+    void* lock, schedule_lock_entry_t* peer);
+
+// entry may be NULL
+extern void schedule_lock_destroy(schedule_lock_entry_t* entry);
+
+// returns the fiber currently holding the lock, or NULL. entry may be NULL.
+static inline fiber_t* schedule_lock_owner(schedule_lock_entry_t* entry) {
+  return entry ? atomic_load_explicit(&entry->owner, memory_order_acquire)
+               : NULL;
+}
+
+extern void schedule_lock_wait_out_ban(schedule_lock_entry_t* entry);
+
+// called before trying to acquire the lock. if the calling fiber is banned
+// from this lock and someone else wants the lock then this waits out the ban.
+// entry may be NULL.
+static inline void schedule_lock_enter(schedule_lock_entry_t* entry) {
+  if (!entry) {
+    return;
+  }
+  // nobody can be banned from a lock which never banned anyone
+  if (fiber_likely(
+          !atomic_load_explicit(&entry->ban_count, memory_order_relaxed))) {
+    return;
+  }
+  schedule_lock_wait_out_ban(entry);
+}
+
+// called once trying to acquire the lock failed, before waiting for it.
+// entry may be NULL.
+static inline void schedule_lock_contend(schedule_lock_entry_t* entry) {
+  if (entry) {
+    atomic_fetch_add(&entry->contenders, 1);
+  }
+}
+
+// called once the lock is held. contended must be 1 if schedule_lock_contend()
+// was called first. entry may be NULL.
+extern void schedule_lock_acquired(schedule_lock_entry_t* entry,
+                                   int contended);
+
+// called right before the lock is released. this may be called from a fiber
+// other than the owner (ie. during maintenance). entry may be NULL.
+extern void schedule_lock_released(schedule_lock_entry_t* entry);
+
+// the shared class equivalents of schedule_lock_acquired() and
+// schedule_lock_released(). entry may be NULL.
+extern void schedule_lock_shared_acquired(schedule_lock_entry_t* entry,
+                                          int contended);
+
+extern void schedule_lock_shared_released(schedule_lock_entry_t* entry);
+
+// returns 1 if a fiber other than the calling contender holds or wants the
+// lock (or, for a reader-writer lock, the other class does)
+static inline int schedule_lock_is_wanted(schedule_lock_entry_t* entry) {
+  if (!entry->shared &&
+      (atomic_load_explicit(&entry->owner, memory_order_acquire) ||
+       atomic_load_explicit(&entry->contenders, memory_order_acquire) > 1)) {
+    return 1;
+  }
+  schedule_lock_entry_t* const peer = entry->peer;
+  return peer &&
+         (atomic_load_explicit(&peer->owner, memory_order_acquire) ||
+          atomic_load_explicit(&peer->holders, memory_order_acquire) ||
+          atomic_load_explicit(&peer->contenders, memory_order_acquire));
+}
 
-extern int lock_using;
+// returns 1 if the_fiber is waiting out a ban on a lock which is still wanted
+// by another fiber. used by the scheduler to skip over banned fibers, so the
+// common case (the fiber isn't waiting out a ban) doesn't read the clock.
+static inline int schedule_lock_fiber_is_banned(fiber_manager_t* manager,
+                                                fiber_t* the_fiber) {
+  lock_stats_t* const stats = the_fiber->fiber_stats;
+  schedule_lock_entry_t* const entry = stats->contending;
+  if (fiber_likely(!entry)) {
+    return 0;
+  }
+  if (fiber_manager_clock(manager) >=
+      atomic_load_explicit(&stats->banned_until, memory_order_relaxed)) {
+    return 0;
+  }
+  // only enforce the ban while someone else holds or wants the lock
+  return schedule_lock_is_wanted(entry);
+}
 
-extern void add_lock();
-extern void init_scheduler_lock_data();
-extern int is_lock_using();
-extern void set_lock_status();
+#ifdef __cplusplus
+}
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -95,6 +95,15 @@ extern void* wsd_work_stealing_deque_pop_bottom(wsd_work_stealing_deque_t* d);
 
 extern void* wsd_work_stealing_deque_steal(wsd_work_stealing_deque_t* d);
 
+/* moves up to half of d (rounded up, at most max items) from its top to the
+   bottom of to, oldest first. to must be owned by the caller. each item is
+   claimed with its own CAS since the owner pops without one. returns the
+   number of items moved; this may be fewer than requested if d is emptied or
+   contended concurrently. */
+extern size_t wsd_work_stealing_deque_steal_half(wsd_work_stealing_deque_t* d,
+                                                 wsd_work_stealing_deque_t* to,
+                                                 size_t max);
+
 #ifdef __cplusplus
 }
 #endif
@@ -10,6 +10,7 @@
 #include <unistd.h>
 
 #include "fiber_manager.h"
+#include "fiber_stack_profile.h"
 #include "mpmc_lifo.h"
 
 void fiber_mark_completed(fiber_t* the_fiber, void* result) {
@@ -36,6 +37,10 @@ void fiber_mark_completed(fiber_t* the_fiber, void* result) {
 }
 
 static void fiber_join_routine(fiber_t* the_fiber, void* result) {
+  if (the_fiber->deadline &&
+      fiber_manager_read_clock() > the_fiber->deadline) {
+    fiber_manager_get()->deadline_miss_count += 1;
+  }
   fiber_mark_completed(the_fiber, result);
   fiber_manager_get()->done_fiber = the_fiber;
   fiber_manager_yield(fiber_manager_get());
@@ -60,77 +65,142 @@ fiber_go_function(void* param) {
   return NULL;
 }
 
-fiber_t* fiber_create_no_sched(size_t stack_size,
-                               fiber_run_function_t run_function, void* param) {
-  fiber_t* ret = calloc(1, sizeof(*ret));
+// allocates a ready fiber, without its context
+static fiber_t* fiber_new(fiber_manager_t* manager,
+                          fiber_run_function_t run_function, void* param) {
+  fiber_t* const ret = fiber_manager_alloc_fiber(manager);
   if (!ret) {
-    errno = ENOMEM;
     return NULL;
   }
+  // the mpsc node isn't part of the block, since mpsc FIFOs hand each popped
+  // fiber a different node than the one it was pushed with
   ret->mpsc_fifo_node = calloc(1, sizeof(*ret->mpsc_fifo_node));
   if (!ret->mpsc_fifo_node) {
-    free(ret);
+    fiber_manager_free_fiber(manager, ret);
     errno = ENOMEM;
     return NULL;
   }
-  ret->fiber_stats = calloc(1, sizeof(*ret->fiber_stats));
-  (ret->fiber_stats)->banned_until.tv_sec  = 0;
-  (ret->fiber_stats)->banned_until.tv_usec = 0;
-  
-  (ret->fiber_stats)->slice_size.tv_sec  = 0;
-  (ret->fiber_stats)->slice_size.tv_usec = 2;   // 2us is the slice Size
+  // the zeroed lock stats mean each lock's adaptive slice is used
 
   ret->run_function = run_function;
   ret->param = param;
+  ret->priority = FIBER_PRIORITY_NORMAL;
+  ret->home_manager = -1;
+  ret->wait_kind = FIBER_TIME_WAIT;
   ret->state = FIBER_STATE_READY;
   ret->detach_state = FIBER_DETACH_NONE;
   ret->join_info = NULL;
   ret->result = NULL;
   ret->id += 1;
+  return ret;
+}
+
+fiber_t* fiber_create_no_sched(size_t stack_size,
+                               fiber_run_function_t run_function, void* param) {
+  fiber_manager_t* const manager = fiber_manager_get();
+  fiber_t* const ret = fiber_new(manager, run_function, param);
+  if (!ret) {
+    return NULL;
+  }
+  stack_size = fiber_stack_profile_size(run_function, stack_size);
   if (FIBER_SUCCESS !=
       fiber_context_init(&ret->context, stack_size, &fiber_go_function, ret)) {
-    free(ret);
+    fiber_manager_free_fiber(manager, ret);
     return NULL;
   }
+  if (fiber_unlikely(fiber_stack_profile_enabled())) {
+    fiber_context_fill_canary(&ret->context);
+  }
 
   return ret;
 }
 
+// new fibers work towards the same deadline as their creator. threads which
+// aren't managers inject them instead (see fiber_manager_inject()).
+static void fiber_schedule_new(fiber_t* the_fiber) {
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (manager && manager->current_fiber) {
+    the_fiber->deadline = manager->current_fiber->deadline;
+  }
+  fiber_manager_schedule(manager, the_fiber);
+}
+
 fiber_t* fiber_create(size_t stack_size, fiber_run_function_t run_function,
                       void* param) {
   fiber_t* const ret = fiber_create_no_sched(stack_size, run_function, param);
   if (ret) {
-    fiber_manager_schedule(fiber_manager_get(), ret);
+    fiber_schedule_new(ret);
+  }
+  return ret;
+}
+
+fiber_t* fiber_create_with_priority(size_t stack_size,
+                                    fiber_run_function_t run_function,
+                                    void* param, fiber_priority_t priority) {
+  if (priority < 0 || priority >= FIBER_PRIORITY_CLASSES) {
+    errno = EINVAL;
+    return NULL;
+  }
+  fiber_t* const ret = fiber_create_no_sched(stack_size, run_function, param);
+  if (ret) {
+    ret->priority = priority;
+    fiber_schedule_new(ret);
   }
   return ret;
 }
 
+fiber_t* fiber_create_shared(fiber_run_function_t run_function,
+                             void* param) {
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager) {
+    errno = EINVAL;
+    return NULL;
+  }
+  fiber_shared_stack_t* const shared = fiber_manager_use_shared_stack(manager);
+  if (!shared) {
+    return NULL;
+  }
+  fiber_t* const ret = fiber_new(manager, run_function, param);
+  if (!ret) {
+    fiber_manager_release_shared_stack(manager);
+    return NULL;
+  }
+  // its frames can only be copied back to this manager's stack
+  ret->home_manager = manager->id;
+  if (FIBER_SUCCESS != fiber_context_init_shared(&ret->context, shared,
+                                                 &fiber_go_function, ret)) {
+    fiber_manager_free_fiber(manager, ret);
+    fiber_manager_release_shared_stack(manager);
+    return NULL;
+  }
+  fiber_schedule_new(ret);
+  return ret;
+}
+
 fiber_t* fiber_create_from_thread() {
-  fiber_t* const ret = calloc(1, sizeof(*ret));
+  // the thread's fiber lives as long as its manager, so it isn't worth
+  // caching
+  fiber_t* const ret = fiber_manager_alloc_fiber(NULL);
   if (!ret) {
-    errno = ENOMEM;
     return NULL;
   }
   ret->mpsc_fifo_node = calloc(1, sizeof(*ret->mpsc_fifo_node));
   if (!ret->mpsc_fifo_node) {
-    free(ret);
+    fiber_manager_free_fiber(NULL, ret);
     errno = ENOMEM;
     return NULL;
   }
-  
-  ret->fiber_stats = calloc(1, sizeof(*ret->fiber_stats));
-  ret->fiber_stats->banned_until.tv_sec  = 0;
-  ret->fiber_stats->banned_until.tv_usec = 0;
-  ret->fiber_stats->slice_size.tv_sec    = 0;
-  ret->fiber_stats->slice_size.tv_usec   = 2;   // 2us is the slice Size
 
+  ret->priority = FIBER_PRIORITY_NORMAL;
+  ret->home_manager = -1;
+  ret->wait_kind = FIBER_TIME_WAIT;
   ret->state = FIBER_STATE_RUNNING;
   ret->detach_state = FIBER_DETACH_NONE;
   ret->join_info = NULL;
   ret->result = NULL;
   ret->id = 1;
   if (FIBER_SUCCESS != fiber_context_init_from_thread(&ret->context)) {
-    free(ret);
+    fiber_manager_free_fiber(NULL, ret);
     return NULL;
   }
   return ret;
@@ -213,6 +283,14 @@ int fiber_yield() {
   return 1;
 }
 
+size_t fiber_trim_stack() {
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager) {
+    return 0;
+  }
+  return fiber_context_trim_stack(&manager->current_fiber->context);
+}
+
 int fiber_detach(fiber_t* f) {
   if (!f) {
     return FIBER_ERROR;
@@ -233,16 +311,84 @@ int fiber_detach(fiber_t* f) {
   return FIBER_SUCCESS;
 }
 
-  /* Lock Stats for Scheduler-v2 */
-  
-  lock_stats_t* get_lock_stats(fiber_t* fiber){
-    return fiber -> fiber_stats;
+int fiber_set_priority(fiber_t* f, fiber_priority_t priority) {
+  assert(f);
+  if (priority < 0 || priority >= FIBER_PRIORITY_CLASSES) {
+    errno = EINVAL;
+    return FIBER_ERROR;
   }
-  void set_lock_stats(fiber_t* fiber, struct timeval* banned_until, struct timeval* slice_size){
-    if (banned_until != NULL)
-    {
-      (fiber->fiber_stats)->banned_until = *banned_until;}
-    if (slice_size != NULL){
-      (fiber->fiber_stats)->slice_size = *slice_size;}
+  f->priority = priority;
+  return FIBER_SUCCESS;
+}
+
+fiber_priority_t fiber_get_priority(fiber_t* f) {
+  assert(f);
+  return f->priority;
+}
+
+const char* fiber_priority_name(fiber_priority_t priority) {
+  static const char* const names[FIBER_PRIORITY_CLASSES] = {
+      "latency", "normal", "background"};
+  assert(priority >= 0 && priority < FIBER_PRIORITY_CLASSES);
+  return names[priority];
+}
+
+void fiber_get_times(fiber_t* f, uint64_t* times) {
+  assert(f);
+  assert(times);
+  memcpy(times, f->times, sizeof(f->times));
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (manager && manager->current_fiber == f && f->time_since) {
+    const uint64_t now = fiber_manager_read_clock();
+    if (now > f->time_since) {
+      times[f->time_kind] += now - f->time_since;
+    }
   }
+}
 
+const char* fiber_time_kind_name(fiber_time_kind_t kind) {
+  static const char* const names[FIBER_TIME_KINDS] = {
+      "running", "ready", "lock", "io", "sleep", "wait"};
+  assert(kind >= 0 && kind < FIBER_TIME_KINDS);
+  return names[kind];
+}
+
+void fiber_set_deadline(fiber_t* f, uint64_t deadline) {
+  assert(f);
+  f->deadline = deadline;
+}
+
+uint64_t fiber_get_deadline(fiber_t* f) {
+  assert(f);
+  return f->deadline;
+}
+
+int fiber_set_home_manager(fiber_t* f, int manager) {
+  assert(f);
+  if (manager < -1 || manager >= fiber_manager_get_kernel_thread_count() ||
+      (f->context.shared_stack && manager != f->home_manager)) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  f->home_manager = manager;
+  return FIBER_SUCCESS;
+}
+
+int fiber_get_home_manager(fiber_t* f) {
+  assert(f);
+  return f->home_manager;
+}
+
+/* Lock Stats for Scheduler-v2 */
+
+lock_stats_t* get_lock_stats(fiber_t* fiber) { return fiber->fiber_stats; }
+
+void set_lock_stats(fiber_t* fiber, const uint64_t* banned_until,
+                    const uint64_t* slice_size) {
+  if (banned_until) {
+    fiber->fiber_stats->banned_until = *banned_until;
+  }
+  if (slice_size) {
+    fiber->fiber_stats->slice_size = *slice_size;
+  }
+}
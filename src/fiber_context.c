@@ -6,13 +6,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 #include "machine_specific.h"
-#ifdef FIBER_STACK_MALLOC
-#include <stdlib.h>
+#ifdef FIBER_STACK_MMAP
+#include "fiber_stack_pool.h"
 #endif
 
 #ifdef USE_VALGRIND
@@ -40,10 +41,6 @@
 #include <sanitizer/tsan_interface.h>
 #endif
 
-#ifndef MAP_ANONYMOUS
-#define MAP_ANONYMOUS MAP_ANON
-#endif
-
 #ifdef FIBER_STACK_SPLIT
 // see http://gcc.gnu.org/svn/gcc/trunk/libgcc/generic-morestack.c
 extern void __splitstack_block_signals_context(splitstack_context_t context,
@@ -56,21 +53,6 @@ extern void* __splitstack_makecontext(size_t stack_size,
 extern void __splitstack_releasecontext(splitstack_context_t context);
 #endif
 
-#ifdef FIBER_STACK_MMAP
-static long fiberPageSize = 0;
-static size_t fiber_round_to_page_size(size_t size) {
-  if (!fiberPageSize) {
-    fiberPageSize = sysconf(_SC_PAGESIZE);
-    fiberPageSize -= 50;  // account for overhead for page info strucures (i
-                          // don't know the actual size, this is a guess)
-  }
-  // minimum of 2 pages, we'll use one as a sentinel
-  const size_t numPages = size / fiberPageSize + 1;
-  const size_t numPagesAfterMin = numPages >= 2 ? numPages : 2;
-  return fiberPageSize * numPagesAfterMin;
-}
-#endif
-
 // allocates a stack and sets context->ctx_stack and context->ctx_stack_size
 static int fiber_context_alloc_stack(fiber_context_t* context,
                                      size_t stack_size) {
@@ -83,17 +65,9 @@ static int fiber_context_alloc_stack(fiber_context_t* context,
   context->ctx_stack = malloc(stack_size);
   context->ctx_stack_size = stack_size;
 #elif defined(FIBER_STACK_MMAP)
-  context->ctx_stack_size = fiber_round_to_page_size(stack_size);
-  context->ctx_stack = mmap(0, context->ctx_stack_size, PROT_READ | PROT_WRITE,
-                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (context->ctx_stack == MAP_FAILED) {
-    return 0;
-  }
-
-  if (mprotect(context->ctx_stack, 1, PROT_NONE)) {
-    munmap(context->ctx_stack, context->ctx_stack_size);
-    return 0;
-  }
+  // the lowest page is a guard page
+  context->ctx_stack =
+      fiber_stack_pool_get(stack_size, &context->ctx_stack_size);
 #else
 #error select a stack allocation strategy
 #endif
@@ -106,13 +80,74 @@ static void fiber_free_stack(fiber_context_t* context) {
 #elif defined(FIBER_STACK_MALLOC)
   free(context->ctx_stack);
 #elif defined(FIBER_STACK_MMAP)
-  munmap(context->ctx_stack, context->ctx_stack_size);
+  fiber_stack_pool_put(context->ctx_stack, context->ctx_stack_size);
 #else
 #error select a stack allocation strategy
 #endif
 }
 
+// room left below the stack pointer for the calls which do the trimming
+#define FIBER_CONTEXT_TRIM_MARGIN (4096)
+
+size_t fiber_context_trim_stack(fiber_context_t* context) {
+  assert(context);
+#if defined(FIBER_STACK_MMAP)
+  if (context->is_thread) {
+    return 0;
+  }
+  char dummy;
+  char* const top = (char*)context->ctx_stack + context->ctx_stack_size;
+  assert(&dummy > (char*)context->ctx_stack && &dummy < top);
+  const size_t keep = top - &dummy + FIBER_CONTEXT_TRIM_MARGIN;
+  return fiber_stack_pool_trim(context->ctx_stack, context->ctx_stack_size,
+                               keep);
+#else
+  // split and malloc'd stacks aren't page aligned
+  return 0;
+#endif
+}
+
+// the 16 byte aligned top of a stack, just above a new context's first frame
+static inline void** fiber_context_stack_top(void* stack, size_t size) {
+  void** const top = (void**)((char*)stack + size) - 1;
+  return (void**)((uintptr_t)top & ~0x0f);
+}
+
+// contexts on a shared stack are switched to through the stack's copier while
+// another context's frames are on it
+static inline fiber_context_t* fiber_context_route(fiber_context_t* context) {
+  fiber_shared_stack_t* const shared = context->shared_stack;
+  if (!shared || shared->occupant == context) {
+    return context;
+  }
+  shared->copy_to = context;
+  return &shared->copier;
+}
+
+static void fiber_context_leave_shared(fiber_context_t* context) {
+  // the frames of an occupant which is going away are simply dropped
+  if (context->shared_stack->occupant == context) {
+    context->shared_stack->occupant = NULL;
+  }
+  free(context->saved_stack);
+}
+
 #if defined(__GNUC__) && defined(__i386__) && defined(FIBER_FAST_SWITCHING)
+#define FIBER_CONTEXT_ASM_SWITCHING
+
+// pushes a new context's first frame below top, returning its stack pointer
+static void** fiber_context_push_frame(void** top,
+                                       fiber_run_function_t run_function,
+                                       void* param) {
+  void** sp = top;
+  --sp;  // sp must be decremented a-multiple-of-4 times to maintain 16 byte
+         // alignement. this decrement is a dummy/filler decrement
+  *--sp = param;
+  *--sp = NULL; /*dummy return address*/
+  *--sp = (void*)run_function;
+  assert(((uintptr_t)sp & 0x0f) == 0);  // verify 16 byte alignment
+  return sp;
+}
 
 int fiber_context_init(fiber_context_t* context, size_t stack_size,
                        fiber_run_function_t run_function, void* param) {
@@ -125,20 +160,9 @@ int fiber_context_init(fiber_context_t* context, size_t stack_size,
     return FIBER_ERROR;
   }
 
-  context->ctx_stack_pointer =
-      (void**)((char*)context->ctx_stack + context->ctx_stack_size) - 1;
-  context->ctx_stack_pointer = (void*)((uintptr_t)context->ctx_stack_pointer &
-                                       ~0x0f);  // 16 byte stack alignment
-  --context->ctx_stack_pointer;  // ctx_stack_pointer must be decremented
-                                 // a-multiple-of-4 times to maintain 16 byte
-                                 // alignement. this decrement is a dummy/filler
-                                 // decrement
-  *--context->ctx_stack_pointer = param;
-  *--context->ctx_stack_pointer = NULL; /*dummy return address*/
-  *--context->ctx_stack_pointer = (void*)run_function;
-
-  assert(((uintptr_t)context->ctx_stack_pointer & 0x0f) ==
-         0);  // verify 16 byte alignment
+  context->ctx_stack_pointer = fiber_context_push_frame(
+      fiber_context_stack_top(context->ctx_stack, context->ctx_stack_size),
+      run_function, param);
 
   STACK_REGISTER(context, context->ctx_stack, context->ctx_stack_size);
 
@@ -157,7 +181,9 @@ int fiber_context_init_from_thread(fiber_context_t* context) {
 }
 
 void fiber_context_destroy(fiber_context_t* context) {
-  if (context && !context->is_thread) {
+  if (context && context->shared_stack) {
+    fiber_context_leave_shared(context);
+  } else if (context && !context->is_thread) {
     STACK_DEREGISTER(context);
     fiber_free_stack(context);
   }
@@ -167,6 +193,7 @@ void fiber_context_swap(fiber_context_t* from_context,
                         fiber_context_t* to_context) {
   assert(from_context);
   assert(to_context);
+  to_context = fiber_context_route(to_context);
 
   void*** const from_sp = &from_context->ctx_stack_pointer;
   void** const to_sp = to_context->ctx_stack_pointer;
@@ -260,6 +287,27 @@ void fiber_context_swap(fiber_context_t* from_context,
 
 #elif defined(__x86_64__) && defined(FIBER_FAST_SWITCHING)
 #include <stdlib.h>
+#define FIBER_CONTEXT_ASM_SWITCHING
+
+// pushes a new context's first frame below top, returning its stack pointer
+static void** fiber_context_push_frame(void** top,
+                                       fiber_run_function_t run_function,
+                                       void* param) {
+  void** sp = top;
+  --sp;  // sp must be decremented an even number of times to maintain 16 byte
+         // alignement. this decrement is a dummy/filler decrement
+  *--sp = param;
+  *--sp = NULL; /*dummy return address*/
+  *--sp = (void*)run_function;
+  *--sp = 0;  // rbp
+  *--sp = 0;  // rbx
+  *--sp = 0;  // r12
+  *--sp = 0;  // r13
+  *--sp = 0;  // r14
+  *--sp = 0;  // r15
+  assert(((uintptr_t)sp & 0x0f) == 0);  // verify 16 byte alignment
+  return sp;
+}
 
 int fiber_context_init(fiber_context_t* context, size_t stack_size,
                        fiber_run_function_t run_function, void* param) {
@@ -272,26 +320,9 @@ int fiber_context_init(fiber_context_t* context, size_t stack_size,
     return FIBER_ERROR;
   }
 
-  context->ctx_stack_pointer =
-      (void**)((char*)context->ctx_stack + context->ctx_stack_size) - 1;
-  context->ctx_stack_pointer = (void*)((uintptr_t)context->ctx_stack_pointer &
-                                       ~0x0f);  // 16 byte stack alignment
-  --context
-        ->ctx_stack_pointer;  // ctx_stack_pointer must be decremented an even
-                              // number of times to maintain 16 byte alignement.
-                              // this decrement is a dummy/filler decrement
-  *--context->ctx_stack_pointer = param;
-  *--context->ctx_stack_pointer = NULL; /*dummy return address*/
-  *--context->ctx_stack_pointer = (void*)run_function;
-  *--context->ctx_stack_pointer = 0;    // rbp
-  *--context->ctx_stack_pointer = 0;    // rbx
-  *--context->ctx_stack_pointer = 0;    // r12
-  *--context->ctx_stack_pointer = 0;    // r13
-  *--context->ctx_stack_pointer = 0;    // r14
-  *--context->ctx_stack_pointer = 0;    // r15
-
-  assert(((uintptr_t)context->ctx_stack_pointer & 0x0f) ==
-         0);  // verify 16 byte alignment
+  context->ctx_stack_pointer = fiber_context_push_frame(
+      fiber_context_stack_top(context->ctx_stack, context->ctx_stack_size),
+      run_function, param);
 
   STACK_REGISTER(context, context->ctx_stack, context->ctx_stack_size);
 
@@ -317,7 +348,12 @@ int fiber_context_init_from_thread(fiber_context_t* context) {
 }
 
 void fiber_context_destroy(fiber_context_t* context) {
-  if (context && !context->is_thread) {
+  if (context && context->shared_stack) {
+    fiber_context_leave_shared(context);
+#if __SANITIZE_THREAD__
+    __tsan_destroy_fiber(context->tsan_fiber);
+#endif
+  } else if (context && !context->is_thread) {
     STACK_DEREGISTER(context);
     fiber_free_stack(context);
 #if __SANITIZE_THREAD__
@@ -330,6 +366,7 @@ void fiber_context_swap(fiber_context_t* from_context,
                         fiber_context_t* to_context) {
   assert(from_context);
   assert(to_context);
+  to_context = fiber_context_route(to_context);
   void*** const from_sp = &from_context->ctx_stack_pointer;
   void** const to_sp = to_context->ctx_stack_pointer;
 #if __SANITIZE_THREAD__
@@ -520,3 +557,169 @@ void fiber_context_swap(fiber_context_t* from_context,
 }
 
 #endif
+
+// the copier needs little more than memcpy() and realloc()
+#define FIBER_SHARED_STACK_COPIER_SIZE (64 * 1024)
+
+#if defined(FIBER_CONTEXT_ASM_SWITCHING) && !defined(FIBER_STACK_SPLIT)
+
+static void* fiber_shared_stack_copier(void* param) {
+  fiber_shared_stack_t* const shared = (fiber_shared_stack_t*)param;
+  while (1) {
+    fiber_context_t* const occupant = shared->occupant;
+    if (occupant) {
+      const size_t size = shared->top - (char*)occupant->ctx_stack_pointer;
+      // grow to fit, and shrink once the stack is much shallower
+      if (size > occupant->saved_capacity ||
+          size < occupant->saved_capacity / 4) {
+        void* const saved = realloc(occupant->saved_stack, size);
+        if (!saved) {
+          // the occupant's frames would be lost
+          abort();
+        }
+        occupant->saved_stack = saved;
+        occupant->saved_capacity = size;
+      }
+      memcpy(occupant->saved_stack, occupant->ctx_stack_pointer, size);
+      occupant->saved_size = size;
+      shared->copied_bytes += size;
+    }
+    fiber_context_t* const to = shared->copy_to;
+    assert((char*)to->ctx_stack_pointer == shared->top - to->saved_size);
+    memcpy(to->ctx_stack_pointer, to->saved_stack, to->saved_size);
+    shared->copied_bytes += to->saved_size;
+    shared->copy_count += 1;
+    shared->occupant = to;
+    fiber_context_swap(&shared->copier, to);
+  }
+  return NULL;
+}
+
+fiber_shared_stack_t* fiber_shared_stack_create(size_t stack_size) {
+  fiber_shared_stack_t* const shared = calloc(1, sizeof(*shared));
+  if (!shared) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (!fiber_context_alloc_stack(&shared->region, stack_size)) {
+    free(shared);
+    errno = ENOMEM;
+    return NULL;
+  }
+  STACK_REGISTER(&shared->region, shared->region.ctx_stack,
+                 shared->region.ctx_stack_size);
+  shared->top = (char*)fiber_context_stack_top(shared->region.ctx_stack,
+                                               shared->region.ctx_stack_size);
+  if (FIBER_SUCCESS != fiber_context_init(&shared->copier,
+                                          FIBER_SHARED_STACK_COPIER_SIZE,
+                                          &fiber_shared_stack_copier, shared)) {
+    STACK_DEREGISTER(&shared->region);
+    fiber_free_stack(&shared->region);
+    free(shared);
+    return NULL;
+  }
+  return shared;
+}
+
+void fiber_shared_stack_destroy(fiber_shared_stack_t* shared) {
+  if (shared) {
+    fiber_context_destroy(&shared->copier);
+    STACK_DEREGISTER(&shared->region);
+    fiber_free_stack(&shared->region);
+    free(shared);
+  }
+}
+
+int fiber_context_init_shared(fiber_context_t* context,
+                              fiber_shared_stack_t* shared,
+                              fiber_run_function_t run_function, void* param) {
+  if (!context || !shared || !run_function) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  // the first frame is built in a buffer aligned like the stack's top, then
+  // kept as if the context had already been switched out
+  void* frame[16] __attribute__((__aligned__(16)));
+  void** const frame_top = frame + sizeof(frame) / sizeof(*frame);
+  void** const sp = fiber_context_push_frame(frame_top, run_function, param);
+  const size_t size = (char*)frame_top - (char*)sp;
+  memset(context, 0, sizeof(*context));
+  context->saved_stack = malloc(size);
+  if (!context->saved_stack) {
+    errno = ENOMEM;
+    return FIBER_ERROR;
+  }
+  memcpy(context->saved_stack, sp, size);
+  context->saved_size = size;
+  context->saved_capacity = size;
+  context->ctx_stack_pointer = (void**)(shared->top - size);
+  context->shared_stack = shared;
+#if __SANITIZE_THREAD__
+  context->tsan_fiber = __tsan_create_fiber(0);
+#endif
+  return FIBER_SUCCESS;
+}
+
+#else
+
+fiber_shared_stack_t* fiber_shared_stack_create(size_t stack_size) {
+  errno = ENOTSUP;
+  return NULL;
+}
+
+void fiber_shared_stack_destroy(fiber_shared_stack_t* shared) {}
+
+int fiber_context_init_shared(fiber_context_t* context,
+                              fiber_shared_stack_t* shared,
+                              fiber_run_function_t run_function, void* param) {
+  errno = ENOTSUP;
+  return FIBER_ERROR;
+}
+
+#endif
+
+#ifdef FIBER_CONTEXT_ASM_SWITCHING
+
+// the lowest address of context's stack a fiber can use
+static uintptr_t* fiber_context_stack_bottom(const fiber_context_t* context) {
+#if defined(FIBER_STACK_MMAP)
+  // skip the guard page
+  return (uintptr_t*)((char*)context->ctx_stack + sysconf(_SC_PAGESIZE));
+#else
+  return (uintptr_t*)context->ctx_stack;
+#endif
+}
+
+void fiber_context_fill_canary(fiber_context_t* context) {
+  assert(context);
+  if (context->is_thread || context->shared_stack) {
+    return;
+  }
+  uintptr_t* word = fiber_context_stack_bottom(context);
+  uintptr_t* const end = (uintptr_t*)context->ctx_stack_pointer;
+  while (word < end) {
+    *word++ = FIBER_CONTEXT_CANARY;
+  }
+  context->has_canary = 1;
+}
+
+size_t fiber_context_stack_depth(const fiber_context_t* context) {
+  assert(context);
+  if (!context->has_canary) {
+    return 0;
+  }
+  const uintptr_t* word = fiber_context_stack_bottom(context);
+  const uintptr_t* const end = (uintptr_t*)context->ctx_stack_pointer;
+  while (word < end && *word == FIBER_CONTEXT_CANARY) {
+    ++word;
+  }
+  return (char*)context->ctx_stack + context->ctx_stack_size - (char*)word;
+}
+
+#else
+
+void fiber_context_fill_canary(fiber_context_t* context) {}
+
+size_t fiber_context_stack_depth(const fiber_context_t* context) { return 0; }
+
+#endif
@@ -2,7 +2,9 @@
 // SPDX-License-Identifier: MIT
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "fiber.h"
@@ -21,6 +23,11 @@ static struct ev_loop* volatile fiber_loop = NULL;
 static fiber_spinlock_t fiber_loop_spinlock = FIBER_SPINLOCK_INITIALIER;
 static volatile int num_events_triggered = 0;
 static _Atomic int active_threads = 0;
+static ev_async wake_watcher;
+
+static void wake_ready(struct ev_loop* loop, ev_async* watcher, int revents) {
+  // nothing - the wake only needs to interrupt ev_run()
+}
 
 int fiber_event_init() {
   fiber_spinlock_lock(&fiber_loop_spinlock);
@@ -34,8 +41,13 @@ int fiber_event_init() {
                     // fiber_poll_events_blocking - active_threads should never
                     // be decremented before it's been set)
 
-  fiber_loop = ev_loop_new(EVFLAG_AUTO);
-  assert(fiber_loop);
+  struct ev_loop* const loop = ev_loop_new(EVFLAG_AUTO);
+  assert(loop);
+  memset(&wake_watcher, 0, sizeof(wake_watcher));
+  ev_set_cb(&wake_watcher, &wake_ready);
+  ev_async_set(&wake_watcher);
+  ev_async_start(loop, &wake_watcher);
+  fiber_loop = loop;
 
   fiber_spinlock_unlock(&fiber_loop_spinlock);
 
@@ -75,6 +87,11 @@ int fiber_poll_events() {
 }
 
 size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds) {
+  if (seconds == FIBER_POLL_FOREVER) {
+    // only the polling thread can be woken, the others sleep in short steps
+    seconds = 0;
+    useconds = FIBER_TIME_RESOLUTION_MS * 1000;
+  }
   if (!fiber_loop) {
     fiber_do_real_sleep(seconds, useconds);
     return 0;
@@ -113,6 +130,15 @@ size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds) {
   return local_copy;
 }
 
+int fiber_event_wake() {
+  struct ev_loop* const loop = fiber_loop;
+  if (!loop) {
+    return FIBER_ERROR;
+  }
+  ev_async_send(loop, &wake_watcher);
+  return FIBER_SUCCESS;
+}
+
 static void fd_ready(struct ev_loop* loop, ev_io* watcher, int revents) {
   ev_io_stop(loop, watcher);
   fiber_manager_t* const manager = fiber_manager_get();
@@ -123,7 +149,14 @@ static void fd_ready(struct ev_loop* loop, ev_io* watcher, int revents) {
 }
 
 int fiber_wait_for_event(int fd, uint32_t events) {
-  ev_io fd_event = {};
+  ev_io on_stack = {};
+  fiber_t* const this_fiber = fiber_manager_get()->current_fiber;
+  ev_io* const fd_event =
+      fiber_manager_wait_record(this_fiber, &on_stack, sizeof(on_stack));
+  if (!fd_event) {
+    errno = ENOMEM;
+    return FIBER_ERROR;
+  }
   int poll_events = 0;
   if (events & FIBER_POLL_IN) {
     poll_events |= EV_READ;
@@ -133,23 +166,24 @@ int fiber_wait_for_event(int fd, uint32_t events) {
   }
   // this code should really use ev_io_init(), but ev_io_init has compile
   // warnings.
-  ev_set_cb(&fd_event, &fd_ready);
-  ev_io_set(&fd_event, fd, poll_events);
+  ev_set_cb(fd_event, &fd_ready);
+  ev_io_set(fd_event, fd, poll_events);
 
   fiber_spinlock_lock(&fiber_loop_spinlock);
 
   fiber_manager_t* const manager = fiber_manager_get();
   manager->event_wait_count += 1;
-  fiber_t* const this_fiber = manager->current_fiber;
 
-  fd_event.data = this_fiber;
-  ev_io_start(fiber_loop, &fd_event);
+  fd_event->data = this_fiber;
+  ev_io_start(fiber_loop, fd_event);
 
+  fiber_manager_set_wait_kind(manager, FIBER_TIME_IO);
   this_fiber->state = FIBER_STATE_WAITING;
   manager->spinlock_to_unlock = &fiber_loop_spinlock;
 
   fiber_manager_yield(manager);
 
+  fiber_manager_free_wait_record(fd_event, &on_stack);
   return FIBER_SUCCESS;
 }
 
@@ -171,26 +205,34 @@ int fiber_sleep(uint32_t seconds, uint32_t useconds) {
 
   // this code should really use ev_timer_init(), but ev_timer_init has compile
   // warnings.
-  ev_timer timer_event = {};
-  ev_set_cb(&timer_event, &timer_trigger);
+  ev_timer on_stack = {};
+  fiber_t* const this_fiber = fiber_manager_get()->current_fiber;
+  ev_timer* const timer_event =
+      fiber_manager_wait_record(this_fiber, &on_stack, sizeof(on_stack));
+  if (!timer_event) {
+    errno = ENOMEM;
+    return FIBER_ERROR;
+  }
+  ev_set_cb(timer_event, &timer_trigger);
   const double sleep_time = seconds + useconds * 0.000001;
-  timer_event.at = sleep_time;
-  timer_event.repeat = 0;
+  timer_event->at = sleep_time;
+  timer_event->repeat = 0;
 
   fiber_spinlock_lock(&fiber_loop_spinlock);
 
   fiber_manager_t* const manager = fiber_manager_get();
-  fiber_t* const this_fiber = manager->current_fiber;
 
-  timer_event.data = this_fiber;
+  timer_event->data = this_fiber;
 
-  ev_timer_start(fiber_loop, &timer_event);
+  ev_timer_start(fiber_loop, timer_event);
 
+  fiber_manager_set_wait_kind(manager, FIBER_TIME_SLEEP);
   this_fiber->state = FIBER_STATE_WAITING;
   manager->spinlock_to_unlock = &fiber_loop_spinlock;
 
   fiber_manager_yield(manager);
 
+  fiber_manager_free_wait_record(timer_event, &on_stack);
   return FIBER_SUCCESS;
 }
 
@@ -13,6 +13,7 @@
 #include "fiber_spinlock.h"
 #if defined(__linux__)
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #elif defined(SOLARIS)
 #include <port.h>
@@ -37,8 +38,15 @@ static uint64_t timer_trigger_count = 0;
 
 #if defined(__linux__)
 static int timer_fd = -1;
+// the timer only runs while there are sleepers, so an idle process isn't
+// woken every FIBER_TIME_RESOLUTION_MS. protected by sleep_spinlock.
+static int timer_armed = 0;
+// written by fiber_event_wake() to interrupt a blocking poll
+static int wake_fd = -1;
 typedef ssize_t (*readFnType)(int, void*, size_t);
 static readFnType fibershim_read = NULL;
+typedef ssize_t (*writeFnType)(int, const void*, size_t);
+static writeFnType fibershim_write = NULL;
 #elif defined(SOLARIS)
 static timer_t timer_id = -1;
 static hrtime_t last_timer_trigger = 0;
@@ -112,23 +120,25 @@ int fiber_event_init() {
   assert(wait_info);
 
 #if defined(__linux__)
+  // created disarmed, see fiber_event_arm_timer()
   timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
   assert(timer_fd >= 0);
-  struct itimerspec in = {};
-  in.it_interval.tv_nsec = FIBER_TIME_RESOLUTION_MS * 1000000;  // ms
-  in.it_value.tv_nsec = FIBER_TIME_RESOLUTION_MS * 1000000;     // ms
-  struct itimerspec out;
-  int ret = timerfd_settime(timer_fd, 0, &in, &out);
-  assert(!ret);
+  timer_armed = 0;
+  wake_fd = eventfd(0, EFD_NONBLOCK);
+  assert(wake_fd >= 0);
 
   fibershim_read = (readFnType)fiber_load_symbol("read");
+  fibershim_write = (writeFnType)fiber_load_symbol("write");
 
   const int the_event_fd = epoll_create(1);
   assert(the_event_fd >= 0);
   struct epoll_event e = {};
   e.events = EPOLLIN;
   e.data.fd = timer_fd;
-  ret = epoll_ctl(the_event_fd, EPOLL_CTL_ADD, timer_fd, &e);
+  int ret = epoll_ctl(the_event_fd, EPOLL_CTL_ADD, timer_fd, &e);
+  assert(!ret);
+  e.data.fd = wake_fd;
+  ret = epoll_ctl(the_event_fd, EPOLL_CTL_ADD, wake_fd, &e);
   assert(!ret);
 #elif defined(SOLARIS)
   const int the_event_fd = port_create();
@@ -168,6 +178,8 @@ void fiber_event_shutdown() {
 #if defined(__linux__)
   close(timer_fd);
   timer_fd = -1;
+  close(wake_fd);
+  wake_fd = -1;
   close(event_fd);
   event_fd = -1;
 #elif defined(SOLARIS)
@@ -183,6 +195,24 @@ void fiber_event_shutdown() {
   wait_info = NULL;
 }
 
+#if defined(__linux__)
+// must be called with sleep_spinlock held
+static void fiber_event_arm_timer(int armed) {
+  if (armed == timer_armed) {
+    return;
+  }
+  struct itimerspec in = {};
+  if (armed) {
+    in.it_interval.tv_nsec = FIBER_TIME_RESOLUTION_MS * 1000000;  // ms
+    in.it_value.tv_nsec = FIBER_TIME_RESOLUTION_MS * 1000000;     // ms
+  }
+  const int ret = timerfd_settime(timer_fd, 0, &in, NULL);
+  (void)ret;
+  assert(!ret);
+  timer_armed = armed;
+}
+#endif
+
 static void fiber_event_wake_waiters(fiber_manager_t* manager,
                                      fd_wait_info_t* info, intptr_t result) {
   while (info->waiters) {
@@ -200,25 +230,47 @@ static void fiber_event_wake_sleepers(fiber_manager_t* manager,
   fiber_spinlock_lock(&sleep_spinlock);
   timer_trigger_count += trigger_count;
 
+  // collect the sleepers first and schedule them once the lock is released,
+  // since waking an idle manager can let it run before we unlock
+  waiter_el_t* woken = NULL;
   waiter_el_t* to_wake = NULL;
   while ((to_wake = waiter_remove_less_than(&sleepers, timer_trigger_count))) {
-    do {
-      assert(to_wake->waiter);
-      fiber_t* const to_schedule = (fiber_t*)to_wake->waiter;
-      to_schedule->state = FIBER_STATE_READY;
-      fiber_manager_schedule(manager, to_schedule);
-      to_wake = to_wake->next;
-    } while (to_wake);
+    waiter_el_t* last = to_wake;
+    while (last->next) {
+      last = last->next;
+    }
+    last->next = woken;
+    woken = to_wake;
   }
+#if defined(__linux__)
+  if (!sleepers) {
+    fiber_event_arm_timer(0);
+  }
+#endif
 
   fiber_spinlock_unlock(&sleep_spinlock);
+
+  while (woken) {
+    assert(woken->waiter);
+    fiber_t* const to_schedule = (fiber_t*)woken->waiter;
+    // woken lives on the sleeper's stack, which is reused as soon as the
+    // sleeper runs
+    woken = woken->next;
+    to_schedule->state = FIBER_STATE_READY;
+    fiber_manager_schedule(manager, to_schedule);
+  }
 }
 
+// wakes from fiber_event_wake() are meant for the blocking poll, so
+// non-blocking polls leave them in place and none of them are counted as events
 static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds) {
+  const int blocking = seconds || useconds;
 #if defined(__linux__)
   struct epoll_event events[64];
-  const int count =
-      epoll_wait(event_fd, events, 64, seconds * 1000 + useconds / 1000);
+  const int timeout_ms = seconds == FIBER_POLL_FOREVER
+                             ? -1
+                             : (int)(seconds * 1000 + useconds / 1000);
+  const int count = epoll_wait(event_fd, events, 64, timeout_ms);
   if (count < 0) {
     if (errno ==
         EINTR) {  // interrupted, just try again later (could be gdb'ing etc)
@@ -232,6 +284,7 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds) {
   }
   fiber_manager_t* const manager = fiber_manager_get();
   manager->poll_count += 1;
+  int num_events = count;
   int i;
   for (i = 0; i < count; ++i) {
     const int the_fd = events[i].data.fd;
@@ -244,6 +297,14 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds) {
         continue;
       }
       fiber_event_wake_sleepers(manager, timer_count);
+    } else if (the_fd == wake_fd) {
+      --num_events;
+      if (blocking) {
+        uint64_t wake_count = 0;
+        const int ret =
+            fibershim_read(wake_fd, &wake_count, sizeof(wake_count));
+        (void)ret;
+      }
     } else {
       fd_wait_info_t* const info = &wait_info[the_fd];
       fiber_spinlock_lock(&info->spinlock);
@@ -259,15 +320,18 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds) {
       fiber_spinlock_unlock(&info->spinlock);
     }
   }
-  return count;
+  return num_events;
 #elif defined(SOLARIS)
   port_event_t events[64];
   uint_t nget = 1;
   errno = 0;
   timespec_t timeout = {seconds, useconds * 1000};
-  const int ret = port_getn(event_fd, events, 64, &nget, &timeout);
+  const int ret =
+      port_getn(event_fd, events, 64, &nget,
+                seconds == FIBER_POLL_FOREVER ? NULL : &timeout);
   fiber_manager_t* const manager = fiber_manager_get();
   manager->poll_count += 1;
+  int num_events = nget;
   uint_t i;
   for (i = 0; i < nget; ++i) {
     port_event_t* const this_event = &events[i];
@@ -277,6 +341,12 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds) {
           (now - last_timer_trigger) / (FIBER_TIME_RESOLUTION_MS * 1000000);
       last_timer_trigger += timer_count * (FIBER_TIME_RESOLUTION_MS * 1000000);
       fiber_event_wake_sleepers(manager, timer_count);
+    } else if (this_event->portev_source == PORT_SOURCE_USER) {
+      --num_events;
+      if (!blocking) {
+        // pass the wake on to the blocking poll
+        port_send(event_fd, 0, NULL);
+      }
     } else if (this_event->portev_source == PORT_SOURCE_FD) {
       fd_wait_info_t* const info = &wait_info[this_event->portev_object];
       fiber_spinlock_lock(&info->spinlock);
@@ -297,7 +367,7 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds) {
     (void)ret;
     abort();
   }
-  return nget;
+  return num_events;
 #else
 #error OS not supported
 #endif
@@ -313,6 +383,10 @@ int fiber_poll_events() {
 
 size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds) {
   if (event_fd < 0) {
+    if (seconds == FIBER_POLL_FOREVER) {
+      seconds = 0;
+      useconds = FIBER_TIME_RESOLUTION_MS * 1000;
+    }
     fiber_do_real_sleep(seconds, useconds);
     return 0;
   }
@@ -320,6 +394,22 @@ size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds) {
   return fiber_poll_events_internal(seconds, useconds);
 }
 
+int fiber_event_wake() {
+  if (event_fd < 0) {
+    return FIBER_ERROR;
+  }
+#if defined(__linux__)
+  const uint64_t one = 1;
+  const ssize_t ret = fibershim_write(wake_fd, &one, sizeof(one));
+  // EAGAIN means the counter is saturated, so a wake is already pending
+  return ret == sizeof(one) || errno == EAGAIN ? FIBER_SUCCESS : FIBER_ERROR;
+#elif defined(SOLARIS)
+  return port_send(event_fd, 0, NULL) ? FIBER_ERROR : FIBER_SUCCESS;
+#else
+#error OS not supported
+#endif
+}
+
 int fiber_wait_for_event(int fd, uint32_t events) {
   assert(fd >= 0);
   assert(fd < max_fd);
@@ -362,6 +452,7 @@ int fiber_wait_for_event(int fd, uint32_t events) {
   this_fiber->scratch =
       info->waiters;  // use scratch field as a linked list of waiters
   info->waiters = this_fiber;
+  fiber_manager_set_wait_kind(manager, FIBER_TIME_IO);
   this_fiber->state = FIBER_STATE_WAITING;
   manager->spinlock_to_unlock = &info->spinlock;
   fiber_manager_yield(manager);
@@ -378,21 +469,32 @@ int fiber_sleep(uint32_t seconds, uint32_t useconds) {
   }
 
   const uint64_t sleep_ms = seconds * 1000 + useconds / 1000 + 1;  // ms
-  waiter_el_t wake_info = {};
+  waiter_el_t on_stack = {};
+  fiber_manager_t* const manager = fiber_manager_get();
+  fiber_t* const this_fiber = manager->current_fiber;
+  waiter_el_t* const wake_info =
+      fiber_manager_wait_record(this_fiber, &on_stack, sizeof(on_stack));
+  if (!wake_info) {
+    errno = ENOMEM;
+    return FIBER_ERROR;
+  }
 
   fiber_spinlock_lock(&sleep_spinlock);
 
   const uint64_t wake_time = timer_trigger_count + sleep_ms;
-  wake_info.wake_time = wake_time;
-  waiter_insert(&sleepers, &wake_info);
+  wake_info->wake_time = wake_time;
+  waiter_insert(&sleepers, wake_info);
+#if defined(__linux__)
+  fiber_event_arm_timer(1);
+#endif
 
-  fiber_manager_t* const manager = fiber_manager_get();
-  fiber_t* const this_fiber = manager->current_fiber;
-  wake_info.waiter = this_fiber;
+  wake_info->waiter = this_fiber;
+  fiber_manager_set_wait_kind(manager, FIBER_TIME_SLEEP);
   this_fiber->state = FIBER_STATE_WAITING;
   manager->spinlock_to_unlock = &sleep_spinlock;
   fiber_manager_yield(manager);
 
+  fiber_manager_free_wait_record(wake_info, &on_stack);
   return FIBER_SUCCESS;
 }
 
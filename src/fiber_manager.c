@@ -1,11 +1,16 @@
 // SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
 // SPDX-License-Identifier: MIT
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // for SIGEV_THREAD_ID
+#endif
+
 #include "fiber_manager.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +18,7 @@
 
 #include "fiber_event.h"
 #include "fiber_io.h"
+#include "fiber_stack_profile.h"
 #include "mpmc_lifo.h"
 #ifndef __USE_GNU
 #define __USE_GNU
@@ -22,6 +28,14 @@
 #include "lockfree_ring_buffer.h"
 #include "schedule_lock.h"
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
 #ifdef FIBER_STACK_SPLIT
 void __splitstack_block_signals(int* new, int* old);
 
@@ -38,20 +52,159 @@ void splitstack_disable_block_signals() {
 #define FIBER_MANAGER_MAX_HAZARDS (MPMC_HAZARD_COUNT)
 
 static int fiber_manager_state = FIBER_MANAGER_STATE_NONE;
+// the number of managers created by fiber_manager_init(). the first
+// fiber_manager_active_threads of them run fibers, and the first
+// fiber_manager_started_threads have threads (see
+// fiber_manager_set_thread_count()).
 static int fiber_manager_num_threads = 0;
+static _Atomic int fiber_manager_active_threads = 0;
+static int fiber_manager_started_threads = 0;
 static pthread_t* fiber_manager_threads = NULL;
 static __thread volatile pthread_t this_thread;
 static fiber_manager_t** fiber_managers = NULL;
 static volatile int fiber_shutting_down = 0;
 static _Atomic(lockfree_ring_buffer_t*) fiber_free_mpmc_nodes = NULL;
-static _Atomic(hazard_pointer_thread_record_t*) fiber_hazard_head = NULL; 
+static _Atomic(hazard_pointer_thread_record_t*) fiber_hazard_head = NULL;
+_Atomic int fiber_manager_idle_count = 0;
+_Atomic int fiber_manager_waking = 0;
+int fiber_manager_thread_per_core = 0;
+// see fiber_manager_options_t.account_time
+static int fiber_manager_account_time = 0;
+static int fiber_manager_track_latency = 0;
+int fiber_manager_stamp_ready = 0;
+static size_t fiber_manager_shared_stack_size = FIBER_MANAGER_SHARED_STACK_SIZE;
+// the idle manager blocked in fiber_poll_events_blocking(), if any
+static _Atomic(fiber_manager_t*) fiber_manager_poller = NULL;
+// fibers scheduled by threads which aren't managers (see
+// fiber_manager_inject()). any thread pushes; only the manager holding
+// fiber_manager_injected_lock pops. fiber_manager_injected_count lets managers
+// check for work without touching the queue.
+static mpsc_fifo_t fiber_manager_injected;
+static _Atomic int fiber_manager_injected_lock = 0;
+static _Atomic int fiber_manager_injected_count = 0;
+
+// managers keep at most this many free fiber blocks, and send blocks back to
+// the managers which allocated them this many at a time
+#define FIBER_MANAGER_MAX_FREE_FIBERS (256)
+#define FIBER_MANAGER_FIBER_BATCH (32)
+
+typedef struct fiber_block {
+  fiber_t fiber;  // first, so a fiber's address is its block's
+  lock_stats_t stats;
+  struct fiber_block* next;  // only while the block is free
+  int owner;  // the manager which allocated the block, -1 if there was none
+} __attribute__((__aligned__(FIBER_CACHELINE_SIZE))) fiber_block_t;
+
+static void fiber_manager_free_blocks(fiber_block_t* block) {
+  while (block) {
+    fiber_block_t* const next = block->next;
+    free(block);
+    block = next;
+  }
+}
+
+// pushes manager's return batch onto its owner's returned_fibers
+static void fiber_manager_flush_return_batch(fiber_manager_t* manager) {
+  if (!manager->return_batch) {
+    return;
+  }
+  fiber_manager_t* const owner = fiber_managers[manager->return_batch_owner];
+  fiber_block_t* head =
+      atomic_load_explicit(&owner->returned_fibers, memory_order_relaxed);
+  do {
+    manager->return_batch_tail->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &owner->returned_fibers, &head, manager->return_batch,
+      memory_order_release, memory_order_relaxed));
+  manager->returned_fiber_count += manager->return_batch_count;
+  manager->return_batch = NULL;
+  manager->return_batch_tail = NULL;
+  manager->return_batch_count = 0;
+}
+
+fiber_t* fiber_manager_alloc_fiber(fiber_manager_t* manager) {
+  fiber_block_t* block = NULL;
+  if (manager) {
+    if (!manager->free_fibers &&
+        atomic_load_explicit(&manager->returned_fibers, memory_order_relaxed)) {
+      // the owner takes every returned block at once, so popping can't ABA
+      manager->free_fibers = atomic_exchange_explicit(
+          &manager->returned_fibers, NULL, memory_order_acquire);
+      for (block = manager->free_fibers; block; block = block->next) {
+        manager->free_fiber_count += 1;
+      }
+    }
+    block = manager->free_fibers;
+    if (block) {
+      manager->free_fibers = block->next;
+      manager->free_fiber_count -= 1;
+      manager->reused_fiber_count += 1;
+    }
+  }
+  if (!block &&
+      posix_memalign((void**)&block, FIBER_CACHELINE_SIZE, sizeof(*block))) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(block, 0, sizeof(*block));
+  block->fiber.fiber_stats = &block->stats;
+  block->owner = manager ? manager->id : -1;
+  return &block->fiber;
+}
+
+void fiber_manager_free_fiber(fiber_manager_t* manager, fiber_t* the_fiber) {
+  if (!the_fiber) {
+    return;
+  }
+  free(the_fiber->mpsc_fifo_node);
+  fiber_block_t* const block = (fiber_block_t*)the_fiber;
+  if (!manager || block->owner < 0) {
+    free(block);
+    return;
+  }
+  // a retired manager may not allocate again for a long time, so its blocks
+  // are kept wherever they're freed
+  if (block->owner == manager->id ||
+      atomic_load_explicit(&fiber_managers[block->owner]->retiring,
+                           memory_order_relaxed)) {
+    if (manager->free_fiber_count >= FIBER_MANAGER_MAX_FREE_FIBERS) {
+      free(block);
+      return;
+    }
+    block->next = manager->free_fibers;
+    manager->free_fibers = block;
+    manager->free_fiber_count += 1;
+    return;
+  }
+  // a batch only ever holds one owner's blocks
+  if (manager->return_batch && manager->return_batch_owner != block->owner) {
+    fiber_manager_flush_return_batch(manager);
+  }
+  if (!manager->return_batch) {
+    manager->return_batch_tail = block;
+    manager->return_batch_owner = block->owner;
+  }
+  block->next = manager->return_batch;
+  manager->return_batch = block;
+  manager->return_batch_count += 1;
+  if (manager->return_batch_count >= FIBER_MANAGER_FIBER_BATCH) {
+    fiber_manager_flush_return_batch(manager);
+  }
+}
 
 void fiber_destroy(fiber_t* f) {
   if (f) {
     assert(f->state == FIBER_STATE_DONE);
+    const int shared = f->context.shared_stack != NULL;
+    if (fiber_unlikely(f->context.has_canary)) {
+      fiber_stack_profile_record(f->run_function,
+                                 fiber_context_stack_depth(&f->context));
+    }
     fiber_context_destroy(&f->context);
-    free(f->mpsc_fifo_node);
-    free(f);
+    if (shared) {
+      fiber_manager_release_shared_stack(fiber_managers[f->home_manager]);
+    }
+    fiber_manager_free_fiber(fiber_manager_get(), f);
   }
 }
 
@@ -66,29 +219,244 @@ fiber_manager_t* fiber_manager_create(fiber_scheduler_t* scheduler) {
   fiber_detach(manager->thread_fiber);
   manager->current_fiber = manager->thread_fiber;
   manager->scheduler = scheduler;
+  // force the first fiber_manager_clock() call to read the clock
+  manager->clock_yield_count = UINT64_MAX;
+  manager->run_started = fiber_manager_read_clock();
+  manager->cpu = -1;
 
-  if (!manager->thread_fiber) {
+  if (!manager->thread_fiber || !mpsc_fifo_init(&manager->inbox)) {
     fiber_destroy(manager->thread_fiber);
     free(manager);
+    errno = ENOMEM;
     return NULL;
   }
   return manager;
 }
 
+// managers keep at most this many spare mailbox nodes
+#define FIBER_MANAGER_MAX_FREE_NODES (256)
+
+static int fiber_manager_create_mailboxes(fiber_manager_t* manager) {
+  manager->mailboxes =
+      calloc(fiber_manager_num_threads, sizeof(*manager->mailboxes));
+  if (!manager->mailboxes) {
+    return FIBER_ERROR;
+  }
+  int i;
+  for (i = 0; i < fiber_manager_num_threads; ++i) {
+    if (!spsc_fifo_init(&manager->mailboxes[i])) {
+      return FIBER_ERROR;
+    }
+  }
+  return FIBER_SUCCESS;
+}
+
+static inline spsc_node_t* fiber_manager_get_spsc_node(
+    fiber_manager_t* manager) {
+  spsc_node_t* const node = manager->free_nodes;
+  if (node) {
+    manager->free_nodes =
+        atomic_load_explicit(&node->next, memory_order_relaxed);
+    manager->free_node_count -= 1;
+    return node;
+  }
+  return malloc(sizeof(*node));
+}
+
+static inline void fiber_manager_return_spsc_node(fiber_manager_t* manager,
+                                                  spsc_node_t* node) {
+  if (manager->free_node_count >= FIBER_MANAGER_MAX_FREE_NODES) {
+    free(node);
+    return;
+  }
+  atomic_store_explicit(&node->next, manager->free_nodes,
+                        memory_order_relaxed);
+  manager->free_nodes = node;
+  manager->free_node_count += 1;
+}
+
 static void fiber_manager_destroy(fiber_manager_t* manager) {
+  if (manager->mailboxes) {
+    int i;
+    for (i = 0; i < fiber_manager_num_threads; ++i) {
+      spsc_fifo_destroy(&manager->mailboxes[i]);
+    }
+    free(manager->mailboxes);
+  }
+  while (manager->free_nodes) {
+    spsc_node_t* const node = manager->free_nodes;
+    manager->free_nodes = node->next;
+    free(node);
+  }
+  // every manager has stopped, so nothing is returned to this one any more
+  fiber_manager_free_blocks(manager->free_fibers);
+  fiber_manager_free_blocks(atomic_load(&manager->returned_fibers));
+  fiber_manager_free_blocks(manager->return_batch);
+  fiber_shared_stack_destroy(manager->shared_stack);
+  if (manager->has_preempt_timer) {
+    timer_delete(manager->preempt_timer);
+  }
   fiber_destroy(manager->thread_fiber);
+  mpsc_fifo_destroy(&manager->inbox);
+  free(manager->parked);
   free(manager);
 }
 
 static void* fiber_manager_thread_func(void* param);
 
+// schedules a fiber which this manager is done with, sending it to its home
+// manager if it has to run elsewhere
+static inline void fiber_manager_requeue(fiber_manager_t* manager,
+                                         fiber_t* the_fiber) {
+  if (fiber_unlikely(fiber_manager_is_away(manager, the_fiber))) {
+    fiber_manager_send_home(manager, the_fiber);
+  } else {
+    fiber_scheduler_schedule(manager->scheduler, the_fiber);
+  }
+}
+
+// moves the fibers other managers sent here to the scheduler. returns the
+// number of fibers moved.
+static int fiber_manager_take_mailboxes(fiber_manager_t* manager) {
+  int count = 0;
+  int i;
+  for (i = 0; i < fiber_manager_num_threads; ++i) {
+    spsc_node_t* node;
+    while ((node = spsc_fifo_trypop(&manager->mailboxes[i]))) {
+      fiber_t* const the_fiber = (fiber_t*)node->data;
+      fiber_manager_return_spsc_node(manager, node);
+      fiber_manager_requeue(manager, the_fiber);
+      count += 1;
+    }
+  }
+  return count;
+}
+
+// moves fibers from the injection queue to this manager's scheduler, unless
+// another manager is already doing that. returns the number of fibers moved.
+static int fiber_manager_take_injected(fiber_manager_t* manager) {
+  if (atomic_exchange_explicit(&fiber_manager_injected_lock, 1,
+                               memory_order_acquire)) {
+    return 0;
+  }
+  int count = 0;
+  mpsc_fifo_node_t* node;
+  while ((node = mpsc_fifo_trypop(&fiber_manager_injected))) {
+    atomic_fetch_sub_explicit(&fiber_manager_injected_count, 1,
+                              memory_order_relaxed);
+    fiber_t* const the_fiber = (fiber_t*)node->data;
+    assert(!the_fiber->mpsc_fifo_node);
+    the_fiber->mpsc_fifo_node = node;
+    if (fiber_unlikely(fiber_manager_thread_per_core) &&
+        the_fiber->home_manager < 0) {
+      the_fiber->home_manager = manager->id;
+    }
+    fiber_manager_requeue(manager, the_fiber);
+    count += 1;
+  }
+  atomic_store_explicit(&fiber_manager_injected_lock, 0, memory_order_release);
+  manager->injected_count += count;
+  return count;
+}
+
+static inline int fiber_manager_has_injected() {
+  return atomic_load_explicit(&fiber_manager_injected_count,
+                              memory_order_relaxed) != 0;
+}
+
+static int fiber_manager_take_inbox(fiber_manager_t* manager) {
+  int count = 0;
+  mpsc_fifo_node_t* node;
+  while ((node = mpsc_fifo_trypop(&manager->inbox))) {
+    fiber_t* const the_fiber = (fiber_t*)node->data;
+    assert(!the_fiber->mpsc_fifo_node);
+    the_fiber->mpsc_fifo_node = node;
+    // the fiber may have moved home again on the way here
+    fiber_manager_requeue(manager, the_fiber);
+    count += 1;
+  }
+  return count;
+}
+
+// accounts for the time the_fiber waited between being scheduled and running
+static inline void fiber_manager_account_latency(fiber_manager_t* manager,
+                                                 fiber_t* the_fiber) {
+  const uint64_t now = fiber_manager_clock(manager);
+  const uint64_t ready_since = the_fiber->ready_since;
+  // another manager's clock may be slightly ahead of this one
+  const uint64_t latency = now > ready_since ? now - ready_since : 0;
+  const fiber_priority_t priority = the_fiber->priority;
+  manager->class_run_count[priority] += 1;
+  manager->class_latency_sum[priority] += latency;
+  if (latency > manager->class_latency_max[priority]) {
+    manager->class_latency_max[priority] = latency;
+  }
+  manager->latency_histogram[fiber_manager_histogram_bucket(latency)] += 1;
+}
+
+// adds the time since the_fiber's last state change, up to until, to what it
+// was doing
+static inline void fiber_manager_charge_time(fiber_t* the_fiber,
+                                            uint64_t until) {
+  const uint64_t since = the_fiber->time_since;
+  if (until > since) {
+    if (since) {
+      the_fiber->times[the_fiber->time_kind] += until - since;
+    }
+    the_fiber->time_since = until;
+  }
+}
+
+// moves old_fiber out of and new_fiber into the running state for the time
+// accounting. a fiber stops waiting when it's scheduled, which is what
+// ready_since records. that's read from the clock when the fiber is woken
+// (see fiber_manager_mark_ready()), so a waker which ran for a while before
+// waking it doesn't turn the end of its wait into ready time.
+static void fiber_manager_account_time_switch(fiber_t* old_fiber,
+                                              int old_runnable,
+                                              fiber_t* new_fiber,
+                                              uint64_t now) {
+  fiber_manager_charge_time(old_fiber, now);
+  old_fiber->time_kind =
+      old_runnable ? FIBER_TIME_READY : old_fiber->wait_kind;
+  old_fiber->wait_kind = FIBER_TIME_WAIT;
+  if (new_fiber->ready_since) {
+    fiber_manager_charge_time(new_fiber, new_fiber->ready_since);
+    new_fiber->time_kind = FIBER_TIME_READY;
+  }
+  fiber_manager_charge_time(new_fiber, now);
+  new_fiber->time_kind = FIBER_TIME_RUNNING;
+}
+
 static inline void fiber_manager_switch_to(fiber_manager_t* manager,
                                            fiber_t* old_fiber,
                                            fiber_t* new_fiber) {
-  if (old_fiber->state == FIBER_STATE_RUNNING) {
+  // a waiting fiber can be made ready by another thread at any moment, but
+  // only this thread moves it out of the running state
+  const int old_runnable = old_fiber->state == FIBER_STATE_RUNNING;
+  if (old_runnable) {
     old_fiber->state = FIBER_STATE_READY;
     manager->to_schedule = old_fiber;
   }
+  const uint64_t now = fiber_manager_clock(manager);
+  if (fiber_unlikely(fiber_manager_account_time)) {
+    fiber_manager_account_time_switch(old_fiber, old_runnable, new_fiber, now);
+  }
+  if (new_fiber->ready_since) {
+    if (fiber_manager_track_latency) {
+      fiber_manager_account_latency(manager, new_fiber);
+    }
+    new_fiber->ready_since = 0;
+  }
+  if (old_fiber != manager->maintenance_fiber) {
+    const uint64_t run_started = manager->run_started;
+    manager->run_length_histogram[fiber_manager_histogram_bucket(
+        now > run_started ? now - run_started : 0)] += 1;
+  }
+  manager->run_started = now;
+  // the new fiber gets a full quantum
+  manager->switch_count += 1;
+  manager->preempt_requested = 0;
   manager->current_fiber = new_fiber;
   manager->old_fiber = old_fiber;
   new_fiber->state = FIBER_STATE_RUNNING;
@@ -96,44 +464,197 @@ static inline void fiber_manager_switch_to(fiber_manager_t* manager,
 
   fiber_manager_do_maintenance();
 }
-// main place where context switching and scheduling happens 
+
+// banned fibers are parked in a per-manager min-heap keyed on ban expiry
+// rather than being pushed back onto the scheduler. this keeps them from being
+// popped (or stolen) over and over while their ban runs out.
+static void fiber_manager_park(fiber_manager_t* manager, fiber_t* the_fiber) {
+  if (manager->parked_count == manager->parked_capacity) {
+    const size_t new_capacity =
+        manager->parked_capacity ? 2 * manager->parked_capacity : 16;
+    fiber_manager_parked_t* const new_parked =
+        realloc(manager->parked, new_capacity * sizeof(*new_parked));
+    if (!new_parked) {
+      // out of memory - fall back to leaving the fiber in the queue
+      fiber_scheduler_schedule(manager->scheduler, the_fiber);
+      return;
+    }
+    manager->parked = new_parked;
+    manager->parked_capacity = new_capacity;
+  }
+
+  const uint64_t until = atomic_load_explicit(
+      &the_fiber->fiber_stats->banned_until, memory_order_relaxed);
+  fiber_manager_parked_t* const heap = manager->parked;
+  size_t i = manager->parked_count++;
+  while (i > 0) {
+    const size_t parent = (i - 1) / 2;
+    if (heap[parent].until <= until) {
+      break;
+    }
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i].until = until;
+  heap[i].fiber = the_fiber;
+  // the ban isn't scheduling latency, so the fiber is ready once it's unparked
+  the_fiber->ready_since = 0;
+  manager->park_count += 1;
+}
+
+// moves parked fiber 'last' down from slot i until the heap is ordered again
+static void fiber_manager_sift_down_parked(fiber_manager_t* manager, size_t i,
+                                           fiber_manager_parked_t last) {
+  fiber_manager_parked_t* const heap = manager->parked;
+  const size_t count = manager->parked_count;
+  while (1) {
+    size_t child = 2 * i + 1;
+    if (child >= count) {
+      break;
+    }
+    if (child + 1 < count && heap[child + 1].until < heap[child].until) {
+      ++child;
+    }
+    if (last.until <= heap[child].until) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+}
+
+// reschedules every parked fiber whose ban expired at or before now
+static void fiber_manager_unpark(fiber_manager_t* manager, uint64_t now) {
+  fiber_manager_parked_t* const heap = manager->parked;
+  while (manager->parked_count && heap[0].until <= now) {
+    fiber_manager_mark_ready(manager, heap[0].fiber);
+    fiber_manager_requeue(manager, heap[0].fiber);
+
+    const fiber_manager_parked_t last = heap[--manager->parked_count];
+    fiber_manager_sift_down_parked(manager, 0, last);
+  }
+}
+
+// reschedules every parked fiber whose lock nobody else holds or wants any
+// more. a ban isn't enforced then (see schedule_lock_fiber_is_banned()), so
+// there's no point waiting it out. returns the number of fibers rescheduled.
+static size_t fiber_manager_unpark_unwanted(fiber_manager_t* manager) {
+  fiber_manager_parked_t* const heap = manager->parked;
+  const size_t old_count = manager->parked_count;
+  size_t kept = 0;
+  size_t i;
+  for (i = 0; i < old_count; ++i) {
+    fiber_t* const the_fiber = heap[i].fiber;
+    if (schedule_lock_is_wanted(the_fiber->fiber_stats->contending)) {
+      heap[kept++] = heap[i];
+    } else {
+      fiber_manager_mark_ready(manager, the_fiber);
+      fiber_manager_requeue(manager, the_fiber);
+    }
+  }
+  if (kept != old_count) {
+    manager->parked_count = kept;
+    for (i = kept / 2; i-- > 0;) {
+      fiber_manager_sift_down_parked(manager, i, heap[i]);
+    }
+  }
+  return old_count - kept;
+}
+
+static inline fiber_t* fiber_manager_take_runnext(fiber_manager_t* manager) {
+  if (!atomic_load_explicit(&manager->runnext, memory_order_relaxed)) {
+    return NULL;
+  }
+  // another manager may steal the fiber in the meantime
+  return atomic_exchange_explicit(&manager->runnext, NULL,
+                                  memory_order_acq_rel);
+}
+
+// pops the next fiber from the scheduler, parking any fiber which is waiting
+// out a lock ban along the way
+static inline fiber_t* fiber_manager_next_queued(fiber_manager_t* manager) {
+  fiber_t* new_fiber;
+  while ((new_fiber = fiber_scheduler_next(manager->scheduler))) {
+    if (fiber_unlikely(fiber_manager_is_away(manager, new_fiber))) {
+      // stolen by a backend which doesn't keep pinned fibers to themselves
+      fiber_manager_send_home(manager, new_fiber);
+    } else if (schedule_lock_fiber_is_banned(manager, new_fiber)) {
+      fiber_manager_park(manager, new_fiber);
+    } else {
+      break;
+    }
+  }
+  if (new_fiber) {
+    manager->runnext_streak = 0;
+  }
+  return new_fiber;
+}
+
+// returns the next fiber to run: the runnext fiber if there is one, otherwise
+// the next fiber from the scheduler
+static inline fiber_t* fiber_manager_next_unbanned(fiber_manager_t* manager) {
+  if (fiber_unlikely(fiber_manager_thread_per_core)) {
+    fiber_manager_take_mailboxes(manager);
+  }
+  if (fiber_unlikely(mpsc_fifo_peek(&manager->inbox, NULL))) {
+    fiber_manager_take_inbox(manager);
+  }
+  if (fiber_unlikely(fiber_manager_has_injected())) {
+    fiber_manager_take_injected(manager);
+  }
+  if (fiber_unlikely(manager->parked_count)) {
+    fiber_manager_unpark(manager, fiber_manager_clock(manager));
+  }
+  fiber_t* const next = fiber_manager_take_runnext(manager);
+  if (next) {
+    if (fiber_unlikely(schedule_lock_fiber_is_banned(manager, next))) {
+      fiber_manager_park(manager, next);
+    } else if (fiber_likely(manager->runnext_streak <
+                                FIBER_MANAGER_RUNNEXT_LIMIT &&
+                            next->state != FIBER_STATE_SAVING_STATE_TO_WAIT)) {
+      manager->runnext_streak += 1;
+      manager->runnext_count += 1;
+      return next;
+    } else {
+      // let the scheduler go first. the fiber may also still be switching out
+      // on another thread, which the scheduler knows how to deal with.
+      fiber_t* const queued = fiber_manager_next_queued(manager);
+      fiber_scheduler_schedule(manager->scheduler, next);
+      if (queued) {
+        return queued;
+      }
+    }
+  }
+  return fiber_manager_next_queued(manager);
+}
+
+// main place where context switching and scheduling happens
 void fiber_manager_yield(fiber_manager_t* manager) {
   assert(fiber_manager_state == FIBER_MANAGER_STATE_STARTED);
   assert(manager);
-  lock_stats_t new_fiber_lock_stats;
-  // lock_stats_t curr_fiber_lock_stats;
-
   fiber_t* const current_fiber = manager->current_fiber;
-  // curr_fiber_lock_stats = *(get_lock_stats(current_fiber)); // add which lock in the future
-  
   while (1) {
     manager->yield_count += 1;
+    if (fiber_unlikely(atomic_load_explicit(&manager->retiring,
+                                            memory_order_relaxed)) &&
+        manager->maintenance_fiber &&
+        current_fiber != manager->maintenance_fiber) {
+      // the maintenance fiber hands everything, including this fiber if it's
+      // runnable, to the active managers
+      fiber_manager_switch_to(manager, current_fiber,
+                              manager->maintenance_fiber);
+      break;
+    }
     const fiber_state_t state = current_fiber->state;
-     
-    fiber_t* const new_fiber = fiber_scheduler_next(manager->scheduler);
-
+    fiber_t* const new_fiber = fiber_manager_next_unbanned(manager);
     if (new_fiber) {
-      new_fiber_lock_stats = *(get_lock_stats(new_fiber));
-      struct timeval now;
-      gettimeofday(&now, NULL);
-      // checking whether banned
-      // NOT_BANNED AND LOCK AVAIALABLE
-      if ((timercmp(&now, &new_fiber_lock_stats.banned_until, >)) 
-           && (is_lock_using() != 1))
-      { 
-        // Optimisation, if the ban_time of the next fiber is less than the slice of its next fiber, 
-        // allocate it the resources anyways and add on to the leftover ban
-        // can optimise the push / pop up
-        set_lock_status();
-        fiber_manager_switch_to(manager, current_fiber, new_fiber);
-
-      } else {
-        fiber_manager_schedule(manager, current_fiber);
-        goto try_steal; // try to steal some work 
-
-      }  // pop back into queue
+      if (state == FIBER_STATE_RUNNING) {
+        // both fibers are runnable, so an idle manager could take one
+        fiber_manager_wake_idle(manager);
+      }
+      fiber_manager_switch_to(manager, current_fiber, new_fiber);
       break;
-
     } else if (FIBER_STATE_WAITING == state || FIBER_STATE_DONE == state ||
                FIBER_STATE_SAVING_STATE_TO_WAIT == state) {
       if (!manager->maintenance_fiber) {
@@ -145,9 +666,19 @@ void fiber_manager_yield(fiber_manager_t* manager) {
                               manager->maintenance_fiber);
       // re-grab the manager, since we could be on a different thread now
       manager = fiber_manager_get();
+    } else if (fiber_unlikely(fiber_manager_is_away(manager, current_fiber))) {
+      // nothing else to run here, but this fiber belongs elsewhere. switching
+      // out marks it ready and the maintenance that follows sends it home,
+      // once its context is saved.
+      if (!manager->maintenance_fiber) {
+        manager->maintenance_fiber =
+            fiber_create_no_sched(102400, &fiber_manager_thread_func, manager);
+      }
+      fiber_manager_switch_to(manager, current_fiber,
+                              manager->maintenance_fiber);
+      break;
     } else {
       // occasionally steal some work from threads with more load
-try_steal:
       if ((manager->yield_count & 1023) == 0) {
         fiber_scheduler_load_balance(manager->scheduler);
       }
@@ -167,41 +698,412 @@ void* fiber_load_symbol(const char* symbol) {
 
 static __thread fiber_manager_t* fiber_the_manager = NULL;
 
-static __thread bool should_check_events = true;
-
 fiber_manager_t* fiber_manager_get() { return fiber_the_manager; }
 
 extern void fiber_mark_completed(fiber_t* the_fiber, void* result);
 
+#if defined(__linux__)
+static inline void fiber_manager_futex_wait(_Atomic uint32_t* address,
+                                            uint32_t value,
+                                            uint64_t timeout_ns) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ns / 1000000000;
+  timeout.tv_nsec = timeout_ns % 1000000000;
+  // returns early on a wake, a signal or if *address != value
+  syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value,
+          timeout_ns ? &timeout : NULL, NULL, 0);
+}
+
+static inline void fiber_manager_futex_wake(_Atomic uint32_t* address) {
+  syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline pid_t fiber_manager_gettid() { return syscall(SYS_gettid); }
+#else
+// no futex; sleep in short steps until the flag is cleared
+static inline void fiber_manager_futex_wait(_Atomic uint32_t* address,
+                                            uint32_t value,
+                                            uint64_t timeout_ns) {
+  uint64_t useconds = FIBER_TIME_RESOLUTION_MS * 1000;
+  if (timeout_ns && timeout_ns / 1000 < useconds) {
+    useconds = timeout_ns / 1000 + 1;
+  }
+  if (atomic_load(address) == value) {
+    fiber_do_real_sleep(/*seconds=*/0, useconds);
+  }
+}
+
+static inline void fiber_manager_futex_wake(_Atomic uint32_t* address) {
+  // nothing - the sleeper notices within FIBER_TIME_RESOLUTION_MS
+}
+
+// only used to target preemption timers, which need linux
+static inline pid_t fiber_manager_gettid() { return getpid(); }
+#endif
+
+// clears target's idle flag and wakes it. returns 1 if target was idle.
+static int fiber_manager_wake_target(fiber_manager_t* target) {
+  uint32_t expected = 1;
+  if (!atomic_load_explicit(&target->idle, memory_order_relaxed) ||
+      !atomic_compare_exchange_strong(&target->idle, &expected, 0)) {
+    return 0;
+  }
+  // the poller is published before its idle flag, so this can't miss it
+  if (atomic_load(&fiber_manager_poller) == target) {
+    fiber_event_wake();
+  } else {
+    fiber_manager_futex_wake(&target->idle);
+  }
+  return 1;
+}
+
+static inline void fiber_manager_push_inbox(fiber_manager_t* target,
+                                            fiber_t* the_fiber) {
+  mpsc_fifo_node_t* const node = the_fiber->mpsc_fifo_node;
+  assert(node);
+  the_fiber->mpsc_fifo_node = NULL;
+  node->data = the_fiber;
+  mpsc_fifo_push(&target->inbox, node);
+}
+
+void fiber_manager_send_home(fiber_manager_t* manager, fiber_t* the_fiber) {
+  assert(manager);
+  assert(fiber_manager_is_away(manager, the_fiber));
+  fiber_manager_t* const home = fiber_managers[the_fiber->home_manager];
+  if (fiber_unlikely(
+          atomic_load_explicit(&home->retiring, memory_order_relaxed))) {
+    // the home manager was retired. if it's retiring this moment the fiber is
+    // still safe in its inbox, since it hands those over too.
+    the_fiber->home_manager = fiber_manager_thread_per_core ? manager->id : -1;
+    fiber_scheduler_schedule(manager->scheduler, the_fiber);
+    return;
+  }
+  spsc_node_t* const spsc_node = fiber_manager_thread_per_core
+                                     ? fiber_manager_get_spsc_node(manager)
+                                     : NULL;
+  if (spsc_node) {
+    spsc_node->data = the_fiber;
+    spsc_fifo_push(&home->mailboxes[manager->id], spsc_node);
+  } else {
+    // out of memory in thread-per-core mode falls back to the shared inbox
+    fiber_manager_push_inbox(home, the_fiber);
+  }
+  manager->sent_home_count += 1;
+  // pairs with going idle: either the home manager finds the fiber or we see
+  // that it's idle
+  atomic_thread_fence(memory_order_seq_cst);
+  fiber_manager_wake_target(home);
+}
+
+static int fiber_manager_wake_one(fiber_manager_t* manager) {
+  fiber_manager_t* const poller = atomic_load(&fiber_manager_poller);
+  const int active = atomic_load(&fiber_manager_active_threads);
+  const int start = manager ? manager->id : 0;
+  int i;
+  for (i = 1; i <= active; ++i) {
+    fiber_manager_t* const target = fiber_managers[(start + i) % active];
+    // a manager being retired wouldn't look for work, so the wake would be
+    // lost
+    if (target && target != poller && !atomic_load(&target->retiring) &&
+        fiber_manager_wake_target(target)) {
+      return 1;
+    }
+  }
+  // the poller is the only idle manager left
+  return poller && !atomic_load(&poller->retiring) &&
+         fiber_manager_wake_target(poller);
+}
+
+void fiber_manager_wake(fiber_manager_t* manager) {
+  int expected = 0;
+  if (!fiber_managers ||
+      !atomic_compare_exchange_strong(&fiber_manager_waking, &expected, 1)) {
+    return;
+  }
+  if (fiber_manager_wake_one(manager)) {
+    if (manager) {
+      manager->wake_count += 1;
+    }
+  } else {
+    atomic_store(&fiber_manager_waking, 0);
+  }
+}
+
+void fiber_manager_inject(fiber_t* the_fiber) {
+  assert(the_fiber);
+  assert(fiber_managers);
+  if (fiber_unlikely(fiber_manager_stamp_ready) && !the_fiber->ready_since) {
+    the_fiber->ready_since = fiber_manager_read_clock();
+  }
+  mpsc_fifo_node_t* const node = the_fiber->mpsc_fifo_node;
+  assert(node);
+  the_fiber->mpsc_fifo_node = NULL;
+  node->data = the_fiber;
+  mpsc_fifo_push(&fiber_manager_injected, node);
+  atomic_fetch_add_explicit(&fiber_manager_injected_count, 1,
+                            memory_order_relaxed);
+  // pairs with going idle: either an idle manager sees the count or we see
+  // that it's idle
+  atomic_thread_fence(memory_order_seq_cst);
+  fiber_manager_wake_idle(NULL);
+}
+
+static void fiber_manager_wake_all() {
+  // a manager going idle either sees fiber_shutting_down or is woken here
+  atomic_thread_fence(memory_order_seq_cst);
+  int i;
+  for (i = 0; i < fiber_manager_started_threads; ++i) {
+    fiber_manager_wake_target(fiber_managers[i]);
+  }
+}
+
+// returns 1 if any manager's runnext slot holds a fiber, which this manager
+// could steal (see fiber_manager_steal_runnext())
+static int fiber_manager_any_runnext() {
+  int i;
+  for (i = 0; i < fiber_manager_num_threads; ++i) {
+    fiber_manager_t* const other = fiber_managers[i];
+    if (other &&
+        atomic_load_explicit(&other->runnext, memory_order_relaxed) != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// returns 1 if this manager can run something after all, which it checks
+// after announcing that it's idle so work scheduled in the meantime is seen
+static int fiber_manager_recheck(fiber_manager_t* manager) {
+  if (fiber_manager_take_inbox(manager) ||
+      (fiber_manager_thread_per_core &&
+       fiber_manager_take_mailboxes(manager)) ||
+      fiber_manager_take_injected(manager)) {
+    return 1;
+  }
+  fiber_scheduler_load_balance(manager->scheduler);
+  fiber_t* const found = fiber_scheduler_next(manager->scheduler);
+  if (found) {
+    fiber_scheduler_schedule(manager->scheduler, found);
+    return 1;
+  }
+  // another manager may be draining the injection queue, and could be about
+  // to go idle itself
+  return fiber_scheduler_pending(manager->scheduler) ||
+         fiber_manager_any_runnext() || fiber_manager_has_injected();
+}
+
+// called by a manager with nothing to run. one idle manager at a time blocks
+// polling for events; the others sleep on their idle flag until
+// fiber_manager_wake() picks them or timeout_ns passes (0 waits forever).
+// returns 1 if the manager was woken by another thread.
+static int fiber_manager_idle(fiber_manager_t* manager, uint64_t timeout_ns) {
+  if (fiber_scheduler_pending(manager->scheduler)) {
+    // nobody would wake this manager once those fibers finish switching out
+    sched_yield();
+    return 0;
+  }
+  const int ready = fiber_poll_events();
+  if (ready > 0) {
+    return 0;
+  }
+  // the event system only has millisecond resolution
+  fiber_manager_t* expected = NULL;
+  const int polling =
+      ready == 0 && (!timeout_ns || timeout_ns >= 1000000) &&
+      atomic_compare_exchange_strong(&fiber_manager_poller, &expected,
+                                     manager);
+
+  atomic_store(&manager->idle, 1);
+  atomic_fetch_add(&fiber_manager_idle_count, 1);
+  size_t num_events = 0;
+  if (!fiber_shutting_down && !fiber_manager_recheck(manager)) {
+    manager->sleep_count += 1;
+    const uint64_t idle_since = fiber_manager_read_clock();
+    atomic_store_explicit(&manager->idle_since, idle_since,
+                          memory_order_relaxed);
+    if (polling && timeout_ns) {
+      num_events = fiber_poll_events_blocking(
+          timeout_ns / 1000000000, (timeout_ns % 1000000000 + 999) / 1000);
+    } else if (polling) {
+      num_events = fiber_poll_events_blocking(FIBER_POLL_FOREVER, 0);
+    } else {
+      fiber_manager_futex_wait(&manager->idle, 1, timeout_ns);
+    }
+    atomic_store_explicit(&manager->idle_since, 0, memory_order_relaxed);
+    manager->idle_ns += fiber_manager_read_clock() - idle_since;
+  }
+  const int woken = !atomic_exchange(&manager->idle, 0);
+  atomic_fetch_sub(&fiber_manager_idle_count, 1);
+  if (woken) {
+    atomic_store(&fiber_manager_waking, 0);
+  }
+  if (polling) {
+    atomic_store(&fiber_manager_poller, NULL);
+    if (woken || num_events) {
+      // this manager has work now; another idle manager takes over polling
+      fiber_manager_wake(manager);
+    }
+  }
+  return woken;
+}
+
+// called by an idle manager which only has parked fibers. waits for the
+// earliest ban to expire while still servicing events. a lock released by
+// its last other user lets its parked fibers go within
+// FIBER_TIME_RESOLUTION_MS, rather than at the end of their bans.
+static int fiber_manager_wait_for_unpark(fiber_manager_t* manager) {
+  if (fiber_manager_unpark_unwanted(manager)) {
+    return 0;
+  }
+  const uint64_t now = fiber_manager_refresh_clock(manager);
+  const uint64_t until = manager->parked[0].until;
+  if (until <= now) {
+    return 0;
+  }
+  const uint64_t poll_ns = FIBER_TIME_RESOLUTION_MS * 1000000ULL;
+  return fiber_manager_idle(manager,
+                            until - now < poll_ns ? until - now : poll_ns);
+}
+
+// moves another manager's runnext fiber to this manager's scheduler. returns 1
+// if a fiber was stolen.
+static int fiber_manager_steal_runnext(fiber_manager_t* manager) {
+  int i;
+  for (i = 1; i < fiber_manager_num_threads; ++i) {
+    fiber_manager_t* const victim =
+        fiber_managers[(manager->id + i) % fiber_manager_num_threads];
+    fiber_t* const stolen = victim ? fiber_manager_take_runnext(victim) : NULL;
+    if (fiber_unlikely(stolen && fiber_manager_is_away(manager, stolen))) {
+      // pinned fibers stay with their home manager
+      fiber_manager_send_home(manager, stolen);
+    } else if (stolen) {
+      fiber_scheduler_schedule(manager->scheduler, stolen);
+      manager->runnext_steal_count += 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// gives the_fiber, which a retired manager can't run, to one of the active
+// managers
+static void fiber_manager_hand_over(fiber_manager_t* manager,
+                                    fiber_t* the_fiber) {
+  if (fiber_manager_is_away(manager, the_fiber)) {
+    fiber_manager_send_home(manager, the_fiber);
+    return;
+  }
+  const int active = atomic_load(&fiber_manager_active_threads);
+  fiber_manager_t* const target =
+      fiber_managers[manager->hand_over_turn++ % active];
+  if (the_fiber->home_manager == manager->id) {
+    the_fiber->home_manager = fiber_manager_thread_per_core ? target->id : -1;
+  }
+  fiber_manager_push_inbox(target, the_fiber);
+  // pairs with going idle, as in fiber_manager_send_home()
+  atomic_thread_fence(memory_order_seq_cst);
+  fiber_manager_wake_target(target);
+}
+
+// hands every fiber a retired manager has to the active managers. returns the
+// number of fibers handed over.
+static int fiber_manager_hand_over_all(fiber_manager_t* manager) {
+  int count = 0;
+  while (1) {
+    fiber_manager_take_inbox(manager);
+    if (fiber_manager_thread_per_core) {
+      fiber_manager_take_mailboxes(manager);
+    }
+    fiber_t* const next = fiber_manager_take_runnext(manager);
+    if (next) {
+      fiber_scheduler_schedule(manager->scheduler, next);
+    }
+    // bans are checked again wherever the fibers end up
+    while (manager->parked_count) {
+      fiber_t* const parked = manager->parked[--manager->parked_count].fiber;
+      fiber_manager_mark_ready(manager, parked);
+      fiber_manager_requeue(manager, parked);
+    }
+    fiber_t* the_fiber;
+    while ((the_fiber = fiber_scheduler_next(manager->scheduler))) {
+      fiber_manager_hand_over(manager, the_fiber);
+      count += 1;
+    }
+    if (!fiber_scheduler_pending(manager->scheduler)) {
+      return count;
+    }
+    // the rest are still switching out on other threads
+    sched_yield();
+  }
+}
+
+// runs on a retired manager's thread until the manager is activated again or
+// the process shuts down. fibers still arrive after the manager was retired -
+// sent home, or woken by fibers which ran here - so it sleeps on its idle flag
+// and passes them on.
+static void fiber_manager_retire(fiber_manager_t* manager) {
+  manager->retire_count += 1;
+  while (atomic_load(&manager->retiring) && !fiber_shutting_down) {
+    if (fiber_manager_hand_over_all(manager)) {
+      continue;
+    }
+    // not counted as idle, so fiber_manager_wake() never picks this manager
+    atomic_store(&manager->idle, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!fiber_manager_hand_over_all(manager) &&
+        atomic_load(&manager->retiring) && !fiber_shutting_down) {
+      fiber_manager_futex_wait(&manager->idle, 1, 0);
+    }
+    if (!atomic_exchange(&manager->idle, 0)) {
+      // fiber_manager_wake() may have picked this manager just before it was
+      // retired; let the next wake through
+      atomic_store(&fiber_manager_waking, 0);
+    }
+  }
+}
+
 static void* fiber_manager_thread_func(void* param) {
   // set the thread local, then start running fibers
   fiber_the_manager = (fiber_manager_t*)param;
+  atomic_store(&fiber_the_manager->tid, fiber_manager_gettid());
 
   splitstack_disable_block_signals();
 
   fiber_manager_t* manager = (fiber_manager_t*)param;
   if (!manager->maintenance_fiber) {
     manager->maintenance_fiber = manager->thread_fiber;
-    should_check_events = true;
     this_thread = pthread_self();
   }
 
+  int woken = 0;
   while (!fiber_shutting_down) {
+    if (fiber_unlikely(atomic_load_explicit(&manager->retiring,
+                                            memory_order_relaxed))) {
+      fiber_manager_retire(manager);
+      continue;
+    }
     fiber_scheduler_load_balance(manager->scheduler);
 
-    fiber_t* const new_fiber = fiber_scheduler_next(manager->scheduler);
+    // the clock isn't advanced by yields in this loop
+    fiber_manager_refresh_clock(manager);
+    fiber_t* new_fiber = fiber_manager_next_unbanned(manager);
+    if (!new_fiber && fiber_manager_steal_runnext(manager)) {
+      new_fiber = fiber_manager_next_unbanned(manager);
+    }
     if (new_fiber) {
+      if (woken) {
+        // there may be more work where this came from
+        woken = 0;
+        fiber_manager_wake_idle(manager);
+      }
       // make this fiber wait so we aren't scheduled again until all work is
       // done
       manager->maintenance_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
       fiber_manager_switch_to(manager, manager->maintenance_fiber, new_fiber);
-    } else if (should_check_events) {
-      const int num_events = fiber_poll_events();
-      if (num_events == 0) {
-        fiber_poll_events_blocking(0, FIBER_TIME_RESOLUTION_MS * 1000);
-      }
+    } else if (manager->parked_count) {
+      woken = fiber_manager_wait_for_unpark(manager);
     } else {
-      fiber_do_real_sleep(/*seconds=*/0, /*useconds=*/10000);
+      woken = fiber_manager_idle(manager, 0);
     }
   }
   fiber_mark_completed(manager->maintenance_fiber, NULL);
@@ -211,7 +1113,10 @@ static void* fiber_manager_thread_func(void* param) {
         fiber_manager_switch_to(manager, manager->maintenance_fiber,
                                 manager->thread_fiber);
       }
-      fiber_t* const new_fiber = fiber_scheduler_next(manager->scheduler);
+      fiber_t* new_fiber = fiber_manager_take_runnext(manager);
+      if (!new_fiber) {
+        new_fiber = fiber_scheduler_next(manager->scheduler);
+      }
       if (new_fiber && new_fiber != manager->maintenance_fiber) {
         fiber_manager_switch_to(manager, manager->maintenance_fiber, new_fiber);
       }
@@ -221,10 +1126,101 @@ static void* fiber_manager_thread_func(void* param) {
 }
 
 int fiber_manager_init(size_t num_threads) {
+  return fiber_manager_init_with_options(num_threads, NULL);
+}
+
+int fiber_manager_init_with_scheduler(size_t num_threads,
+                                      const char* scheduler) {
+  fiber_manager_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.scheduler = scheduler;
+  return fiber_manager_init_with_options(num_threads, &options);
+}
+
+static int fiber_manager_pinning = 0;
+#if defined(__linux__)
+// the CPUs to pin to, read before the first thread was pinned
+static cpu_set_t fiber_manager_pin_allowed;
+
+// pins manager i's thread to the (i % count)-th CPU in the allowed set. a
+// manager which can't be pinned keeps running anywhere.
+static void fiber_manager_pin_thread(int i) {
+  const int count = CPU_COUNT(&fiber_manager_pin_allowed);
+  int skip = i % count;
+  int cpu;
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &fiber_manager_pin_allowed) && skip-- == 0) {
+      break;
+    }
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (!pthread_setaffinity_np(fiber_manager_threads[i], sizeof(set), &set)) {
+    fiber_managers[i]->cpu = cpu;
+  }
+}
+#else
+static void fiber_manager_pin_thread(int i) {
+  // nothing - fiber_manager_init_with_options() refuses to pin
+}
+#endif
+
+static uint64_t fiber_manager_preempt_quantum = 0;
+static int fiber_manager_arm_preempt_timer(int index);
+
+// starts the thread for the next manager which doesn't have one yet
+static int fiber_manager_start_thread() {
+  const int i = fiber_manager_started_threads;
+  assert(i > 0 && i < fiber_manager_num_threads);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 1024000);
+  const int error = pthread_create(&fiber_manager_threads[i], &attr,
+                                   &fiber_manager_thread_func,
+                                   fiber_managers[i]);
+  pthread_attr_destroy(&attr);
+  if (error) {
+    errno = error;
+    return FIBER_ERROR;
+  }
+  fiber_manager_started_threads = i + 1;
+  if (fiber_manager_pinning) {
+    fiber_manager_pin_thread(i);
+  }
+  if (fiber_manager_preempt_quantum &&
+      !fiber_manager_arm_preempt_timer(i)) {
+    return FIBER_ERROR;
+  }
+  return FIBER_SUCCESS;
+}
+
+int fiber_manager_init_with_options(size_t num_threads,
+                                    const fiber_manager_options_t* options) {
+  fiber_manager_options_t defaults;
+  if (!options) {
+    memset(&defaults, 0, sizeof(defaults));
+    options = &defaults;
+  }
+  const char* scheduler = options->scheduler;
+  if (options->thread_per_core && !scheduler) {
+    scheduler = "tpc";
+  }
+#if defined(__linux__)
+  if (options->pin_threads &&
+      sched_getaffinity(0, sizeof(fiber_manager_pin_allowed),
+                        &fiber_manager_pin_allowed)) {
+    return FIBER_ERROR;
+  }
+#else
+  if (options->pin_threads) {
+    errno = ENOSYS;
+    return FIBER_ERROR;
+  }
+#endif
+
   splitstack_disable_block_signals();
-  init_scheduler_lock_data();
   fiber_shutting_down = 0;
-  should_check_events = true;
   this_thread = pthread_self();
 
   if (fiber_manager_get_state() != FIBER_MANAGER_STATE_NONE) {
@@ -232,24 +1228,38 @@ int fiber_manager_init(size_t num_threads) {
     return FIBER_ERROR;
   }
 
-  const int sched_ret = fiber_scheduler_init(num_threads);
+  if (!scheduler) {
+    scheduler = getenv(FIBER_SCHEDULER_ENV);
+  }
+  if (!fiber_scheduler_select(scheduler)) {
+    return FIBER_ERROR;
+  }
+  // everything is sized for the most managers there can be, so growing only
+  // has to start threads
+  const size_t max_threads =
+      options->max_threads > num_threads ? options->max_threads : num_threads;
+  const int sched_ret = fiber_scheduler_init(max_threads);
   if (!sched_ret) {
     return FIBER_ERROR;
   }
 
   assert(!fiber_manager_threads);
-  fiber_manager_threads = calloc(num_threads, sizeof(*fiber_manager_threads));
+  fiber_manager_threads = calloc(max_threads, sizeof(*fiber_manager_threads));
   assert(fiber_manager_threads);
-  fiber_manager_num_threads = num_threads;
+  fiber_manager_num_threads = max_threads;
   assert(!fiber_managers);
-  fiber_managers = calloc(num_threads, sizeof(*fiber_managers));
+  fiber_managers = calloc(max_threads, sizeof(*fiber_managers));
   assert(fiber_managers);
+  const int injected_ret = mpsc_fifo_init(&fiber_manager_injected);
+  (void)injected_ret;
+  assert(injected_ret);
 
   fiber_manager_t* const main_manager =
       fiber_manager_create(fiber_scheduler_for_thread(0));
   assert(main_manager);
 
   fiber_the_manager = main_manager;
+  atomic_store(&main_manager->tid, fiber_manager_gettid());
 
   fiber_managers[0] = main_manager;
   fiber_manager_threads[0] = pthread_self();
@@ -257,7 +1267,7 @@ int fiber_manager_init(size_t num_threads) {
   fiber_manager_state = FIBER_MANAGER_STATE_STARTED;
 
   size_t i;
-  for (i = 1; i < num_threads; ++i) {
+  for (i = 1; i < max_threads; ++i) {
     fiber_manager_t* const new_manager =
         fiber_manager_create(fiber_scheduler_for_thread(i));
     assert(new_manager);
@@ -265,22 +1275,38 @@ int fiber_manager_init(size_t num_threads) {
     fiber_managers[i] = new_manager;
   }
 
-  pthread_attr_t attr;
-  pthread_attr_init(&attr);
-  pthread_attr_setstacksize(&attr, 1024000);
+  fiber_manager_thread_per_core = options->thread_per_core;
+  fiber_manager_account_time = options->account_time;
+  fiber_manager_track_latency = options->track_latency;
+  fiber_manager_stamp_ready =
+      fiber_manager_account_time || fiber_manager_track_latency;
+  fiber_manager_shared_stack_size = options->shared_stack_size
+                                        ? options->shared_stack_size
+                                        : FIBER_MANAGER_SHARED_STACK_SIZE;
+  if (fiber_manager_thread_per_core) {
+    for (i = 0; i < max_threads; ++i) {
+      const int ret = fiber_manager_create_mailboxes(fiber_managers[i]);
+      (void)ret;
+      assert(ret && "failed to create mailboxes");
+      // the thread's own fiber (ie. main) must come back to its thread
+      fiber_managers[i]->thread_fiber->home_manager = i;
+    }
+  }
 
-  fiber_manager_threads[0] = pthread_self();
+  fiber_manager_pinning = options->pin_threads;
+  if (fiber_manager_pinning) {
+    fiber_manager_pin_thread(0);
+  }
+  fiber_manager_started_threads = 1;
   for (i = 1; i < num_threads; ++i) {
-    if (pthread_create(&fiber_manager_threads[i], &attr,
-                       &fiber_manager_thread_func, fiber_managers[i])) {
+    if (!fiber_manager_start_thread()) {
       assert(0 && "failed to create kernel thread");
       fiber_manager_state = FIBER_MANAGER_STATE_ERROR;
       abort();
       return FIBER_ERROR;
     }
   }
-
-  pthread_attr_destroy(&attr);
+  atomic_store(&fiber_manager_active_threads, num_threads);
 
   if (!fiber_io_init()) {
     return FIBER_ERROR;
@@ -288,22 +1314,379 @@ int fiber_manager_init(size_t num_threads) {
   if (!fiber_event_init()) {
     return FIBER_ERROR;
   }
+  // managers which went idle before events were ready aren't polling
+  fiber_manager_wake(main_manager);
+
+  return FIBER_SUCCESS;
+}
+
+// marks the running fiber for preemption if the manager hasn't switched fibers
+// since the previous signal
+static void fiber_manager_preempt_handler(int signum) {
+  fiber_manager_t* const manager = fiber_the_manager;
+  if (!manager) {
+    return;
+  }
+  const uint64_t switch_count = manager->switch_count;
+  if (switch_count == manager->preempt_switch_count) {
+    manager->preempt_requested = 1;
+  }
+  manager->preempt_switch_count = switch_count;
+}
+
+static int fiber_manager_preempt_installed = 0;
+static struct sigaction fiber_manager_old_preempt_action;
+
+static void fiber_manager_restore_preempt_handler() {
+  if (fiber_manager_preempt_installed) {
+    sigaction(FIBER_PREEMPT_SIGNAL, &fiber_manager_old_preempt_action, NULL);
+    fiber_manager_preempt_installed = 0;
+  }
+}
+
+#if defined(__linux__)
+static int fiber_manager_create_preempt_timer(int index) {
+  fiber_manager_t* const manager = fiber_managers[index];
+  pid_t tid;
+  while (!(tid = atomic_load(&manager->tid))) {
+    // the manager's thread is still starting up
+    sched_yield();
+  }
+  clockid_t clock;
+  const int error = pthread_getcpuclockid(fiber_manager_threads[index], &clock);
+  if (error) {
+    errno = error;
+    return FIBER_ERROR;
+  }
+  struct sigevent event;
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = FIBER_PREEMPT_SIGNAL;
+  event.sigev_notify_thread_id = tid;
+  if (timer_create(clock, &event, &manager->preempt_timer)) {
+    return FIBER_ERROR;
+  }
+  manager->has_preempt_timer = 1;
+  return FIBER_SUCCESS;
+}
+
+// sets manager index's timer to fire every fiber_manager_preempt_quantum,
+// creating the timer if needed
+static int fiber_manager_arm_preempt_timer(int index) {
+  fiber_manager_t* const manager = fiber_managers[index];
+  const uint64_t quantum_ns = fiber_manager_preempt_quantum;
+  if (!manager->has_preempt_timer) {
+    if (!quantum_ns) {
+      return FIBER_SUCCESS;
+    }
+    if (!fiber_manager_create_preempt_timer(index)) {
+      return FIBER_ERROR;
+    }
+  }
+  struct itimerspec spec;
+  spec.it_value.tv_sec = quantum_ns / 1000000000;
+  spec.it_value.tv_nsec = quantum_ns % 1000000000;
+  spec.it_interval = spec.it_value;
+  return timer_settime(manager->preempt_timer, 0, &spec, NULL) ? FIBER_ERROR
+                                                               : FIBER_SUCCESS;
+}
+
+int fiber_manager_set_preemption(uint64_t quantum_ns) {
+  if (fiber_manager_state != FIBER_MANAGER_STATE_STARTED) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  if (quantum_ns && !fiber_manager_preempt_installed) {
+    // replaces the application's handler, if any, until fiber_shutdown()
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &fiber_manager_preempt_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(FIBER_PREEMPT_SIGNAL, &action,
+                  &fiber_manager_old_preempt_action)) {
+      return FIBER_ERROR;
+    }
+    fiber_manager_preempt_installed = 1;
+  }
 
+  // threads started later get a timer when they start
+  fiber_manager_preempt_quantum = quantum_ns;
+  int i;
+  for (i = 0; i < fiber_manager_started_threads; ++i) {
+    if (!fiber_manager_arm_preempt_timer(i)) {
+      return FIBER_ERROR;
+    }
+  }
   return FIBER_SUCCESS;
 }
+#else
+static int fiber_manager_arm_preempt_timer(int index) {
+  // nothing - fiber_manager_set_preemption() never sets a quantum
+  return FIBER_SUCCESS;
+}
+
+int fiber_manager_set_preemption(uint64_t quantum_ns) {
+  errno = ENOSYS;
+  return FIBER_ERROR;
+}
+#endif
+
+int fiber_manager_submit_fiber(int manager, fiber_t* the_fiber) {
+  assert(the_fiber);
+  if (manager < 0 || manager >= atomic_load(&fiber_manager_active_threads)) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  the_fiber->home_manager = manager;
+  fiber_manager_schedule(fiber_manager_get(), the_fiber);
+  return FIBER_SUCCESS;
+}
+
+fiber_t* fiber_manager_submit(int manager, size_t stack_size,
+                              fiber_run_function_t run, void* param) {
+  if (manager < 0 || manager >= atomic_load(&fiber_manager_active_threads)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  fiber_t* const ret = fiber_create_no_sched(stack_size, run, param);
+  if (ret) {
+    fiber_manager_submit_fiber(manager, ret);
+  }
+  return ret;
+}
+
+void fiber_manager_preempt(fiber_manager_t* manager) {
+  assert(manager);
+  manager->preempt_requested = 0;
+  manager->preempt_count += 1;
+  fiber_manager_yield(manager);
+}
+
+static pthread_mutex_t fiber_manager_resize_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int fiber_manager_set_thread_count(size_t num_threads) {
+  if (fiber_manager_state != FIBER_MANAGER_STATE_STARTED || num_threads < 1 ||
+      num_threads > (size_t)fiber_manager_num_threads) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  pthread_mutex_lock(&fiber_manager_resize_lock);
+  int ret = FIBER_SUCCESS;
+  const int old_count = atomic_load(&fiber_manager_active_threads);
+  int i;
+  if ((int)num_threads > old_count) {
+    for (i = old_count; i < (int)num_threads; ++i) {
+      if (i < fiber_manager_started_threads) {
+        atomic_store(&fiber_managers[i]->retiring, 0);
+        // it's asleep in fiber_manager_retire()
+        fiber_manager_wake_target(fiber_managers[i]);
+      } else if (!fiber_manager_start_thread()) {
+        ret = FIBER_ERROR;
+        break;
+      }
+    }
+    atomic_store(&fiber_manager_active_threads, i);
+  } else {
+    for (i = num_threads; i < old_count; ++i) {
+      // fibers on a manager's shared stack can't run anywhere else
+      if (atomic_load(&fiber_managers[i]->shared_fiber_count)) {
+        pthread_mutex_unlock(&fiber_manager_resize_lock);
+        errno = EBUSY;
+        return FIBER_ERROR;
+      }
+    }
+    // nothing is handed to these managers once they're no longer active
+    atomic_store(&fiber_manager_active_threads, num_threads);
+    for (i = num_threads; i < old_count; ++i) {
+      atomic_store(&fiber_managers[i]->retiring, 1);
+      fiber_manager_wake_target(fiber_managers[i]);
+    }
+  }
+  pthread_mutex_unlock(&fiber_manager_resize_lock);
+  return ret;
+}
+
+fiber_shared_stack_t* fiber_manager_use_shared_stack(
+    fiber_manager_t* manager) {
+  assert(manager);
+  if (!manager->shared_stack) {
+    manager->shared_stack =
+        fiber_shared_stack_create(fiber_manager_shared_stack_size);
+    if (!manager->shared_stack) {
+      return NULL;
+    }
+  }
+  if (!atomic_fetch_add(&manager->shared_fiber_count, 1)) {
+    // fiber_manager_set_thread_count() checks the count under the same lock,
+    // so the manager is either retired already or won't be
+    pthread_mutex_lock(&fiber_manager_resize_lock);
+    const int retiring = atomic_load(&manager->retiring);
+    pthread_mutex_unlock(&fiber_manager_resize_lock);
+    if (retiring) {
+      atomic_fetch_sub(&manager->shared_fiber_count, 1);
+      errno = EAGAIN;
+      return NULL;
+    }
+  }
+  return manager->shared_stack;
+}
+
+void fiber_manager_release_shared_stack(fiber_manager_t* manager) {
+  assert(manager);
+  const size_t old_count = atomic_fetch_sub(&manager->shared_fiber_count, 1);
+  (void)old_count;
+  assert(old_count);
+}
+
+// the auto-scaler adds a manager when more fibers are queued than there are
+// active managers and they were idle for less than GROW_IDLE percent of the
+// interval. it retires one when they were idle for more than SHRINK_IDLE
+// percent.
+#define FIBER_MANAGER_AUTOSCALE_GROW_IDLE (5)
+#define FIBER_MANAGER_AUTOSCALE_SHRINK_IDLE (50)
+
+static pthread_mutex_t fiber_manager_autoscale_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fiber_manager_autoscale_cond;
+static pthread_t fiber_manager_autoscale_thread;
+static int fiber_manager_autoscale_running = 0;
+static size_t fiber_manager_autoscale_min = 1;
+static uint64_t fiber_manager_autoscale_interval = 0;
+
+// the time manager has spent blocked while idle, including the current sleep
+static uint64_t fiber_manager_idle_time(fiber_manager_t* manager,
+                                        uint64_t now) {
+  const uint64_t idle_since =
+      atomic_load_explicit(&manager->idle_since, memory_order_relaxed);
+  return manager->idle_ns + (idle_since && now > idle_since ? now - idle_since
+                                                            : 0);
+}
+
+// returns the idle time of all managers with threads, and sets *queued to the
+// number of fibers queued on the active ones
+static uint64_t fiber_manager_autoscale_sample(uint64_t now, uint64_t* queued) {
+  uint64_t idle_ns = 0;
+  int i;
+  for (i = 0; i < fiber_manager_started_threads; ++i) {
+    // retired managers aren't counted as idle, so they don't add to this
+    idle_ns += fiber_manager_idle_time(fiber_managers[i], now);
+  }
+  fiber_manager_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  const int active = atomic_load(&fiber_manager_active_threads);
+  for (i = 0; i < active; ++i) {
+    fiber_manager_stats(fiber_managers[i], &stats);
+  }
+  *queued = 0;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    *queued += stats.class_queue_depth[i];
+  }
+  return idle_ns;
+}
+
+static void* fiber_manager_autoscale_func(void* param) {
+  pthread_mutex_lock(&fiber_manager_autoscale_lock);
+  uint64_t queued = 0;
+  uint64_t last = fiber_manager_read_clock();
+  uint64_t last_idle_ns = fiber_manager_autoscale_sample(last, &queued);
+  while (fiber_manager_autoscale_interval) {
+    const uint64_t wake_at = last + fiber_manager_autoscale_interval;
+    struct timespec timeout;
+    timeout.tv_sec = wake_at / 1000000000;
+    timeout.tv_nsec = wake_at % 1000000000;
+    pthread_cond_timedwait(&fiber_manager_autoscale_cond,
+                           &fiber_manager_autoscale_lock, &timeout);
+    const uint64_t now = fiber_manager_read_clock();
+    if (!fiber_manager_autoscale_interval || now < wake_at) {
+      continue;
+    }
+    const uint64_t idle_ns = fiber_manager_autoscale_sample(now, &queued);
+    const int active = atomic_load(&fiber_manager_active_threads);
+    // percent of the managers' time spent idle since the last sample. the
+    // samples race with managers waking up, so they may go backwards a bit.
+    const uint64_t idle_delta =
+        idle_ns > last_idle_ns ? idle_ns - last_idle_ns : 0;
+    const uint64_t idle_percent = idle_delta * 100 / ((now - last) * active);
+    if (queued > (uint64_t)active &&
+        idle_percent < FIBER_MANAGER_AUTOSCALE_GROW_IDLE &&
+        active < fiber_manager_num_threads) {
+      fiber_manager_set_thread_count(active + 1);
+    } else if (idle_percent > FIBER_MANAGER_AUTOSCALE_SHRINK_IDLE &&
+               (size_t)active > fiber_manager_autoscale_min) {
+      fiber_manager_set_thread_count(active - 1);
+    }
+    last = now;
+    last_idle_ns = idle_ns;
+  }
+  pthread_mutex_unlock(&fiber_manager_autoscale_lock);
+  return NULL;
+}
+
+static void fiber_manager_stop_autoscale() {
+  pthread_mutex_lock(&fiber_manager_autoscale_lock);
+  const int running = fiber_manager_autoscale_running;
+  fiber_manager_autoscale_interval = 0;
+  fiber_manager_autoscale_running = 0;
+  pthread_cond_signal(&fiber_manager_autoscale_cond);
+  pthread_mutex_unlock(&fiber_manager_autoscale_lock);
+  if (running) {
+    pthread_join(fiber_manager_autoscale_thread, NULL);
+    pthread_cond_destroy(&fiber_manager_autoscale_cond);
+  }
+}
+
+int fiber_manager_autoscale(size_t min_threads, uint64_t interval_ns) {
+  if (fiber_manager_state != FIBER_MANAGER_STATE_STARTED) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  if (!interval_ns) {
+    fiber_manager_stop_autoscale();
+    return FIBER_SUCCESS;
+  }
+  pthread_mutex_lock(&fiber_manager_autoscale_lock);
+  fiber_manager_autoscale_min = min_threads ? min_threads : 1;
+  fiber_manager_autoscale_interval = interval_ns;
+  int error = 0;
+  if (!fiber_manager_autoscale_running) {
+    // the timeouts are read from the same clock as fiber_manager_read_clock()
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fiber_manager_autoscale_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    error = pthread_create(&fiber_manager_autoscale_thread, NULL,
+                           &fiber_manager_autoscale_func, NULL);
+    if (error) {
+      pthread_cond_destroy(&fiber_manager_autoscale_cond);
+      fiber_manager_autoscale_interval = 0;
+    } else {
+      fiber_manager_autoscale_running = 1;
+    }
+  }
+  pthread_mutex_unlock(&fiber_manager_autoscale_lock);
+  if (error) {
+    errno = error;
+    return FIBER_ERROR;
+  }
+  return FIBER_SUCCESS;
+}
+
+static void fiber_manager_forget_foreign_hptrs();
 
 void fiber_shutdown() {
   // Note: 'this_thread' is used instead of simply calling pthread_self()
   // because gcc will hoist the call to pthread_self() out of the loop and we'll
   // never terminate.
   while (!pthread_equal(this_thread, fiber_manager_threads[0])) {
-    should_check_events = false;
     fiber_yield();
     usleep(1000);
   }
+  fiber_manager_stop_autoscale();
   fiber_shutting_down = 1;
+  fiber_manager_wake_all();
   int i;
-  for (i = 1; i < fiber_manager_num_threads; ++i) {
+  for (i = 1; i < fiber_manager_started_threads; ++i) {
     pthread_join(fiber_manager_threads[i], NULL);
   }
 
@@ -319,10 +1702,24 @@ void fiber_shutdown() {
   }
   free(fiber_managers);
   fiber_managers = NULL;
+  // nothing refers to the backend's per-thread state any more
+  fiber_scheduler_shutdown();
+  mpsc_fifo_destroy(&fiber_manager_injected);
+  atomic_store(&fiber_manager_injected_count, 0);
+  fiber_manager_thread_per_core = 0;
+  fiber_manager_account_time = 0;
+  fiber_manager_track_latency = 0;
+  fiber_manager_stamp_ready = 0;
+  fiber_manager_shared_stack_size = FIBER_MANAGER_SHARED_STACK_SIZE;
+  fiber_manager_started_threads = 0;
+  atomic_store(&fiber_manager_active_threads, 0);
+  fiber_manager_preempt_quantum = 0;
+  fiber_manager_restore_preempt_handler();
   free(fiber_manager_threads);
   fiber_manager_threads = NULL;
   lockfree_ring_buffer_destroy(fiber_free_mpmc_nodes);
   fiber_free_mpmc_nodes = NULL;
+  fiber_manager_forget_foreign_hptrs();
   hazard_pointer_thread_record_destroy_all(fiber_hazard_head);
   fiber_hazard_head = NULL;
 
@@ -333,7 +1730,7 @@ void fiber_shutdown() {
 int fiber_manager_get_state() { return fiber_manager_state; }
 
 int fiber_manager_get_kernel_thread_count() {
-  return fiber_manager_num_threads;
+  return atomic_load(&fiber_manager_active_threads);
 }
 
 extern int fiber_mutex_unlock_internal(fiber_mutex_t* mutex);
@@ -353,7 +1750,11 @@ void fiber_manager_do_maintenance() {
 
   if (manager->to_schedule) {
     assert(manager->to_schedule->state == FIBER_STATE_READY);
-    fiber_scheduler_schedule(manager->scheduler, manager->to_schedule);
+    // it was switched out this round, so the round's clock is current
+    if (fiber_manager_stamp_ready && !manager->to_schedule->ready_since) {
+      manager->to_schedule->ready_since = fiber_manager_clock(manager);
+    }
+    fiber_manager_requeue(manager, manager->to_schedule);
     manager->to_schedule = NULL;
   }
 
@@ -413,11 +1814,13 @@ int fiber_manager_wake_from_mpmc_queue(fiber_manager_t* manager,
       fiber_t* const to_schedule = (fiber_t*)out;
       assert(to_schedule->state == FIBER_STATE_WAITING);
       to_schedule->state = FIBER_STATE_READY;
-      fiber_manager_schedule(manager, to_schedule);
+      fiber_manager_schedule_next(manager, to_schedule);
       wake_count += 1;
     } else if (count > 0) {
       cpu_relax();  // back off if we failed to pop something
-      manager->wake_mpmc_spin_count += 1;
+      if (manager) {
+        manager->wake_mpmc_spin_count += 1;
+      }
     }
   } while (wake_count < count);
   return wake_count;
@@ -458,12 +1861,15 @@ int fiber_manager_wake_from_mpsc_queue(fiber_manager_t* manager,
       if (to_schedule->state == FIBER_STATE_WAITING) {
         to_schedule->state = FIBER_STATE_READY;
       }
-      fiber_manager_schedule(manager, to_schedule);
+      fiber_manager_schedule_next(manager, to_schedule);
       wake_count += 1;
-    } else if (count > 0) {
+    } else if (count > 0 && manager) {
       manager->wake_mpsc_spin_count += 1;
       fiber_manager_yield(manager);
       manager = fiber_manager_get();
+    } else if (count > 0) {
+      // not a manager thread, so there's nothing to yield to
+      cpu_relax();
     }
   } while (wake_count < count);
   return wake_count;
@@ -513,9 +1919,92 @@ void fiber_do_real_sleep(uint32_t seconds, uint32_t useconds) {
   }
 }
 
+// threads which aren't managers get a record of their own. records can't be
+// unlinked from the list other threads scan, so a thread's record is put aside
+// when it exits and handed to the next thread which needs one. the generation
+// changes at shutdown, which frees every record, so stale ones are dropped.
+static __thread hazard_pointer_thread_record_t* fiber_foreign_hptr = NULL;
+static __thread uint64_t fiber_foreign_hptr_generation = 0;
+static pthread_once_t fiber_foreign_hptr_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fiber_foreign_hptr_key;
+// guards the spare records and the generation
+static pthread_mutex_t fiber_foreign_hptr_lock = PTHREAD_MUTEX_INITIALIZER;
+static hazard_pointer_thread_record_t** fiber_spare_hptrs = NULL;
+static size_t fiber_spare_hptr_count = 0;
+static size_t fiber_spare_hptr_capacity = 0;
+static _Atomic uint64_t fiber_hptr_generation = 1;
+
+static void fiber_manager_release_foreign_hptr(void* param) {
+  hazard_pointer_thread_record_t* const hptr =
+      (hazard_pointer_thread_record_t*)param;
+  pthread_mutex_lock(&fiber_foreign_hptr_lock);
+  if (fiber_foreign_hptr_generation == atomic_load(&fiber_hptr_generation)) {
+    // best effort; whatever is still hazardous waits for the next owner
+    hazard_pointer_scan(hptr);
+    if (fiber_spare_hptr_count == fiber_spare_hptr_capacity) {
+      const size_t new_capacity =
+          fiber_spare_hptr_capacity ? 2 * fiber_spare_hptr_capacity : 4;
+      hazard_pointer_thread_record_t** const new_spares = realloc(
+          fiber_spare_hptrs, new_capacity * sizeof(*fiber_spare_hptrs));
+      if (new_spares) {
+        fiber_spare_hptrs = new_spares;
+        fiber_spare_hptr_capacity = new_capacity;
+      }
+    }
+    // out of memory leaks the record, as before
+    if (fiber_spare_hptr_count < fiber_spare_hptr_capacity) {
+      fiber_spare_hptrs[fiber_spare_hptr_count++] = hptr;
+    }
+  }
+  pthread_mutex_unlock(&fiber_foreign_hptr_lock);
+  fiber_foreign_hptr = NULL;
+}
+
+static void fiber_manager_init_foreign_hptr_key() {
+  const int ret = pthread_key_create(&fiber_foreign_hptr_key,
+                                     &fiber_manager_release_foreign_hptr);
+  (void)ret;
+  assert(!ret);
+}
+
+static hazard_pointer_thread_record_t* fiber_manager_get_foreign_hptr() {
+  if (fiber_foreign_hptr &&
+      fiber_foreign_hptr_generation ==
+          atomic_load_explicit(&fiber_hptr_generation, memory_order_relaxed)) {
+    return fiber_foreign_hptr;
+  }
+  pthread_once(&fiber_foreign_hptr_once, &fiber_manager_init_foreign_hptr_key);
+  pthread_mutex_lock(&fiber_foreign_hptr_lock);
+  hazard_pointer_thread_record_t* hptr =
+      fiber_spare_hptr_count ? fiber_spare_hptrs[--fiber_spare_hptr_count]
+                             : NULL;
+  if (!hptr) {
+    hptr = hazard_pointer_thread_record_create_and_push(
+        &fiber_hazard_head, FIBER_MANAGER_MAX_HAZARDS);
+  }
+  fiber_foreign_hptr_generation = atomic_load(&fiber_hptr_generation);
+  pthread_mutex_unlock(&fiber_foreign_hptr_lock);
+  fiber_foreign_hptr = hptr;
+  pthread_setspecific(fiber_foreign_hptr_key, hptr);
+  return hptr;
+}
+
+// called at shutdown, once every record is about to be freed
+static void fiber_manager_forget_foreign_hptrs() {
+  pthread_mutex_lock(&fiber_foreign_hptr_lock);
+  free(fiber_spare_hptrs);
+  fiber_spare_hptrs = NULL;
+  fiber_spare_hptr_count = 0;
+  fiber_spare_hptr_capacity = 0;
+  atomic_fetch_add(&fiber_hptr_generation, 1);
+  pthread_mutex_unlock(&fiber_foreign_hptr_lock);
+}
+
 hazard_pointer_thread_record_t* fiber_manager_get_hazard_record(
     fiber_manager_t* manager) {
-  assert(manager);
+  if (!manager) {
+    return fiber_manager_get_foreign_hptr();
+  }
   if (!manager->mpmc_hptr) {
     manager->mpmc_hptr = hazard_pointer_thread_record_create_and_push(
         &fiber_hazard_head, FIBER_MANAGER_MAX_HAZARDS);
@@ -566,7 +2055,8 @@ void fiber_manager_stats(fiber_manager_t* manager, fiber_manager_stats_t* out) {
   assert(out);
   out->yield_count += manager->yield_count;
   fiber_scheduler_stats(manager->scheduler, &out->steal_count,
-                        &out->failed_steal_count);
+                        &out->failed_steal_count, out->level_steal_count,
+                        out->class_queue_depth);
   out->spin_count += manager->spin_count;
   out->signal_spin_count += manager->signal_spin_count;
   out->multi_signal_spin_count += manager->multi_signal_spin_count;
@@ -575,6 +2065,35 @@ void fiber_manager_stats(fiber_manager_t* manager, fiber_manager_stats_t* out) {
   out->poll_count += manager->poll_count;
   out->event_wait_count += manager->event_wait_count;
   out->lock_contention_count += manager->lock_contention_count;
+  out->park_count += manager->park_count;
+  out->runnext_count += manager->runnext_count;
+  out->runnext_steal_count += manager->runnext_steal_count;
+  out->sleep_count += manager->sleep_count;
+  out->wake_count += manager->wake_count;
+  out->deadline_miss_count += manager->deadline_miss_count;
+  out->preempt_count += manager->preempt_count;
+  out->sent_home_count += manager->sent_home_count;
+  out->injected_count += manager->injected_count;
+  out->reused_fiber_count += manager->reused_fiber_count;
+  out->returned_fiber_count += manager->returned_fiber_count;
+  if (manager->shared_stack) {
+    out->stack_copy_count += manager->shared_stack->copy_count;
+    out->stack_copied_bytes += manager->shared_stack->copied_bytes;
+  }
+  out->idle_ns += fiber_manager_idle_time(manager, fiber_manager_read_clock());
+  out->retire_count += manager->retire_count;
+  int i;
+  for (i = 0; i < FIBER_MANAGER_HISTOGRAM_BUCKETS; ++i) {
+    out->run_length_histogram[i] += manager->run_length_histogram[i];
+    out->latency_histogram[i] += manager->latency_histogram[i];
+  }
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    out->class_run_count[i] += manager->class_run_count[i];
+    out->class_latency_sum[i] += manager->class_latency_sum[i];
+    if (manager->class_latency_max[i] > out->class_latency_max[i]) {
+      out->class_latency_max[i] = manager->class_latency_max[i];
+    }
+  }
 }
 
 void fiber_manager_all_stats(fiber_manager_stats_t* out) {
@@ -586,3 +2105,57 @@ void fiber_manager_all_stats(fiber_manager_stats_t* out) {
     }
   }
 }
+
+uint64_t fiber_manager_histogram_percentile(const uint64_t* histogram,
+                                           double percentile) {
+  assert(histogram);
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < FIBER_MANAGER_HISTOGRAM_BUCKETS; ++i) {
+    total += histogram[i];
+  }
+  if (!total) {
+    return 0;
+  }
+  // the rank of the wanted sample, counting from 1
+  const double exact = percentile * total / 100;
+  uint64_t rank = exact > 0 ? (uint64_t)exact : 0;
+  if (rank < exact) {
+    rank += 1;
+  }
+  if (!rank) {
+    rank = 1;
+  } else if (rank > total) {
+    rank = total;
+  }
+  uint64_t seen = 0;
+  for (i = 0; i < FIBER_MANAGER_HISTOGRAM_BUCKETS - 1; ++i) {
+    seen += histogram[i];
+    if (seen >= rank) {
+      return 1000ULL << i;
+    }
+  }
+  return UINT64_MAX;
+}
+
+void fiber_manager_latency_histogram(uint64_t* out) {
+  assert(out);
+  memset(out, 0, FIBER_MANAGER_HISTOGRAM_BUCKETS * sizeof(*out));
+  if (!fiber_managers) {
+    return;
+  }
+  int i;
+  for (i = 0; i < fiber_manager_num_threads; ++i) {
+    const fiber_manager_t* const manager = fiber_managers[i];
+    int j;
+    for (j = 0; j < FIBER_MANAGER_HISTOGRAM_BUCKETS; ++j) {
+      out[j] += manager->latency_histogram[j];
+    }
+  }
+}
+
+uint64_t fiber_manager_latency_percentile(double percentile) {
+  uint64_t histogram[FIBER_MANAGER_HISTOGRAM_BUCKETS];
+  fiber_manager_latency_histogram(histogram);
+  return fiber_manager_histogram_percentile(histogram, percentile);
+}
@@ -4,6 +4,7 @@
 #include "fiber_mutex.h"
 
 #include "fiber_manager.h"
+#include "schedule_lock.h"
 
 int fiber_mutex_init(fiber_mutex_t* mutex) {
   assert(mutex);
@@ -11,6 +12,11 @@ int fiber_mutex_init(fiber_mutex_t* mutex) {
   if (!mpsc_fifo_init(&mutex->waiters)) {
     return FIBER_ERROR;
   }
+  mutex->schedule_lock = schedule_lock_create(mutex);
+  if (!mutex->schedule_lock) {
+    mpsc_fifo_destroy(&mutex->waiters);
+    return FIBER_ERROR;
+  }
   return FIBER_SUCCESS;
 }
 
@@ -18,23 +24,32 @@ int fiber_mutex_destroy(fiber_mutex_t* mutex) {
   assert(mutex);
   mutex->counter = 1;
   mpsc_fifo_destroy(&mutex->waiters);
+  schedule_lock_destroy(mutex->schedule_lock);
+  mutex->schedule_lock = NULL;
   return FIBER_SUCCESS;
 }
 
 int fiber_mutex_lock(fiber_mutex_t* mutex) {
   assert(mutex);
 
+  schedule_lock_entry_t* const entry = mutex->schedule_lock;
+  schedule_lock_enter(entry);
+
   const int val = atomic_fetch_sub(&mutex->counter, 1) - 1;
   if (val == 0) {
     // we just got the lock, there was no contention
+    schedule_lock_acquired(entry, 0);
     return FIBER_SUCCESS;
   }
 
   // we failed to acquire the lock (there's contention). we'll wait.
+  schedule_lock_contend(entry);
   fiber_manager_t* const manager = fiber_manager_get();
   manager->lock_contention_count += 1;
+  fiber_manager_set_wait_kind(manager, FIBER_TIME_LOCK);
   fiber_manager_wait_in_mpsc_queue(manager, &mutex->waiters);
 
+  schedule_lock_acquired(entry, 1);
   return FIBER_SUCCESS;
 }
 
@@ -45,6 +60,7 @@ int fiber_mutex_trylock(fiber_mutex_t* mutex) {
                                             memory_order_acquire,
                                             memory_order_relaxed)) {
     // we just got the lock, there was no contention
+    schedule_lock_acquired(mutex->schedule_lock, 0);
     return FIBER_SUCCESS;
   }
   return FIBER_ERROR;
@@ -56,6 +72,8 @@ int fiber_mutex_unlock_internal(fiber_mutex_t* mutex) {
   // assumption: the atomic operation below provides read/write ordering (ie.
   // read and writes performed before unlocking actually occur before unlocking)
 
+  schedule_lock_released(mutex->schedule_lock);
+
   // unlock and wake a waiting fiber if there is one
   const int new_val = atomic_fetch_add(&mutex->counter, 1) + 1;
   if (new_val != 1) {
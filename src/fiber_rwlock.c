@@ -4,6 +4,7 @@
 #include "fiber_rwlock.h"
 
 #include "fiber_manager.h"
+#include "schedule_lock.h"
 
 #ifdef __GNUC__
 #define STATIC_ASSERT_HELPER(expr, msg) \
@@ -28,11 +29,26 @@ int fiber_rwlock_init(fiber_rwlock_t* rwlock) {
     return FIBER_ERROR;
   }
   rwlock->state.blob = 0;
+  // bans on writing refer to the lock, and bans on reading to its read queue
+  rwlock->write_schedule_lock = schedule_lock_create(rwlock);
+  rwlock->read_schedule_lock =
+      rwlock->write_schedule_lock
+          ? schedule_lock_create_shared(&rwlock->read_waiters,
+                                        rwlock->write_schedule_lock)
+          : NULL;
+  if (!rwlock->read_schedule_lock) {
+    fiber_rwlock_destroy(rwlock);
+    return FIBER_ERROR;
+  }
   return FIBER_SUCCESS;
 }
 
 void fiber_rwlock_destroy(fiber_rwlock_t* rwlock) {
   if (rwlock) {
+    schedule_lock_destroy(rwlock->read_schedule_lock);
+    schedule_lock_destroy(rwlock->write_schedule_lock);
+    rwlock->read_schedule_lock = NULL;
+    rwlock->write_schedule_lock = NULL;
     mpsc_fifo_destroy(&rwlock->write_waiters);
     mpsc_fifo_destroy(&rwlock->read_waiters);
   }
@@ -40,7 +56,10 @@ void fiber_rwlock_destroy(fiber_rwlock_t* rwlock) {
 
 int fiber_rwlock_rdlock(fiber_rwlock_t* rwlock) {
   assert(rwlock);
+  schedule_lock_entry_t* const entry = rwlock->read_schedule_lock;
+  schedule_lock_enter(entry);
 
+  int contended = 0;
   fiber_rwlock_state_t current_state;
   while (1) {
     const uint64_t snapshot = rwlock->state.blob;
@@ -52,6 +71,9 @@ int fiber_rwlock_rdlock(fiber_rwlock_t* rwlock) {
       if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                        current_state.blob)) {
         // currently write locked or a writer is waiting - be friendly and wait
+        schedule_lock_contend(entry);
+        contended = 1;
+        fiber_manager_set_wait_kind(fiber_manager_get(), FIBER_TIME_LOCK);
         fiber_manager_wait_in_mpsc_queue(fiber_manager_get(),
                                          &rwlock->read_waiters);
         break;
@@ -65,12 +87,16 @@ int fiber_rwlock_rdlock(fiber_rwlock_t* rwlock) {
       }
     }
   }
+  schedule_lock_shared_acquired(entry, contended);
   return FIBER_SUCCESS;
 }
 
 int fiber_rwlock_wrlock(fiber_rwlock_t* rwlock) {
   assert(rwlock);
+  schedule_lock_entry_t* const entry = rwlock->write_schedule_lock;
+  schedule_lock_enter(entry);
 
+  int contended = 0;
   fiber_rwlock_state_t current_state;
   while (1) {
     const uint64_t snapshot = rwlock->state.blob;
@@ -80,6 +106,9 @@ int fiber_rwlock_wrlock(fiber_rwlock_t* rwlock) {
       if (__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot,
                                        current_state.blob)) {
         // currently locked or a reader is waiting - be friendly and wait
+        schedule_lock_contend(entry);
+        contended = 1;
+        fiber_manager_set_wait_kind(fiber_manager_get(), FIBER_TIME_LOCK);
         fiber_manager_wait_in_mpsc_queue(fiber_manager_get(),
                                          &rwlock->write_waiters);
         break;
@@ -93,6 +122,7 @@ int fiber_rwlock_wrlock(fiber_rwlock_t* rwlock) {
       }
     }
   }
+  schedule_lock_acquired(entry, contended);
   return FIBER_SUCCESS;
 }
 
@@ -114,6 +144,7 @@ int fiber_rwlock_tryrdlock(fiber_rwlock_t* rwlock) {
       break;
     }
   }
+  schedule_lock_shared_acquired(rwlock->read_schedule_lock, 0);
   return FIBER_SUCCESS;
 }
 
@@ -133,11 +164,13 @@ int fiber_rwlock_trywrlock(fiber_rwlock_t* rwlock) {
       break;
     }
   }
+  schedule_lock_acquired(rwlock->write_schedule_lock, 0);
   return FIBER_SUCCESS;
 }
 
 int fiber_rwlock_rdunlock(fiber_rwlock_t* rwlock) {
   assert(rwlock);
+  schedule_lock_shared_released(rwlock->read_schedule_lock);
 
   fiber_rwlock_state_t current_state;
   while (1) {
@@ -185,6 +218,7 @@ int fiber_rwlock_rdunlock(fiber_rwlock_t* rwlock) {
 
 int fiber_rwlock_wrunlock(fiber_rwlock_t* rwlock) {
   assert(rwlock);
+  schedule_lock_released(rwlock->write_schedule_lock);
 
   fiber_rwlock_state_t current_state;
   while (1) {
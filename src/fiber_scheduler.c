@@ -0,0 +1,65 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_scheduler.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+static const fiber_scheduler_ops_t* const fiber_scheduler_backends[] = {
+    &fiber_scheduler_wsd_ops,
+    &fiber_scheduler_dist_ops,
+    &fiber_scheduler_edf_ops,
+    &fiber_scheduler_tpc_ops,
+    NULL,
+};
+
+const fiber_scheduler_ops_t* fiber_scheduler_ops = &fiber_scheduler_wsd_ops;
+
+static int fiber_scheduler_initialized = 0;
+
+const fiber_scheduler_ops_t* fiber_scheduler_find(const char* name) {
+  if (!name) {
+    return NULL;
+  }
+  size_t i;
+  for (i = 0; fiber_scheduler_backends[i]; ++i) {
+    if (!strcmp(fiber_scheduler_backends[i]->name, name)) {
+      return fiber_scheduler_backends[i];
+    }
+  }
+  return NULL;
+}
+
+int fiber_scheduler_select(const char* name) {
+  const fiber_scheduler_ops_t* const ops =
+      fiber_scheduler_find(name ? name : FIBER_SCHEDULER_DEFAULT);
+  if (!ops) {
+    errno = EINVAL;
+    return FIBER_ERROR;
+  }
+  if (fiber_scheduler_initialized) {
+    errno = EBUSY;
+    return FIBER_ERROR;
+  }
+  fiber_scheduler_ops = ops;
+  return FIBER_SUCCESS;
+}
+
+int fiber_scheduler_init(size_t num_threads) {
+  assert(!fiber_scheduler_initialized);
+  if (!fiber_topology_init() || !fiber_scheduler_ops->init(num_threads)) {
+    return FIBER_ERROR;
+  }
+  fiber_scheduler_initialized = 1;
+  return FIBER_SUCCESS;
+}
+
+void fiber_scheduler_shutdown() {
+  if (fiber_scheduler_initialized) {
+    fiber_scheduler_ops->shutdown();
+    fiber_scheduler_initialized = 0;
+  }
+  fiber_topology_shutdown();
+}
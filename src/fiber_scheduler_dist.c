@@ -3,12 +3,18 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "dist_fifo.h"
 #include "fiber_scheduler.h"
 
 typedef struct fiber_scheduler_dist {
-  dist_fifo_t queue;
+  // one queue per priority class. dist_fifo_t must stay aligned, so these
+  // come first.
+  dist_fifo_t queues[FIBER_PRIORITY_CLASSES];
+  // roughly how many fibers each queue holds, for the stats
+  _Atomic uint64_t sizes[FIBER_PRIORITY_CLASSES];
+  fiber_scheduler_priority_t priority;
   size_t id;
   uint64_t steal_count;
   uint64_t failed_steal_count;
@@ -17,23 +23,35 @@ typedef struct fiber_scheduler_dist {
 static size_t fiber_scheduler_num_threads = 0;
 static fiber_scheduler_dist_t* fiber_schedulers = NULL;
 
-static int fiber_scheduler_dist_init(fiber_scheduler_dist_t* scheduler,
-                                     size_t id) {
+static int fiber_scheduler_dist_init_thread(fiber_scheduler_dist_t* scheduler,
+                                            size_t id) {
   assert(scheduler);
   scheduler->id = id;
   scheduler->steal_count = 0;
   scheduler->failed_steal_count = 0;
-  if (!dist_fifo_init(&scheduler->queue)) {
-    return 0;
+  memset(&scheduler->priority, 0, sizeof(scheduler->priority));
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    atomic_init(&scheduler->sizes[i], 0);
+    if (!dist_fifo_init(&scheduler->queues[i])) {
+      while (i-- > 0) {
+        dist_fifo_destroy(&scheduler->queues[i]);
+      }
+      return 0;
+    }
   }
   return 1;
 }
 
-static void fiber_scheduler_dist_destroy(fiber_scheduler_dist_t* scheduler) {
-  dist_fifo_destroy(&scheduler->queue);
+static void fiber_scheduler_dist_destroy_thread(
+    fiber_scheduler_dist_t* scheduler) {
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    dist_fifo_destroy(&scheduler->queues[i]);
+  }
 }
 
-int fiber_scheduler_init(size_t num_threads) {
+static int fiber_scheduler_dist_init(size_t num_threads) {
   assert(num_threads > 0);
   fiber_scheduler_num_threads = num_threads;
 
@@ -43,53 +61,57 @@ int fiber_scheduler_init(size_t num_threads) {
 
   size_t i;
   for (i = 0; i < num_threads; ++i) {
-    const int ret = fiber_scheduler_dist_init(&fiber_schedulers[i], i);
+    const int ret = fiber_scheduler_dist_init_thread(&fiber_schedulers[i], i);
     (void)ret;
     assert(ret);
   }
   return 1;
 }
 
-void fiber_scheduler_shutdown() {
+static void fiber_scheduler_dist_shutdown() {
   size_t i;
   for (i = 0; i < fiber_scheduler_num_threads; ++i) {
-    fiber_scheduler_dist_destroy(&fiber_schedulers[i]);
+    fiber_scheduler_dist_destroy_thread(&fiber_schedulers[i]);
   }
   free(fiber_schedulers);
   fiber_schedulers = NULL;
 }
 
-fiber_scheduler_t* fiber_scheduler_for_thread(size_t thread_id) {
+static fiber_scheduler_t* fiber_scheduler_dist_for_thread(size_t thread_id) {
   assert(fiber_schedulers);
   assert(thread_id < fiber_scheduler_num_threads);
   return (fiber_scheduler_t*)&fiber_schedulers[thread_id];
 }
 
-void fiber_scheduler_schedule(fiber_scheduler_t* scheduler,
-                              fiber_t* the_fiber) {
+static void fiber_scheduler_dist_schedule(fiber_scheduler_t* scheduler,
+                                          fiber_t* the_fiber) {
   assert(scheduler);
   assert(the_fiber);
   mpsc_fifo_node_t* const node = the_fiber->mpsc_fifo_node;
   assert(node);
   the_fiber->mpsc_fifo_node = NULL;
   node->data = the_fiber;
-  dist_fifo_push(&((fiber_scheduler_dist_t*)scheduler)->queue, node);
+  assert(the_fiber->priority >= 0 &&
+         the_fiber->priority < FIBER_PRIORITY_CLASSES);
+  fiber_scheduler_dist_t* const dist_scheduler =
+      (fiber_scheduler_dist_t*)scheduler;
+  atomic_fetch_add_explicit(&dist_scheduler->sizes[the_fiber->priority], 1,
+                            memory_order_relaxed);
+  dist_fifo_push(&dist_scheduler->queues[the_fiber->priority], node);
 }
 
-fiber_t* fiber_scheduler_next(fiber_scheduler_t* sched) {
-  fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
-  assert(scheduler);
+static fiber_t* fiber_scheduler_dist_next_in_class(dist_fifo_t* queue) {
   dist_fifo_node_t* node = NULL;
   while (1) {
     do {
-      node = dist_fifo_trypop(&scheduler->queue);
+      node = dist_fifo_trypop(queue);
     } while (node == DIST_FIFO_RETRY);
     if (!node) {
       break;
     }
     fiber_t* const new_fiber = (fiber_t*)node->data;
     if (new_fiber->state == FIBER_STATE_SAVING_STATE_TO_WAIT) {
-      dist_fifo_push(&scheduler->queue, node);
+      dist_fifo_push(queue, node);
     } else {
       new_fiber->mpsc_fifo_node = node;
       return new_fiber;
@@ -98,36 +120,95 @@ fiber_t* fiber_scheduler_next(fiber_scheduler_t* sched) {
   return NULL;
 }
 
-void fiber_scheduler_load_balance(fiber_scheduler_t* sched) {
+static fiber_t* fiber_scheduler_dist_next(fiber_scheduler_t* sched) {
+  fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
+  assert(scheduler);
+  const int aged = fiber_scheduler_priority_aged(&scheduler->priority);
+  if (aged >= 0) {
+    fiber_t* const new_fiber =
+        fiber_scheduler_dist_next_in_class(&scheduler->queues[aged]);
+    if (new_fiber) {
+      atomic_fetch_sub_explicit(&scheduler->sizes[aged], 1,
+                                memory_order_relaxed);
+      fiber_scheduler_priority_ran(&scheduler->priority, aged);
+      return new_fiber;
+    }
+  }
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    fiber_t* const new_fiber =
+        fiber_scheduler_dist_next_in_class(&scheduler->queues[i]);
+    if (new_fiber) {
+      atomic_fetch_sub_explicit(&scheduler->sizes[i], 1, memory_order_relaxed);
+      fiber_scheduler_priority_ran(&scheduler->priority, i);
+      return new_fiber;
+    }
+  }
+  return NULL;
+}
+
+static void fiber_scheduler_dist_load_balance(fiber_scheduler_t* sched) {
   fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
   size_t max_steal = 16;
-  size_t i = scheduler->id + 1;
-  const size_t end = i + fiber_scheduler_num_threads - 1;
+  size_t i;
+  const size_t end = scheduler->id + fiber_scheduler_num_threads;
   const size_t mod = fiber_scheduler_num_threads;
-  for (; i < end; ++i) {
-    const size_t index = i % mod;
-    dist_fifo_t* const remote_queue = &fiber_schedulers[index].queue;
-    assert(remote_queue != &scheduler->queue);
-    if (!remote_queue) {
-      continue;
-    }
-    while (max_steal > 0) {
-      dist_fifo_node_t* const stolen = dist_fifo_trypop(remote_queue);
-      if (stolen == DIST_FIFO_EMPTY || stolen == DIST_FIFO_RETRY) {
-        ++scheduler->failed_steal_count;
-        break;
+  // take the highest priority class any other thread has first
+  int priority;
+  for (priority = 0; priority < FIBER_PRIORITY_CLASSES; ++priority) {
+    dist_fifo_t* const local_queue = &scheduler->queues[priority];
+    for (i = scheduler->id + 1; i < end; ++i) {
+      const size_t index = i % mod;
+      dist_fifo_t* const remote_queue =
+          &fiber_schedulers[index].queues[priority];
+      assert(remote_queue != local_queue);
+      while (max_steal > 0) {
+        dist_fifo_node_t* const stolen = dist_fifo_trypop(remote_queue);
+        if (stolen == DIST_FIFO_EMPTY || stolen == DIST_FIFO_RETRY) {
+          ++scheduler->failed_steal_count;
+          break;
+        }
+        atomic_fetch_sub_explicit(&fiber_schedulers[index].sizes[priority], 1,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&scheduler->sizes[priority], 1,
+                                  memory_order_relaxed);
+        dist_fifo_push(local_queue, stolen);
+        --max_steal;
+        ++scheduler->steal_count;
       }
-      dist_fifo_push(&scheduler->queue, stolen);
-      --max_steal;
-      ++scheduler->steal_count;
     }
   }
 }
 
-void fiber_scheduler_stats(fiber_scheduler_t* sched, uint64_t* steal_count,
-                           uint64_t* failed_steal_count) {
+static int fiber_scheduler_dist_pending(fiber_scheduler_t* sched) {
+  // next() waits for fibers which are switching out, so none are left behind
+  return 0;
+}
+
+static void fiber_scheduler_dist_stats(fiber_scheduler_t* sched,
+                                       uint64_t* steal_count,
+                                       uint64_t* failed_steal_count,
+                                       uint64_t* level_steal_count,
+                                       uint64_t* class_queue_depth) {
   fiber_scheduler_dist_t* const scheduler = (fiber_scheduler_dist_t*)sched;
   assert(scheduler);
   *steal_count += scheduler->steal_count;
   *failed_steal_count += scheduler->failed_steal_count;
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    class_queue_depth[i] +=
+        atomic_load_explicit(&scheduler->sizes[i], memory_order_relaxed);
+  }
 }
+
+const fiber_scheduler_ops_t fiber_scheduler_dist_ops = {
+    .name = "dist",
+    .init = &fiber_scheduler_dist_init,
+    .shutdown = &fiber_scheduler_dist_shutdown,
+    .for_thread = &fiber_scheduler_dist_for_thread,
+    .schedule = &fiber_scheduler_dist_schedule,
+    .next = &fiber_scheduler_dist_next,
+    .load_balance = &fiber_scheduler_dist_load_balance,
+    .pending = &fiber_scheduler_dist_pending,
+    .stats = &fiber_scheduler_dist_stats,
+};
@@ -0,0 +1,377 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fiber_scheduler.h"
+#include "fiber_spinlock.h"
+
+// a queued fiber. fibers without a deadline sort after all the others, and
+// fibers with the same deadline run in the order they were scheduled.
+typedef struct fiber_scheduler_edf_entry {
+  uint64_t deadline;
+  uint64_t sequence;
+  fiber_t* fiber;
+} fiber_scheduler_edf_entry_t;
+
+// a min-heap of one priority class's fibers, ordered by deadline
+typedef struct fiber_scheduler_edf_heap {
+  fiber_scheduler_edf_entry_t* entries;
+  size_t size;
+  size_t capacity;
+} fiber_scheduler_edf_heap_t;
+
+typedef struct fiber_scheduler_edf {
+  // protects the heaps. the owning thread locks it, others only try to.
+  fiber_spinlock_t lock;
+  fiber_scheduler_edf_heap_t heaps[FIBER_PRIORITY_CLASSES];
+  // earliest deadline in each heap, readable without the lock
+  _Atomic uint64_t earliest[FIBER_PRIORITY_CLASSES];
+  _Atomic size_t sizes[FIBER_PRIORITY_CLASSES];
+  fiber_scheduler_priority_t priority;
+  uint64_t sequence;
+  // fibers popped while still switching out, put back after next()
+  fiber_scheduler_edf_entry_t* deferred;
+  size_t deferred_capacity;
+  size_t id;
+  uint64_t steal_count;
+  uint64_t failed_steal_count;
+} fiber_scheduler_edf_t;
+
+// load balancing takes at most this many fibers at a time
+#define FIBER_SCHEDULER_EDF_MAX_STEAL (16)
+#define FIBER_SCHEDULER_EDF_NO_DEADLINE (UINT64_MAX)
+
+static size_t fiber_scheduler_num_threads = 0;
+static fiber_scheduler_edf_t* fiber_schedulers = NULL;
+
+static inline int fiber_scheduler_edf_before(
+    const fiber_scheduler_edf_entry_t* a,
+    const fiber_scheduler_edf_entry_t* b) {
+  return a->deadline < b->deadline ||
+         (a->deadline == b->deadline && a->sequence < b->sequence);
+}
+
+static int fiber_scheduler_edf_heap_push(
+    fiber_scheduler_edf_heap_t* heap,
+    const fiber_scheduler_edf_entry_t* entry) {
+  if (heap->size == heap->capacity) {
+    const size_t new_capacity = heap->capacity ? 2 * heap->capacity : 64;
+    fiber_scheduler_edf_entry_t* const new_entries =
+        realloc(heap->entries, new_capacity * sizeof(*new_entries));
+    if (!new_entries) {
+      return 0;
+    }
+    heap->entries = new_entries;
+    heap->capacity = new_capacity;
+  }
+  fiber_scheduler_edf_entry_t* const entries = heap->entries;
+  size_t i = heap->size++;
+  while (i > 0) {
+    const size_t parent = (i - 1) / 2;
+    if (!fiber_scheduler_edf_before(entry, &entries[parent])) {
+      break;
+    }
+    entries[i] = entries[parent];
+    i = parent;
+  }
+  entries[i] = *entry;
+  return 1;
+}
+
+static fiber_scheduler_edf_entry_t fiber_scheduler_edf_heap_pop(
+    fiber_scheduler_edf_heap_t* heap) {
+  assert(heap->size);
+  fiber_scheduler_edf_entry_t* const entries = heap->entries;
+  const fiber_scheduler_edf_entry_t top = entries[0];
+  const fiber_scheduler_edf_entry_t last = entries[--heap->size];
+  const size_t count = heap->size;
+  size_t i = 0;
+  while (1) {
+    size_t child = 2 * i + 1;
+    if (child >= count) {
+      break;
+    }
+    if (child + 1 < count &&
+        fiber_scheduler_edf_before(&entries[child + 1], &entries[child])) {
+      ++child;
+    }
+    if (!fiber_scheduler_edf_before(&entries[child], &last)) {
+      break;
+    }
+    entries[i] = entries[child];
+    i = child;
+  }
+  entries[i] = last;
+  return top;
+}
+
+// must be called with the lock held after a heap changes
+static inline void fiber_scheduler_edf_publish(fiber_scheduler_edf_t* scheduler,
+                                               int priority) {
+  fiber_scheduler_edf_heap_t* const heap = &scheduler->heaps[priority];
+  atomic_store_explicit(&scheduler->sizes[priority], heap->size,
+                        memory_order_relaxed);
+  atomic_store_explicit(
+      &scheduler->earliest[priority],
+      heap->size ? heap->entries[0].deadline : FIBER_SCHEDULER_EDF_NO_DEADLINE,
+      memory_order_relaxed);
+}
+
+// must be called with the lock held
+static void fiber_scheduler_edf_push_locked(fiber_scheduler_edf_t* scheduler,
+                                            fiber_t* the_fiber) {
+  assert(the_fiber->priority >= 0 &&
+         the_fiber->priority < FIBER_PRIORITY_CLASSES);
+  fiber_scheduler_edf_entry_t entry;
+  entry.deadline =
+      the_fiber->deadline ? the_fiber->deadline : FIBER_SCHEDULER_EDF_NO_DEADLINE;
+  entry.sequence = scheduler->sequence++;
+  entry.fiber = the_fiber;
+  const int ret =
+      fiber_scheduler_edf_heap_push(&scheduler->heaps[the_fiber->priority],
+                                    &entry);
+  (void)ret;
+  assert(ret && "out of memory queueing a fiber");
+  fiber_scheduler_edf_publish(scheduler, the_fiber->priority);
+}
+
+static int fiber_scheduler_edf_init(size_t num_threads) {
+  assert(num_threads > 0);
+  fiber_scheduler_num_threads = num_threads;
+
+  assert(!fiber_schedulers);
+  fiber_schedulers = calloc(num_threads, sizeof(*fiber_schedulers));
+  assert(fiber_schedulers);
+
+  size_t i;
+  for (i = 0; i < num_threads; ++i) {
+    fiber_scheduler_edf_t* const scheduler = &fiber_schedulers[i];
+    fiber_spinlock_init(&scheduler->lock);
+    scheduler->id = i;
+    int j;
+    for (j = 0; j < FIBER_PRIORITY_CLASSES; ++j) {
+      scheduler->earliest[j] = FIBER_SCHEDULER_EDF_NO_DEADLINE;
+    }
+  }
+  return 1;
+}
+
+static void fiber_scheduler_edf_shutdown() {
+  size_t i;
+  for (i = 0; i < fiber_scheduler_num_threads; ++i) {
+    int j;
+    for (j = 0; j < FIBER_PRIORITY_CLASSES; ++j) {
+      free(fiber_schedulers[i].heaps[j].entries);
+    }
+    free(fiber_schedulers[i].deferred);
+    fiber_spinlock_destroy(&fiber_schedulers[i].lock);
+  }
+  free(fiber_schedulers);
+  fiber_schedulers = NULL;
+}
+
+static fiber_scheduler_t* fiber_scheduler_edf_for_thread(size_t thread_id) {
+  assert(fiber_schedulers);
+  assert(thread_id < fiber_scheduler_num_threads);
+  return (fiber_scheduler_t*)&fiber_schedulers[thread_id];
+}
+
+static void fiber_scheduler_edf_schedule(fiber_scheduler_t* sched,
+                                         fiber_t* the_fiber) {
+  fiber_scheduler_edf_t* const scheduler = (fiber_scheduler_edf_t*)sched;
+  assert(scheduler);
+  assert(the_fiber);
+  fiber_spinlock_lock(&scheduler->lock);
+  fiber_scheduler_edf_push_locked(scheduler, the_fiber);
+  fiber_spinlock_unlock(&scheduler->lock);
+}
+
+// must be called with the lock held. fibers still switching out are set aside
+// in scheduler->deferred.
+static fiber_t* fiber_scheduler_edf_next_in_class(
+    fiber_scheduler_edf_t* scheduler, int priority, size_t* deferred_count) {
+  fiber_scheduler_edf_heap_t* const heap = &scheduler->heaps[priority];
+  fiber_t* new_fiber = NULL;
+  while (heap->size) {
+    const fiber_scheduler_edf_entry_t entry =
+        fiber_scheduler_edf_heap_pop(heap);
+    if (entry.fiber->state != FIBER_STATE_SAVING_STATE_TO_WAIT) {
+      new_fiber = entry.fiber;
+      break;
+    }
+    if (*deferred_count == scheduler->deferred_capacity) {
+      const size_t new_capacity =
+          scheduler->deferred_capacity ? 2 * scheduler->deferred_capacity : 16;
+      fiber_scheduler_edf_entry_t* const new_deferred = realloc(
+          scheduler->deferred, new_capacity * sizeof(*new_deferred));
+      if (!new_deferred) {
+        // out of memory - put it back and try again later
+        fiber_scheduler_edf_heap_push(heap, &entry);
+        break;
+      }
+      scheduler->deferred = new_deferred;
+      scheduler->deferred_capacity = new_capacity;
+    }
+    scheduler->deferred[(*deferred_count)++] = entry;
+  }
+  return new_fiber;
+}
+
+static fiber_t* fiber_scheduler_edf_next(fiber_scheduler_t* sched) {
+  fiber_scheduler_edf_t* const scheduler = (fiber_scheduler_edf_t*)sched;
+  assert(scheduler);
+  fiber_spinlock_lock(&scheduler->lock);
+  size_t deferred_count = 0;
+  fiber_t* new_fiber = NULL;
+  int picked = fiber_scheduler_priority_aged(&scheduler->priority);
+  if (picked >= 0) {
+    new_fiber =
+        fiber_scheduler_edf_next_in_class(scheduler, picked, &deferred_count);
+  }
+  int i;
+  for (i = 0; !new_fiber && i < FIBER_PRIORITY_CLASSES; ++i) {
+    new_fiber = fiber_scheduler_edf_next_in_class(scheduler, i, &deferred_count);
+    picked = i;
+  }
+  if (new_fiber) {
+    fiber_scheduler_priority_ran(&scheduler->priority, picked);
+  }
+  // the deferred fibers keep their place
+  size_t j;
+  for (j = 0; j < deferred_count; ++j) {
+    const fiber_scheduler_edf_entry_t* const entry = &scheduler->deferred[j];
+    fiber_scheduler_edf_heap_push(&scheduler->heaps[entry->fiber->priority],
+                                  entry);
+  }
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    fiber_scheduler_edf_publish(scheduler, i);
+  }
+  fiber_spinlock_unlock(&scheduler->lock);
+  return new_fiber;
+}
+
+// steals the most urgent fibers, highest priority class first, from whichever
+// thread has the earliest deadline queued
+static void fiber_scheduler_edf_load_balance(fiber_scheduler_t* sched) {
+  fiber_scheduler_edf_t* const scheduler = (fiber_scheduler_edf_t*)sched;
+  assert(scheduler);
+  if (fiber_scheduler_num_threads < 2) {
+    return;
+  }
+  int priority;
+  for (priority = 0; priority < FIBER_PRIORITY_CLASSES; ++priority) {
+    const size_t local_count =
+        atomic_load_explicit(&scheduler->sizes[priority], memory_order_relaxed);
+    fiber_scheduler_edf_t* victim = NULL;
+    uint64_t victim_earliest = 0;
+    size_t victim_count = 0;
+    size_t i;
+    for (i = 0; i < fiber_scheduler_num_threads; ++i) {
+      fiber_scheduler_edf_t* const candidate = &fiber_schedulers[i];
+      if (candidate == scheduler) {
+        continue;
+      }
+      const size_t count = atomic_load_explicit(&candidate->sizes[priority],
+                                                memory_order_relaxed);
+      const uint64_t earliest = atomic_load_explicit(
+          &candidate->earliest[priority], memory_order_relaxed);
+      if (count > local_count + 1 &&
+          (!victim || earliest < victim_earliest)) {
+        victim = candidate;
+        victim_earliest = earliest;
+        victim_count = count;
+      }
+    }
+    if (!victim) {
+      continue;
+    }
+    if (!fiber_spinlock_trylock(&victim->lock)) {
+      ++scheduler->failed_steal_count;
+      return;
+    }
+    // even out the two heaps
+    size_t wanted = (victim_count - local_count) / 2;
+    if (wanted > FIBER_SCHEDULER_EDF_MAX_STEAL) {
+      wanted = FIBER_SCHEDULER_EDF_MAX_STEAL;
+    }
+    fiber_scheduler_edf_heap_t* const heap = &victim->heaps[priority];
+    fiber_t* stolen[FIBER_SCHEDULER_EDF_MAX_STEAL];
+    size_t count = 0;
+    size_t skipped = 0;
+    fiber_scheduler_edf_entry_t busy[FIBER_SCHEDULER_EDF_MAX_STEAL];
+    while (count < wanted && skipped < FIBER_SCHEDULER_EDF_MAX_STEAL &&
+           heap->size) {
+      const fiber_scheduler_edf_entry_t entry =
+          fiber_scheduler_edf_heap_pop(heap);
+      if (entry.fiber->state == FIBER_STATE_SAVING_STATE_TO_WAIT ||
+          entry.fiber->home_manager >= 0) {
+        // leave it with the thread it's switching out on, or its home
+        busy[skipped++] = entry;
+      } else {
+        stolen[count++] = entry.fiber;
+      }
+    }
+    for (i = 0; i < skipped; ++i) {
+      fiber_scheduler_edf_heap_push(heap, &busy[i]);
+    }
+    fiber_scheduler_edf_publish(victim, priority);
+    fiber_spinlock_unlock(&victim->lock);
+
+    if (count < wanted) {
+      ++scheduler->failed_steal_count;
+    }
+    if (count) {
+      fiber_spinlock_lock(&scheduler->lock);
+      for (i = 0; i < count; ++i) {
+        fiber_scheduler_edf_push_locked(scheduler, stolen[i]);
+      }
+      fiber_spinlock_unlock(&scheduler->lock);
+      scheduler->steal_count += count;
+      return;
+    }
+  }
+}
+
+static int fiber_scheduler_edf_pending(fiber_scheduler_t* sched) {
+  fiber_scheduler_edf_t* const scheduler = (fiber_scheduler_edf_t*)sched;
+  assert(scheduler);
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    if (atomic_load_explicit(&scheduler->sizes[i], memory_order_relaxed)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void fiber_scheduler_edf_stats(fiber_scheduler_t* sched,
+                                      uint64_t* steal_count,
+                                      uint64_t* failed_steal_count,
+                                      uint64_t* level_steal_count,
+                                      uint64_t* class_queue_depth) {
+  fiber_scheduler_edf_t* const scheduler = (fiber_scheduler_edf_t*)sched;
+  assert(scheduler);
+  *steal_count += scheduler->steal_count;
+  *failed_steal_count += scheduler->failed_steal_count;
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    class_queue_depth[i] +=
+        atomic_load_explicit(&scheduler->sizes[i], memory_order_relaxed);
+  }
+}
+
+const fiber_scheduler_ops_t fiber_scheduler_edf_ops = {
+    .name = "edf",
+    .init = &fiber_scheduler_edf_init,
+    .shutdown = &fiber_scheduler_edf_shutdown,
+    .for_thread = &fiber_scheduler_edf_for_thread,
+    .schedule = &fiber_scheduler_edf_schedule,
+    .next = &fiber_scheduler_edf_next,
+    .load_balance = &fiber_scheduler_edf_load_balance,
+    .pending = &fiber_scheduler_edf_pending,
+    .stats = &fiber_scheduler_edf_stats,
+};
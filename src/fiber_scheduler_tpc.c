@@ -0,0 +1,177 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fiber_scheduler.h"
+
+// a growable ring of fibers. only the owning thread touches it, so there are
+// no atomics on push or pop.
+typedef struct fiber_scheduler_tpc_ring {
+  fiber_t** fibers;
+  size_t capacity;  // a power of two, or 0
+  size_t head;
+  size_t count;
+} fiber_scheduler_tpc_ring_t;
+
+typedef struct fiber_scheduler_tpc {
+  fiber_scheduler_tpc_ring_t rings[FIBER_PRIORITY_CLASSES];
+  fiber_scheduler_priority_t priority;
+} fiber_scheduler_tpc_t;
+
+static size_t fiber_scheduler_num_threads = 0;
+static fiber_scheduler_tpc_t* fiber_schedulers = NULL;
+
+static int fiber_scheduler_tpc_push(fiber_scheduler_tpc_ring_t* ring,
+                                    fiber_t* the_fiber) {
+  if (ring->count == ring->capacity) {
+    const size_t new_capacity = ring->capacity ? 2 * ring->capacity : 64;
+    fiber_t** const new_fibers = malloc(new_capacity * sizeof(*new_fibers));
+    if (!new_fibers) {
+      return 0;
+    }
+    size_t i;
+    for (i = 0; i < ring->count; ++i) {
+      new_fibers[i] = ring->fibers[(ring->head + i) & (ring->capacity - 1)];
+    }
+    free(ring->fibers);
+    ring->fibers = new_fibers;
+    ring->capacity = new_capacity;
+    ring->head = 0;
+  }
+  ring->fibers[(ring->head + ring->count) & (ring->capacity - 1)] = the_fiber;
+  ++ring->count;
+  return 1;
+}
+
+static fiber_t* fiber_scheduler_tpc_pop(fiber_scheduler_tpc_ring_t* ring) {
+  assert(ring->count);
+  fiber_t* const the_fiber = ring->fibers[ring->head];
+  ring->head = (ring->head + 1) & (ring->capacity - 1);
+  --ring->count;
+  return the_fiber;
+}
+
+static int fiber_scheduler_tpc_init(size_t num_threads) {
+  assert(num_threads > 0);
+  fiber_scheduler_num_threads = num_threads;
+
+  assert(!fiber_schedulers);
+  fiber_schedulers = calloc(num_threads, sizeof(*fiber_schedulers));
+  assert(fiber_schedulers);
+  return 1;
+}
+
+static void fiber_scheduler_tpc_shutdown() {
+  size_t i;
+  for (i = 0; i < fiber_scheduler_num_threads; ++i) {
+    int j;
+    for (j = 0; j < FIBER_PRIORITY_CLASSES; ++j) {
+      free(fiber_schedulers[i].rings[j].fibers);
+    }
+  }
+  free(fiber_schedulers);
+  fiber_schedulers = NULL;
+}
+
+static fiber_scheduler_t* fiber_scheduler_tpc_for_thread(size_t thread_id) {
+  assert(fiber_schedulers);
+  assert(thread_id < fiber_scheduler_num_threads);
+  return (fiber_scheduler_t*)&fiber_schedulers[thread_id];
+}
+
+static void fiber_scheduler_tpc_schedule(fiber_scheduler_t* sched,
+                                         fiber_t* the_fiber) {
+  fiber_scheduler_tpc_t* const scheduler = (fiber_scheduler_tpc_t*)sched;
+  assert(scheduler);
+  assert(the_fiber);
+  assert(the_fiber->priority >= 0 &&
+         the_fiber->priority < FIBER_PRIORITY_CLASSES);
+  const int ret = fiber_scheduler_tpc_push(
+      &scheduler->rings[the_fiber->priority], the_fiber);
+  (void)ret;
+  assert(ret && "out of memory queueing a fiber");
+}
+
+// fibers still switching out go to the back of the ring
+static fiber_t* fiber_scheduler_tpc_next_in_class(
+    fiber_scheduler_tpc_ring_t* ring) {
+  size_t remaining = ring->count;
+  while (remaining--) {
+    fiber_t* const new_fiber = fiber_scheduler_tpc_pop(ring);
+    if (new_fiber->state != FIBER_STATE_SAVING_STATE_TO_WAIT) {
+      return new_fiber;
+    }
+    fiber_scheduler_tpc_push(ring, new_fiber);
+  }
+  return NULL;
+}
+
+static fiber_t* fiber_scheduler_tpc_next(fiber_scheduler_t* sched) {
+  fiber_scheduler_tpc_t* const scheduler = (fiber_scheduler_tpc_t*)sched;
+  assert(scheduler);
+  const int aged = fiber_scheduler_priority_aged(&scheduler->priority);
+  if (aged >= 0) {
+    fiber_t* const new_fiber =
+        fiber_scheduler_tpc_next_in_class(&scheduler->rings[aged]);
+    if (new_fiber) {
+      fiber_scheduler_priority_ran(&scheduler->priority, aged);
+      return new_fiber;
+    }
+  }
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    fiber_t* const new_fiber =
+        fiber_scheduler_tpc_next_in_class(&scheduler->rings[i]);
+    if (new_fiber) {
+      fiber_scheduler_priority_ran(&scheduler->priority, i);
+      return new_fiber;
+    }
+  }
+  return NULL;
+}
+
+static void fiber_scheduler_tpc_load_balance(fiber_scheduler_t* sched) {
+  // nothing - each thread only runs its own fibers
+}
+
+static int fiber_scheduler_tpc_pending(fiber_scheduler_t* sched) {
+  fiber_scheduler_tpc_t* const scheduler = (fiber_scheduler_tpc_t*)sched;
+  assert(scheduler);
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    if (scheduler->rings[i].count) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void fiber_scheduler_tpc_stats(fiber_scheduler_t* sched,
+                                      uint64_t* steal_count,
+                                      uint64_t* failed_steal_count,
+                                      uint64_t* level_steal_count,
+                                      uint64_t* class_queue_depth) {
+  fiber_scheduler_tpc_t* const scheduler = (fiber_scheduler_tpc_t*)sched;
+  assert(scheduler);
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    // read without the owner's cooperation, so only roughly right
+    class_queue_depth[i] += scheduler->rings[i].count;
+  }
+}
+
+const fiber_scheduler_ops_t fiber_scheduler_tpc_ops = {
+    .name = "tpc",
+    .init = &fiber_scheduler_tpc_init,
+    .shutdown = &fiber_scheduler_tpc_shutdown,
+    .for_thread = &fiber_scheduler_tpc_for_thread,
+    .schedule = &fiber_scheduler_tpc_schedule,
+    .next = &fiber_scheduler_tpc_next,
+    .load_balance = &fiber_scheduler_tpc_load_balance,
+    .pending = &fiber_scheduler_tpc_pending,
+    .stats = &fiber_scheduler_tpc_stats,
+};
@@ -1,50 +1,118 @@
 // SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
 // SPDX-License-Identifier: MIT
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // for sched_getcpu()
+#endif
 #include <assert.h>
+#include <sched.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "fiber_scheduler.h"
 #include "work_stealing_deque.h"
 
-typedef struct fiber_scheduler_wsd {
+// one priority class. fibers which are still switching out wait in store_to
+// until schedule_from runs dry. fibers with a home manager are queued in
+// pinned, which other threads never steal from; next() alternates between it
+// and the other fibers.
+typedef struct fiber_scheduler_wsd_class {
   wsd_work_stealing_deque_t* queue_one;
   wsd_work_stealing_deque_t* queue_two;
   wsd_work_stealing_deque_t* volatile schedule_from;
   wsd_work_stealing_deque_t* volatile store_to;
+  wsd_work_stealing_deque_t* pinned;
+  int pinned_turn;
+} fiber_scheduler_wsd_class_t;
+
+typedef struct fiber_scheduler_wsd {
+  fiber_scheduler_wsd_class_t classes[FIBER_PRIORITY_CLASSES];
+  fiber_scheduler_priority_t priority;
   size_t id;
+  uint32_t seed;  // for picking steal victims
+  // the CPU this thread last ran load balancing on, -1 if unknown
+  volatile int cpu;
+  // the other threads, nearest first. victims at level l are
+  // victims[level_end[l - 1]] up to victims[level_end[l]].
+  size_t* victims;
+  size_t level_end[FIBER_TOPOLOGY_LEVELS];
+  unsigned int victims_age;
   uint64_t steal_count;
   uint64_t failed_steal_count;
+  uint64_t level_steal_count[FIBER_TOPOLOGY_LEVELS];
 } fiber_scheduler_wsd_t;
 
+// load balancing probes this many random victims at each topology level,
+// nearest level first, stopping at the first one it steals from. it takes at
+// most FIBER_SCHEDULER_WSD_MAX_STEAL fibers.
+#define FIBER_SCHEDULER_WSD_PROBES (4)
+#define FIBER_SCHEDULER_WSD_MAX_STEAL (64)
+// threads migrate between CPUs, so the victim order is rebuilt this often
+// (in load balancing passes) even if this thread stays put
+#define FIBER_SCHEDULER_WSD_VICTIMS_MAX_AGE (64)
+
 static size_t fiber_scheduler_num_threads = 0;
 static fiber_scheduler_wsd_t* fiber_schedulers = NULL;
+// every thread's deques, by thread, then class
 static wsd_work_stealing_deque_t** fiber_scheduler_thread_queues = NULL;
 
-int fiber_scheduler_wsd_init(fiber_scheduler_wsd_t* scheduler, size_t id) {
+#define FIBER_SCHEDULER_WSD_QUEUES_PER_THREAD (2 * FIBER_PRIORITY_CLASSES)
+
+static int fiber_scheduler_wsd_init_thread(fiber_scheduler_wsd_t* scheduler,
+                                           size_t id) {
   assert(scheduler);
-  scheduler->queue_one = wsd_work_stealing_deque_create();
-  scheduler->queue_two = wsd_work_stealing_deque_create();
-  scheduler->schedule_from = scheduler->queue_one;
-  scheduler->store_to = scheduler->queue_two;
+  int ok = 1;
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    fiber_scheduler_wsd_class_t* const the_class = &scheduler->classes[i];
+    the_class->queue_one = wsd_work_stealing_deque_create();
+    the_class->queue_two = wsd_work_stealing_deque_create();
+    the_class->pinned = wsd_work_stealing_deque_create();
+    the_class->schedule_from = the_class->queue_one;
+    the_class->store_to = the_class->queue_two;
+    the_class->pinned_turn = 0;
+    ok = ok && the_class->queue_one && the_class->queue_two &&
+         the_class->pinned;
+  }
+  memset(&scheduler->priority, 0, sizeof(scheduler->priority));
   scheduler->id = id;
+  scheduler->seed = (uint32_t)(id + 1) * 2654435761u;
+  scheduler->cpu = -1;
+  scheduler->victims =
+      fiber_scheduler_num_threads > 1
+          ? calloc(fiber_scheduler_num_threads - 1, sizeof(*scheduler->victims))
+          : NULL;
+  memset(scheduler->level_end, 0, sizeof(scheduler->level_end));
+  scheduler->victims_age = FIBER_SCHEDULER_WSD_VICTIMS_MAX_AGE;
   scheduler->steal_count = 0;
   scheduler->failed_steal_count = 0;
+  memset(scheduler->level_steal_count, 0,
+         sizeof(scheduler->level_steal_count));
 
-  if (!scheduler->queue_one || !scheduler->queue_two) {
-    wsd_work_stealing_deque_destroy(scheduler->queue_one);
-    wsd_work_stealing_deque_destroy(scheduler->queue_two);
+  if (!ok || (fiber_scheduler_num_threads > 1 && !scheduler->victims)) {
+    for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+      wsd_work_stealing_deque_destroy(scheduler->classes[i].queue_one);
+      wsd_work_stealing_deque_destroy(scheduler->classes[i].queue_two);
+      wsd_work_stealing_deque_destroy(scheduler->classes[i].pinned);
+    }
+    free(scheduler->victims);
     return 0;
   }
   return 1;
 }
 
-void fiber_scheduler_wsd_destroy(fiber_scheduler_wsd_t* scheduler) {
-  wsd_work_stealing_deque_destroy(scheduler->queue_one);
-  wsd_work_stealing_deque_destroy(scheduler->queue_two);
+static void fiber_scheduler_wsd_destroy_thread(
+    fiber_scheduler_wsd_t* scheduler) {
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    wsd_work_stealing_deque_destroy(scheduler->classes[i].queue_one);
+    wsd_work_stealing_deque_destroy(scheduler->classes[i].queue_two);
+    wsd_work_stealing_deque_destroy(scheduler->classes[i].pinned);
+  }
+  free(scheduler->victims);
 }
 
-int fiber_scheduler_init(size_t num_threads) {
+static int fiber_scheduler_wsd_init(size_t num_threads) {
   assert(num_threads > 0);
   fiber_scheduler_num_threads = num_threads;
 
@@ -53,24 +121,31 @@ int fiber_scheduler_init(size_t num_threads) {
   assert(fiber_schedulers);
   assert(!fiber_scheduler_thread_queues);
   fiber_scheduler_thread_queues =
-      calloc(2 * num_threads, sizeof(*fiber_scheduler_thread_queues));
+      calloc(FIBER_SCHEDULER_WSD_QUEUES_PER_THREAD * num_threads,
+             sizeof(*fiber_scheduler_thread_queues));
   assert(fiber_scheduler_thread_queues);
 
   size_t i;
   for (i = 0; i < num_threads; ++i) {
-    const int ret = fiber_scheduler_wsd_init(&fiber_schedulers[i], i);
+    const int ret = fiber_scheduler_wsd_init_thread(&fiber_schedulers[i], i);
     (void)ret;
     assert(ret);
-    fiber_scheduler_thread_queues[i * 2] = fiber_schedulers[i].queue_one;
-    fiber_scheduler_thread_queues[i * 2 + 1] = fiber_schedulers[i].queue_two;
+    wsd_work_stealing_deque_t** const queues =
+        &fiber_scheduler_thread_queues[i *
+                                       FIBER_SCHEDULER_WSD_QUEUES_PER_THREAD];
+    int j;
+    for (j = 0; j < FIBER_PRIORITY_CLASSES; ++j) {
+      queues[j * 2] = fiber_schedulers[i].classes[j].queue_one;
+      queues[j * 2 + 1] = fiber_schedulers[i].classes[j].queue_two;
+    }
   }
   return 1;
 }
 
-void fiber_scheduler_shutdown() {
+static void fiber_scheduler_wsd_shutdown() {
   size_t i;
   for (i = 0; i < fiber_scheduler_num_threads; ++i) {
-    fiber_scheduler_wsd_destroy(&fiber_schedulers[i]);
+    fiber_scheduler_wsd_destroy_thread(&fiber_schedulers[i]);
   }
   free(fiber_schedulers);
   fiber_schedulers = NULL;
@@ -78,35 +153,58 @@ void fiber_scheduler_shutdown() {
   fiber_scheduler_thread_queues = NULL;
 }
 
-fiber_scheduler_t* fiber_scheduler_for_thread(size_t thread_id) {
+static fiber_scheduler_t* fiber_scheduler_wsd_for_thread(size_t thread_id) {
   assert(fiber_schedulers);
   assert(thread_id < fiber_scheduler_num_threads);
   return (fiber_scheduler_t*)&fiber_schedulers[thread_id];
 }
 
-void fiber_scheduler_schedule(fiber_scheduler_t* scheduler,
-                              fiber_t* the_fiber) {
+static void fiber_scheduler_wsd_schedule(fiber_scheduler_t* scheduler,
+                                         fiber_t* the_fiber) {
   assert(scheduler);
   assert(the_fiber);
+  assert(the_fiber->priority >= 0 &&
+         the_fiber->priority < FIBER_PRIORITY_CLASSES);
+  fiber_scheduler_wsd_class_t* const the_class =
+      &((fiber_scheduler_wsd_t*)scheduler)->classes[the_fiber->priority];
   wsd_work_stealing_deque_push_bottom(
-      ((fiber_scheduler_wsd_t*)scheduler)->schedule_from, the_fiber);
+      the_fiber->home_manager >= 0 ? the_class->pinned
+                                   : the_class->schedule_from,
+      the_fiber);
 }
 
-fiber_t* fiber_scheduler_next(fiber_scheduler_t* sched) {
-  fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
-  assert(scheduler);
-  if (wsd_work_stealing_deque_size(scheduler->schedule_from) == 0) {
-    wsd_work_stealing_deque_t* const temp = scheduler->schedule_from;
-    scheduler->schedule_from = scheduler->store_to;
-    scheduler->store_to = temp;
+static fiber_t* fiber_scheduler_wsd_next_pinned(
+    fiber_scheduler_wsd_class_t* the_class) {
+  if (wsd_work_stealing_deque_size(the_class->pinned) == 0) {
+    return NULL;
+  }
+  fiber_t* const new_fiber =
+      (fiber_t*)wsd_work_stealing_deque_pop_bottom(the_class->pinned);
+  if (new_fiber == WSD_EMPTY || new_fiber == WSD_ABORT) {
+    return NULL;
   }
+  if (new_fiber->state == FIBER_STATE_SAVING_STATE_TO_WAIT) {
+    // it's still switching out on another thread; try again next time
+    wsd_work_stealing_deque_push_bottom(the_class->pinned, new_fiber);
+    return NULL;
+  }
+  return new_fiber;
+}
 
-  while (wsd_work_stealing_deque_size(scheduler->schedule_from) > 0) {
+static fiber_t* fiber_scheduler_wsd_next_shared(
+    fiber_scheduler_wsd_class_t* the_class) {
+  if (wsd_work_stealing_deque_size(the_class->schedule_from) == 0) {
+    wsd_work_stealing_deque_t* const temp = the_class->schedule_from;
+    the_class->schedule_from = the_class->store_to;
+    the_class->store_to = temp;
+  }
+
+  while (wsd_work_stealing_deque_size(the_class->schedule_from) > 0) {
     fiber_t* const new_fiber =
-        (fiber_t*)wsd_work_stealing_deque_pop_bottom(scheduler->schedule_from);
+        (fiber_t*)wsd_work_stealing_deque_pop_bottom(the_class->schedule_from);
     if (new_fiber != WSD_EMPTY && new_fiber != WSD_ABORT) {
       if (new_fiber->state == FIBER_STATE_SAVING_STATE_TO_WAIT) {
-        wsd_work_stealing_deque_push_bottom(scheduler->store_to, new_fiber);
+        wsd_work_stealing_deque_push_bottom(the_class->store_to, new_fiber);
       } else {
         return new_fiber;
       }
@@ -115,43 +213,228 @@ fiber_t* fiber_scheduler_next(fiber_scheduler_t* sched) {
   return NULL;
 }
 
-void fiber_scheduler_load_balance(fiber_scheduler_t* sched) {
+static fiber_t* fiber_scheduler_wsd_next_in_class(
+    fiber_scheduler_wsd_class_t* the_class) {
+  fiber_t* new_fiber = NULL;
+  the_class->pinned_turn = !the_class->pinned_turn;
+  if (the_class->pinned_turn) {
+    new_fiber = fiber_scheduler_wsd_next_pinned(the_class);
+  }
+  if (!new_fiber) {
+    new_fiber = fiber_scheduler_wsd_next_shared(the_class);
+  }
+  if (!new_fiber && !the_class->pinned_turn) {
+    new_fiber = fiber_scheduler_wsd_next_pinned(the_class);
+  }
+  return new_fiber;
+}
+
+static fiber_t* fiber_scheduler_wsd_next(fiber_scheduler_t* sched) {
   fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
-  size_t max_steal = 50;
-  size_t i = 2 * (scheduler->id + 1);
-  const size_t end = i + 2 * (fiber_scheduler_num_threads - 1);
-  const size_t mod = 2 * fiber_scheduler_num_threads;
-  size_t local_count = wsd_work_stealing_deque_size(scheduler->schedule_from);
-  for (; i < end; ++i) {
-    const size_t index = i % mod;
-    wsd_work_stealing_deque_t* const remote_queue =
-        fiber_scheduler_thread_queues[index];
-    assert(remote_queue != scheduler->queue_one);
-    assert(remote_queue != scheduler->queue_two);
-    if (!remote_queue) {
+  assert(scheduler);
+  const int aged = fiber_scheduler_priority_aged(&scheduler->priority);
+  if (aged >= 0) {
+    fiber_t* const new_fiber =
+        fiber_scheduler_wsd_next_in_class(&scheduler->classes[aged]);
+    if (new_fiber) {
+      fiber_scheduler_priority_ran(&scheduler->priority, aged);
+      return new_fiber;
+    }
+  }
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    fiber_t* const new_fiber =
+        fiber_scheduler_wsd_next_in_class(&scheduler->classes[i]);
+    if (new_fiber) {
+      fiber_scheduler_priority_ran(&scheduler->priority, i);
+      return new_fiber;
+    }
+  }
+  return NULL;
+}
+
+static inline uint32_t fiber_scheduler_wsd_random(
+    fiber_scheduler_wsd_t* scheduler) {
+  // xorshift32
+  uint32_t x = scheduler->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  scheduler->seed = x;
+  return x;
+}
+
+// sorts the other threads by their distance from this thread's CPU. other
+// threads' CPUs are only hints, so a stale read just orders a victim wrongly.
+// the CPUs read are stored in cpu_of, by thread, unless it's NULL.
+static void fiber_scheduler_wsd_order_victims(
+    fiber_scheduler_wsd_t* scheduler, int* cpu_of) {
+  size_t level_count[FIBER_TOPOLOGY_LEVELS] = {0};
+  fiber_topology_level_t level_of[fiber_scheduler_num_threads];
+  size_t i;
+  for (i = 0; i < fiber_scheduler_num_threads; ++i) {
+    if (i != scheduler->id) {
+      const int cpu = fiber_schedulers[i].cpu;
+      if (cpu_of) {
+        cpu_of[i] = cpu;
+      }
+      level_of[i] = fiber_topology_distance(scheduler->cpu, cpu);
+      ++level_count[level_of[i]];
+    }
+  }
+  size_t next[FIBER_TOPOLOGY_LEVELS];
+  size_t total = 0;
+  int level;
+  for (level = 0; level < FIBER_TOPOLOGY_LEVELS; ++level) {
+    next[level] = total;
+    total += level_count[level];
+    scheduler->level_end[level] = total;
+  }
+  for (i = 0; i < fiber_scheduler_num_threads; ++i) {
+    if (i != scheduler->id) {
+      scheduler->victims[next[level_of[i]]++] = i;
+    }
+  }
+  scheduler->victims_age = 0;
+}
+
+// steals up to half of victim's fibers, highest priority classes first.
+// returns the number stolen.
+static size_t fiber_scheduler_wsd_steal_from(fiber_scheduler_wsd_t* scheduler,
+                                             size_t victim) {
+  wsd_work_stealing_deque_t** const remote_queues =
+      &fiber_scheduler_thread_queues[victim *
+                                     FIBER_SCHEDULER_WSD_QUEUES_PER_THREAD];
+  size_t stolen = 0;
+  int i;
+  for (i = 0; i < FIBER_SCHEDULER_WSD_QUEUES_PER_THREAD &&
+              stolen < FIBER_SCHEDULER_WSD_MAX_STEAL;
+       ++i) {
+    fiber_scheduler_wsd_class_t* const the_class = &scheduler->classes[i / 2];
+    wsd_work_stealing_deque_t* const remote_queue = remote_queues[i];
+    assert(remote_queue != the_class->queue_one);
+    assert(remote_queue != the_class->queue_two);
+    const size_t local_count =
+        wsd_work_stealing_deque_size(the_class->schedule_from);
+    const size_t remote_count = wsd_work_stealing_deque_size(remote_queue);
+    if (remote_count <= local_count) {
       continue;
     }
-    size_t remote_count = wsd_work_stealing_deque_size(remote_queue);
-    while (remote_count > local_count && max_steal > 0) {
-      fiber_t* const stolen =
-          (fiber_t*)wsd_work_stealing_deque_steal(remote_queue);
-      if (stolen == WSD_EMPTY || stolen == WSD_ABORT) {
-        ++scheduler->failed_steal_count;
-        break;
+    // even out the two queues
+    size_t wanted = (remote_count - local_count + 1) / 2;
+    if (wanted > FIBER_SCHEDULER_WSD_MAX_STEAL - stolen) {
+      wanted = FIBER_SCHEDULER_WSD_MAX_STEAL - stolen;
+    }
+    const size_t count = wsd_work_stealing_deque_steal_half(
+        remote_queue, the_class->schedule_from, wanted);
+    if (count < wanted) {
+      ++scheduler->failed_steal_count;
+    }
+    stolen += count;
+  }
+  return stolen;
+}
+
+static void fiber_scheduler_wsd_load_balance(fiber_scheduler_t* sched) {
+  fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
+  if (fiber_scheduler_num_threads < 2) {
+    return;
+  }
+  const int cpu = sched_getcpu();
+  if (cpu != scheduler->cpu ||
+      ++scheduler->victims_age >= FIBER_SCHEDULER_WSD_VICTIMS_MAX_AGE) {
+    scheduler->cpu = cpu;
+    fiber_scheduler_wsd_order_victims(scheduler, NULL);
+  }
+
+  // try siblings first, then the same LLC, the same node and remote nodes
+  size_t level_start = 0;
+  int level;
+  for (level = 0; level < FIBER_TOPOLOGY_LEVELS; ++level) {
+    const size_t level_end = scheduler->level_end[level];
+    const size_t level_size = level_end - level_start;
+    size_t probes = FIBER_SCHEDULER_WSD_PROBES;
+    if (probes > level_size) {
+      probes = level_size;
+    }
+    for (; probes > 0; --probes) {
+      const size_t pick = fiber_scheduler_wsd_random(scheduler) % level_size;
+      const size_t victim = scheduler->victims[level_start + pick];
+      const size_t stolen = fiber_scheduler_wsd_steal_from(scheduler, victim);
+      if (stolen) {
+        scheduler->steal_count += stolen;
+        scheduler->level_steal_count[level] += stolen;
+        return;
       }
-      wsd_work_stealing_deque_push_bottom(scheduler->schedule_from, stolen);
-      --remote_count;
-      ++local_count;
-      --max_steal;
-      ++scheduler->steal_count;
     }
+    level_start = level_end;
   }
 }
 
-void fiber_scheduler_stats(fiber_scheduler_t* sched, uint64_t* steal_count,
-                           uint64_t* failed_steal_count) {
+static int fiber_scheduler_wsd_pending(fiber_scheduler_t* sched) {
+  fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
+  assert(scheduler);
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    if (wsd_work_stealing_deque_size(scheduler->classes[i].queue_one) > 0 ||
+        wsd_work_stealing_deque_size(scheduler->classes[i].queue_two) > 0 ||
+        wsd_work_stealing_deque_size(scheduler->classes[i].pinned) > 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void fiber_scheduler_wsd_stats(fiber_scheduler_t* sched,
+                                      uint64_t* steal_count,
+                                      uint64_t* failed_steal_count,
+                                      uint64_t* level_steal_count,
+                                      uint64_t* class_queue_depth) {
   fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
   assert(scheduler);
   *steal_count += scheduler->steal_count;
   *failed_steal_count += scheduler->failed_steal_count;
+  int level;
+  for (level = 0; level < FIBER_TOPOLOGY_LEVELS; ++level) {
+    level_steal_count[level] += scheduler->level_steal_count[level];
+  }
+  int i;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    class_queue_depth[i] +=
+        wsd_work_stealing_deque_size(scheduler->classes[i].queue_one) +
+        wsd_work_stealing_deque_size(scheduler->classes[i].queue_two) +
+        wsd_work_stealing_deque_size(scheduler->classes[i].pinned);
+  }
 }
+
+size_t fiber_scheduler_wsd_victims(fiber_scheduler_t* sched, int* cpu,
+                                   size_t* victims, int* victim_cpus) {
+  fiber_scheduler_wsd_t* const scheduler = (fiber_scheduler_wsd_t*)sched;
+  assert(scheduler);
+  if (fiber_scheduler_num_threads < 2) {
+    *cpu = scheduler->cpu;
+    return 0;
+  }
+  int cpu_of[fiber_scheduler_num_threads];
+  scheduler->cpu = sched_getcpu();
+  fiber_scheduler_wsd_order_victims(scheduler, cpu_of);
+  *cpu = scheduler->cpu;
+  size_t i;
+  for (i = 0; i < fiber_scheduler_num_threads - 1; ++i) {
+    victims[i] = scheduler->victims[i];
+    victim_cpus[i] = cpu_of[victims[i]];
+  }
+  return fiber_scheduler_num_threads - 1;
+}
+
+const fiber_scheduler_ops_t fiber_scheduler_wsd_ops = {
+    .name = "wsd",
+    .init = &fiber_scheduler_wsd_init,
+    .shutdown = &fiber_scheduler_wsd_shutdown,
+    .for_thread = &fiber_scheduler_wsd_for_thread,
+    .schedule = &fiber_scheduler_wsd_schedule,
+    .next = &fiber_scheduler_wsd_next,
+    .load_balance = &fiber_scheduler_wsd_load_balance,
+    .pending = &fiber_scheduler_wsd_pending,
+    .stats = &fiber_scheduler_wsd_stats,
+};
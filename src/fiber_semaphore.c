@@ -83,7 +83,7 @@ int fiber_semaphore_post_internal(fiber_semaphore_t* semaphore) {
 
 int fiber_semaphore_post(fiber_semaphore_t* semaphore) {
   const int had_waiters = fiber_semaphore_post_internal(semaphore);
-  if (had_waiters) {
+  if (had_waiters && fiber_manager_get()) {
     // the semaphore was contended - be nice and let the waiter run
     fiber_yield();
   }
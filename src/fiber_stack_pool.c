@@ -0,0 +1,390 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_stack_pool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// pooled stacks are kept in lists linked through their highest word, which a
+// running fiber touches first anyway
+typedef struct fiber_stack_pool_list {
+  void* head;
+  size_t count;
+} fiber_stack_pool_list_t;
+
+typedef struct fiber_stack_pool_cache {
+  fiber_stack_pool_list_t lists[FIBER_STACK_POOL_CLASSES];
+  // a moving average of how deep freed stacks of each class went, in bytes
+  size_t high_water[FIBER_STACK_POOL_CLASSES];
+  fiber_stack_pool_stats_t stats;
+  struct fiber_stack_pool_cache* next;
+} fiber_stack_pool_cache_t;
+
+static size_t fiber_stack_pool_page_size = 0;
+static pthread_once_t fiber_stack_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fiber_stack_pool_key;
+static __thread fiber_stack_pool_cache_t* fiber_stack_pool_cache = NULL;
+
+static _Atomic size_t fiber_stack_pool_local_limit =
+    FIBER_STACK_POOL_LOCAL_LIMIT;
+static _Atomic size_t fiber_stack_pool_global_limit =
+    FIBER_STACK_POOL_GLOBAL_LIMIT;
+static _Atomic int fiber_stack_pool_reclaim = 0;
+static _Atomic int fiber_stack_pool_advice = MADV_DONTNEED;
+
+// guards the global pool, the list of caches and the stats of threads which
+// exited
+static pthread_mutex_t fiber_stack_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static fiber_stack_pool_list_t
+    fiber_stack_pool_global[FIBER_STACK_POOL_CLASSES];
+static fiber_stack_pool_cache_t* fiber_stack_pool_caches = NULL;
+static fiber_stack_pool_stats_t fiber_stack_pool_exited;
+
+static inline size_t fiber_stack_pool_class_size(int size_class) {
+  return fiber_stack_pool_page_size << (size_class + 1);
+}
+
+// the smallest class with room for stack_size and a guard page, or -1 if the
+// stack is too large to pool
+static int fiber_stack_pool_class(size_t stack_size) {
+  int i;
+  for (i = 0; i < FIBER_STACK_POOL_CLASSES; ++i) {
+    if (stack_size + fiber_stack_pool_page_size <=
+        fiber_stack_pool_class_size(i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// the class whose stacks are exactly size bytes, or -1 if there is none
+static int fiber_stack_pool_class_of(size_t size) {
+  int i;
+  for (i = 0; i < FIBER_STACK_POOL_CLASSES; ++i) {
+    if (size == fiber_stack_pool_class_size(i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static inline void** fiber_stack_pool_link(void* stack, int size_class) {
+  return (void**)((char*)stack + fiber_stack_pool_class_size(size_class)) - 1;
+}
+
+static inline void fiber_stack_pool_push(fiber_stack_pool_list_t* list,
+                                         int size_class, void* stack) {
+  *fiber_stack_pool_link(stack, size_class) = list->head;
+  list->head = stack;
+  list->count += 1;
+}
+
+static inline void* fiber_stack_pool_pop(fiber_stack_pool_list_t* list,
+                                         int size_class) {
+  void* const stack = list->head;
+  if (stack) {
+    list->head = *fiber_stack_pool_link(stack, size_class);
+    list->count -= 1;
+  }
+  return stack;
+}
+
+static void* fiber_stack_pool_map(size_t size) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+  // pages are only committed as the fiber touches them
+  flags |= MAP_NORESERVE;
+#endif
+  void* const stack = mmap(0, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (stack == MAP_FAILED) {
+    return NULL;
+  }
+  if (mprotect(stack, fiber_stack_pool_page_size, PROT_NONE)) {
+    munmap(stack, size);
+    return NULL;
+  }
+  return stack;
+}
+
+// unmaps every stack in list, returning how many there were
+static uint64_t fiber_stack_pool_unmap_all(fiber_stack_pool_list_t* list,
+                                           int size_class) {
+  uint64_t count = 0;
+  void* stack;
+  while ((stack = fiber_stack_pool_pop(list, size_class))) {
+    munmap(stack, fiber_stack_pool_class_size(size_class));
+    count += 1;
+  }
+  return count;
+}
+
+// moves up to count stacks from one list to another
+static void fiber_stack_pool_move(fiber_stack_pool_list_t* from,
+                                  fiber_stack_pool_list_t* to, int size_class,
+                                  size_t count) {
+  void* stack;
+  while (count-- && (stack = fiber_stack_pool_pop(from, size_class))) {
+    fiber_stack_pool_push(to, size_class, stack);
+  }
+}
+
+// moves stacks from list to the global pool until list holds at most keep.
+// whatever the global pool has no room for is unmapped.
+static void fiber_stack_pool_release(fiber_stack_pool_list_t* list,
+                                     int size_class, size_t keep,
+                                     fiber_stack_pool_stats_t* stats) {
+  if (list->count <= keep) {
+    return;
+  }
+  const size_t global_limit = atomic_load_explicit(
+      &fiber_stack_pool_global_limit, memory_order_relaxed);
+  fiber_stack_pool_list_t excess = {};
+  pthread_mutex_lock(&fiber_stack_pool_lock);
+  fiber_stack_pool_list_t* const global = &fiber_stack_pool_global[size_class];
+  fiber_stack_pool_move(list, global, size_class, list->count - keep);
+  if (global->count > global_limit) {
+    fiber_stack_pool_move(global, &excess, size_class,
+                          global->count - global_limit);
+  }
+  pthread_mutex_unlock(&fiber_stack_pool_lock);
+  // the syscalls happen outside of the lock
+  stats->unmap_count += fiber_stack_pool_unmap_all(&excess, size_class);
+}
+
+static void fiber_stack_pool_thread_exit(void* param) {
+  fiber_stack_pool_cache_t* const cache = (fiber_stack_pool_cache_t*)param;
+  // stacks freed by later destructors start a new cache
+  fiber_stack_pool_cache = NULL;
+  int i;
+  for (i = 0; i < FIBER_STACK_POOL_CLASSES; ++i) {
+    fiber_stack_pool_release(&cache->lists[i], i, 0, &cache->stats);
+  }
+  pthread_mutex_lock(&fiber_stack_pool_lock);
+  fiber_stack_pool_cache_t** link = &fiber_stack_pool_caches;
+  while (*link != cache) {
+    link = &(*link)->next;
+  }
+  *link = cache->next;
+  fiber_stack_pool_exited.hit_count += cache->stats.hit_count;
+  fiber_stack_pool_exited.global_hit_count += cache->stats.global_hit_count;
+  fiber_stack_pool_exited.miss_count += cache->stats.miss_count;
+  fiber_stack_pool_exited.unmap_count += cache->stats.unmap_count;
+  fiber_stack_pool_exited.trim_count += cache->stats.trim_count;
+  fiber_stack_pool_exited.trimmed_bytes += cache->stats.trimmed_bytes;
+  pthread_mutex_unlock(&fiber_stack_pool_lock);
+  free(cache);
+}
+
+static void fiber_stack_pool_init() {
+  fiber_stack_pool_page_size = sysconf(_SC_PAGESIZE);
+  const int ret =
+      pthread_key_create(&fiber_stack_pool_key, &fiber_stack_pool_thread_exit);
+  (void)ret;
+  assert(!ret);
+}
+
+// returns the calling thread's cache, creating it the first time. NULL if out
+// of memory.
+static fiber_stack_pool_cache_t* fiber_stack_pool_get_cache() {
+  if (fiber_stack_pool_cache) {
+    return fiber_stack_pool_cache;
+  }
+  fiber_stack_pool_cache_t* const cache = calloc(1, sizeof(*cache));
+  if (!cache) {
+    return NULL;
+  }
+  // the key's destructor hands the stacks back when the thread exits
+  if (pthread_setspecific(fiber_stack_pool_key, cache)) {
+    free(cache);
+    return NULL;
+  }
+  pthread_mutex_lock(&fiber_stack_pool_lock);
+  cache->next = fiber_stack_pool_caches;
+  fiber_stack_pool_caches = cache;
+  pthread_mutex_unlock(&fiber_stack_pool_lock);
+  fiber_stack_pool_cache = cache;
+  return cache;
+}
+
+void* fiber_stack_pool_get(size_t stack_size, size_t* size) {
+  assert(size);
+  pthread_once(&fiber_stack_pool_once, &fiber_stack_pool_init);
+  const int size_class = fiber_stack_pool_class(stack_size);
+  fiber_stack_pool_cache_t* const cache =
+      size_class >= 0 ? fiber_stack_pool_get_cache() : NULL;
+  if (!cache) {
+    // round up to whole pages, with one more for the guard page
+    const size_t page_size = fiber_stack_pool_page_size;
+    *size = size_class >= 0
+                ? fiber_stack_pool_class_size(size_class)
+                : (stack_size + 2 * page_size - 1) / page_size * page_size;
+    void* const stack = fiber_stack_pool_map(*size);
+    if (!stack) {
+      errno = ENOMEM;
+    }
+    return stack;
+  }
+
+  *size = fiber_stack_pool_class_size(size_class);
+  fiber_stack_pool_list_t* const list = &cache->lists[size_class];
+  void* stack = fiber_stack_pool_pop(list, size_class);
+  if (stack) {
+    cache->stats.hit_count += 1;
+    return stack;
+  }
+  pthread_mutex_lock(&fiber_stack_pool_lock);
+  // take enough to fill the cache halfway, so the next few are hits too
+  const size_t refill = atomic_load_explicit(&fiber_stack_pool_local_limit,
+                                             memory_order_relaxed) /
+                            2 +
+                        1;
+  fiber_stack_pool_move(&fiber_stack_pool_global[size_class], list,
+                        size_class, refill);
+  pthread_mutex_unlock(&fiber_stack_pool_lock);
+  stack = fiber_stack_pool_pop(list, size_class);
+  if (stack) {
+    cache->stats.global_hit_count += 1;
+    return stack;
+  }
+  cache->stats.miss_count += 1;
+  stack = fiber_stack_pool_map(*size);
+  if (!stack) {
+    errno = ENOMEM;
+  }
+  return stack;
+}
+
+// how far down from its top the stack has resident pages, or 0 if that can't
+// be told
+static size_t fiber_stack_pool_depth(void* stack, int size_class) {
+  const size_t page_size = fiber_stack_pool_page_size;
+  unsigned char resident[1 << FIBER_STACK_POOL_CLASSES];
+  const size_t size = fiber_stack_pool_class_size(size_class);
+  if (mincore(stack, size, resident)) {
+    return 0;
+  }
+  size_t i;
+  for (i = 1; i < size / page_size; ++i) {
+    if (resident[i] & 1) {
+      break;
+    }
+  }
+  return size - i * page_size;
+}
+
+// releases the pages of a freed stack which went deeper than stacks of its
+// class usually do. the usual depth moves an eighth of the way towards each
+// stack's, so one deep stack doesn't keep every later one deep.
+static void fiber_stack_pool_reclaim_stack(fiber_stack_pool_cache_t* cache,
+                                           int size_class, void* stack) {
+  const size_t depth = fiber_stack_pool_depth(stack, size_class);
+  size_t* const high_water = &cache->high_water[size_class];
+  const size_t keep = *high_water + fiber_stack_pool_page_size;
+  *high_water = *high_water - *high_water / 8 + depth / 8;
+  if (depth > keep) {
+    fiber_stack_pool_trim(stack, fiber_stack_pool_class_size(size_class),
+                          keep);
+  }
+}
+
+void fiber_stack_pool_put(void* stack, size_t size) {
+  assert(stack);
+  assert(fiber_stack_pool_page_size);
+  const int size_class = fiber_stack_pool_class_of(size);
+  fiber_stack_pool_cache_t* const cache =
+      size_class >= 0 ? fiber_stack_pool_get_cache() : NULL;
+  if (!cache) {
+    munmap(stack, size);
+    return;
+  }
+  if (atomic_load_explicit(&fiber_stack_pool_reclaim, memory_order_relaxed)) {
+    fiber_stack_pool_reclaim_stack(cache, size_class, stack);
+  }
+  fiber_stack_pool_list_t* const list = &cache->lists[size_class];
+  fiber_stack_pool_push(list, size_class, stack);
+  const size_t local_limit = atomic_load_explicit(
+      &fiber_stack_pool_local_limit, memory_order_relaxed);
+  if (list->count > local_limit) {
+    // keep half, so the next few frees don't come straight back here
+    fiber_stack_pool_release(list, size_class, local_limit / 2,
+                             &cache->stats);
+  }
+}
+
+void fiber_stack_pool_set_limits(size_t local_limit, size_t global_limit) {
+  atomic_store(&fiber_stack_pool_local_limit, local_limit);
+  atomic_store(&fiber_stack_pool_global_limit, global_limit);
+}
+
+void fiber_stack_pool_set_reclaim(int enabled, int lazy) {
+  int advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+  if (lazy) {
+    advice = MADV_FREE;
+  }
+#endif
+  atomic_store(&fiber_stack_pool_advice, advice);
+  atomic_store(&fiber_stack_pool_reclaim, enabled);
+}
+
+size_t fiber_stack_pool_trim(void* stack, size_t size, size_t keep) {
+  assert(stack);
+  pthread_once(&fiber_stack_pool_once, &fiber_stack_pool_init);
+  const size_t page_size = fiber_stack_pool_page_size;
+  if (keep >= size - page_size) {
+    return 0;
+  }
+  // everything above the guard page and below the first page keep touches
+  char* const low = (char*)stack + page_size;
+  char* const high = (char*)stack + (size - keep) / page_size * page_size;
+  if (high <= low) {
+    return 0;
+  }
+  const size_t length = high - low;
+  if (madvise(low, length,
+              atomic_load_explicit(&fiber_stack_pool_advice,
+                                   memory_order_relaxed))) {
+    return 0;
+  }
+  fiber_stack_pool_cache_t* const cache = fiber_stack_pool_get_cache();
+  if (cache) {
+    cache->stats.trim_count += 1;
+    cache->stats.trimmed_bytes += length;
+  }
+  return length;
+}
+
+void fiber_stack_pool_stats(fiber_stack_pool_stats_t* out) {
+  assert(out);
+  memset(out, 0, sizeof(*out));
+  pthread_mutex_lock(&fiber_stack_pool_lock);
+  *out = fiber_stack_pool_exited;
+  int i;
+  for (i = 0; i < FIBER_STACK_POOL_CLASSES; ++i) {
+    out->cached_count += fiber_stack_pool_global[i].count;
+  }
+  const fiber_stack_pool_cache_t* cache;
+  for (cache = fiber_stack_pool_caches; cache; cache = cache->next) {
+    out->hit_count += cache->stats.hit_count;
+    out->global_hit_count += cache->stats.global_hit_count;
+    out->miss_count += cache->stats.miss_count;
+    out->unmap_count += cache->stats.unmap_count;
+    out->trim_count += cache->stats.trim_count;
+    out->trimmed_bytes += cache->stats.trimmed_bytes;
+    for (i = 0; i < FIBER_STACK_POOL_CLASSES; ++i) {
+      out->cached_count += cache->lists[i].count;
+    }
+  }
+  pthread_mutex_unlock(&fiber_stack_pool_lock);
+}
@@ -0,0 +1,175 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_stack_profile.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "machine_specific.h"
+
+// sites are claimed by setting their key, and never given back (short of
+// fiber_stack_profile_reset()), so recording takes no locks
+typedef struct fiber_stack_profile_site {
+  _Atomic uintptr_t key;
+  _Atomic uint64_t count;
+  _Atomic size_t max_depth;
+  _Atomic size_t auto_size;
+  _Atomic uint64_t buckets[FIBER_STACK_PROFILE_BUCKETS];
+} fiber_stack_profile_site_t;
+
+static fiber_stack_profile_site_t
+    fiber_stack_profile_table[FIBER_STACK_PROFILE_SITES];
+static _Atomic int fiber_stack_profile_on = 0;
+static _Atomic int fiber_stack_profile_auto = 0;
+static _Atomic size_t fiber_stack_profile_margin = FIBER_STACK_PROFILE_MARGIN;
+
+static inline uintptr_t fiber_stack_profile_key(fiber_run_function_t site) {
+  return (uintptr_t)site;
+}
+
+// the site's entry, or NULL if it has none. with create set, an entry is
+// claimed for it if there's room.
+static fiber_stack_profile_site_t* fiber_stack_profile_find(
+    fiber_run_function_t site, int create) {
+  const uintptr_t key = fiber_stack_profile_key(site);
+  if (!key) {
+    return NULL;
+  }
+  // functions are at least 16 byte aligned more often than not
+  const size_t start = (key >> 4) % FIBER_STACK_PROFILE_SITES;
+  size_t i;
+  for (i = 0; i < FIBER_STACK_PROFILE_SITES; ++i) {
+    fiber_stack_profile_site_t* const entry =
+        &fiber_stack_profile_table[(start + i) % FIBER_STACK_PROFILE_SITES];
+    uintptr_t current = atomic_load(&entry->key);
+    if (current == key) {
+      return entry;
+    }
+    if (!current) {
+      if (!create) {
+        return NULL;
+      }
+      if (atomic_compare_exchange_strong(&entry->key, &current, key) ||
+          current == key) {
+        return entry;
+      }
+    }
+  }
+  return NULL;
+}
+
+// the upper bound of the bucket holding the 99th percentile of entry's
+// samples. samples in the last bucket could be any deeper, so the deepest
+// one stands in for them.
+static size_t fiber_stack_profile_p99(fiber_stack_profile_site_t* entry) {
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < FIBER_STACK_PROFILE_BUCKETS; ++i) {
+    total += atomic_load_explicit(&entry->buckets[i], memory_order_relaxed);
+  }
+  if (!total) {
+    return 0;
+  }
+  // the number of samples at or below the percentile
+  const uint64_t rank = total - total / 100;
+  uint64_t seen = 0;
+  for (i = 0; i < FIBER_STACK_PROFILE_BUCKETS - 1; ++i) {
+    seen += atomic_load_explicit(&entry->buckets[i], memory_order_relaxed);
+    if (seen >= rank) {
+      return (size_t)(i + 1) * FIBER_STACK_PROFILE_BUCKET_SIZE;
+    }
+  }
+  return atomic_load_explicit(&entry->max_depth, memory_order_relaxed);
+}
+
+void fiber_stack_profile_enable(int enabled) {
+  atomic_store(&fiber_stack_profile_on, enabled);
+}
+
+int fiber_stack_profile_enabled() {
+  return atomic_load_explicit(&fiber_stack_profile_on, memory_order_relaxed);
+}
+
+void fiber_stack_profile_auto_size(int enabled, size_t margin) {
+  atomic_store(&fiber_stack_profile_margin,
+               margin ? margin : FIBER_STACK_PROFILE_MARGIN);
+  atomic_store(&fiber_stack_profile_auto, enabled);
+}
+
+void fiber_stack_profile_record(fiber_run_function_t site, size_t depth) {
+  fiber_stack_profile_site_t* const entry = fiber_stack_profile_find(site, 1);
+  if (!entry) {
+    return;
+  }
+  size_t bucket = depth / FIBER_STACK_PROFILE_BUCKET_SIZE;
+  if (bucket >= FIBER_STACK_PROFILE_BUCKETS) {
+    bucket = FIBER_STACK_PROFILE_BUCKETS - 1;
+  }
+  atomic_fetch_add_explicit(&entry->buckets[bucket], 1, memory_order_relaxed);
+  size_t max_depth =
+      atomic_load_explicit(&entry->max_depth, memory_order_relaxed);
+  while (depth > max_depth &&
+         !atomic_compare_exchange_weak(&entry->max_depth, &max_depth, depth)) {
+  }
+  const uint64_t count =
+      atomic_fetch_add_explicit(&entry->count, 1, memory_order_relaxed) + 1;
+  // the percentile is only worked out now and then, so fiber_create() needn't
+  if (count % FIBER_STACK_PROFILE_MIN_SAMPLES == 0) {
+    const size_t margin =
+        atomic_load_explicit(&fiber_stack_profile_margin, memory_order_relaxed);
+    atomic_store_explicit(&entry->auto_size,
+                          fiber_stack_profile_p99(entry) + margin,
+                          memory_order_relaxed);
+  }
+}
+
+size_t fiber_stack_profile_size(fiber_run_function_t site,
+                                size_t stack_size) {
+  if (fiber_likely(!atomic_load_explicit(&fiber_stack_profile_auto,
+                                         memory_order_relaxed))) {
+    return stack_size;
+  }
+  fiber_stack_profile_site_t* const entry = fiber_stack_profile_find(site, 0);
+  if (!entry) {
+    return stack_size;
+  }
+  const size_t auto_size =
+      atomic_load_explicit(&entry->auto_size, memory_order_relaxed);
+  return auto_size ? auto_size : stack_size;
+}
+
+int fiber_stack_profile_get(fiber_run_function_t site,
+                            fiber_stack_profile_stats_t* out) {
+  assert(out);
+  fiber_stack_profile_site_t* const entry = fiber_stack_profile_find(site, 0);
+  if (!entry || !atomic_load(&entry->count)) {
+    return FIBER_ERROR;
+  }
+  out->count = atomic_load(&entry->count);
+  out->max_depth = atomic_load(&entry->max_depth);
+  out->p99_depth = fiber_stack_profile_p99(entry);
+  out->auto_size = atomic_load(&entry->auto_size);
+  return FIBER_SUCCESS;
+}
+
+size_t fiber_stack_profile_sites(fiber_run_function_t* sites, size_t max) {
+  assert(sites || !max);
+  size_t written = 0;
+  int i;
+  for (i = 0; i < FIBER_STACK_PROFILE_SITES && written < max; ++i) {
+    fiber_stack_profile_site_t* const entry = &fiber_stack_profile_table[i];
+    const uintptr_t key = atomic_load(&entry->key);
+    if (key && atomic_load(&entry->count)) {
+      sites[written++] = (fiber_run_function_t)key;
+    }
+  }
+  return written;
+}
+
+void fiber_stack_profile_reset() {
+  // not safe against concurrent recording, which could land in a site being
+  // cleared
+  memset(fiber_stack_profile_table, 0, sizeof(fiber_stack_profile_table));
+}
@@ -0,0 +1,157 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_topology.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fiber_context.h"
+
+#define FIBER_TOPOLOGY_SYSFS "/sys/devices/system/cpu"
+#define FIBER_TOPOLOGY_MAX_CACHES (16)
+
+// each id is the lowest CPU (or the node number) of the group, -1 if unknown
+typedef struct fiber_topology_cpu {
+  int core;
+  int llc;
+  int node;
+} fiber_topology_cpu_t;
+
+static fiber_topology_cpu_t* fiber_topology_cpus = NULL;
+static int fiber_topology_num_cpus = 0;
+
+// returns the first integer in the file, which for a cpu list is its lowest
+// CPU, or -1 if the file can't be read
+static int fiber_topology_read_int(const char* path) {
+  FILE* const file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  int value = -1;
+  if (fscanf(file, "%d", &value) != 1) {
+    value = -1;
+  }
+  fclose(file);
+  return value;
+}
+
+static int fiber_topology_read_llc(int cpu) {
+  char path[256];
+  int best_level = -1;
+  int llc = -1;
+  int i;
+  for (i = 0; i < FIBER_TOPOLOGY_MAX_CACHES; ++i) {
+    snprintf(path, sizeof(path),
+             FIBER_TOPOLOGY_SYSFS "/cpu%d/cache/index%d/level", cpu, i);
+    const int level = fiber_topology_read_int(path);
+    if (level < 0) {
+      break;
+    }
+    if (level > best_level) {
+      snprintf(path, sizeof(path),
+               FIBER_TOPOLOGY_SYSFS "/cpu%d/cache/index%d/shared_cpu_list", cpu,
+               i);
+      best_level = level;
+      llc = fiber_topology_read_int(path);
+    }
+  }
+  return llc;
+}
+
+static int fiber_topology_read_node(int cpu) {
+  char path[256];
+  snprintf(path, sizeof(path), FIBER_TOPOLOGY_SYSFS "/cpu%d", cpu);
+  DIR* const dir = opendir(path);
+  if (!dir) {
+    return -1;
+  }
+  int node = -1;
+  struct dirent* entry;
+  while ((entry = readdir(dir))) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1) {
+      break;
+    }
+    node = -1;
+  }
+  closedir(dir);
+  if (node < 0) {
+    // no NUMA support in the kernel; treat each package as a node
+    snprintf(path, sizeof(path),
+             FIBER_TOPOLOGY_SYSFS "/cpu%d/topology/physical_package_id", cpu);
+    node = fiber_topology_read_int(path);
+  }
+  return node;
+}
+
+int fiber_topology_init() {
+  if (fiber_topology_cpus) {
+    return FIBER_SUCCESS;
+  }
+  long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  if (num_cpus < 1) {
+    num_cpus = 1;
+  }
+  fiber_topology_cpu_t* const cpus = calloc(num_cpus, sizeof(*cpus));
+  if (!cpus) {
+    return FIBER_ERROR;
+  }
+
+  char path[256];
+  int i;
+  for (i = 0; i < num_cpus; ++i) {
+    snprintf(path, sizeof(path),
+             FIBER_TOPOLOGY_SYSFS "/cpu%d/topology/thread_siblings_list", i);
+    cpus[i].core = fiber_topology_read_int(path);
+    cpus[i].llc = fiber_topology_read_llc(i);
+    cpus[i].node = fiber_topology_read_node(i);
+  }
+  fiber_topology_num_cpus = num_cpus;
+  fiber_topology_cpus = cpus;
+  return FIBER_SUCCESS;
+}
+
+void fiber_topology_shutdown() {
+  free(fiber_topology_cpus);
+  fiber_topology_cpus = NULL;
+  fiber_topology_num_cpus = 0;
+}
+
+int fiber_topology_cpu_count() { return fiber_topology_num_cpus; }
+
+int fiber_topology_node(int cpu) {
+  if (cpu < 0 || cpu >= fiber_topology_num_cpus) {
+    return -1;
+  }
+  return fiber_topology_cpus[cpu].node;
+}
+
+fiber_topology_level_t fiber_topology_distance(int cpu_a, int cpu_b) {
+  if (cpu_a < 0 || cpu_b < 0 || cpu_a >= fiber_topology_num_cpus ||
+      cpu_b >= fiber_topology_num_cpus) {
+    return FIBER_TOPOLOGY_REMOTE;
+  }
+  if (cpu_a == cpu_b) {
+    return FIBER_TOPOLOGY_SMT;
+  }
+  const fiber_topology_cpu_t* const a = &fiber_topology_cpus[cpu_a];
+  const fiber_topology_cpu_t* const b = &fiber_topology_cpus[cpu_b];
+  if (a->core >= 0 && a->core == b->core) {
+    return FIBER_TOPOLOGY_SMT;
+  }
+  if (a->llc >= 0 && a->llc == b->llc) {
+    return FIBER_TOPOLOGY_LLC;
+  }
+  if (a->node >= 0 && a->node == b->node) {
+    return FIBER_TOPOLOGY_NODE;
+  }
+  return FIBER_TOPOLOGY_REMOTE;
+}
+
+const char* fiber_topology_level_name(fiber_topology_level_t level) {
+  static const char* const names[FIBER_TOPOLOGY_LEVELS] = {"smt", "llc", "node",
+                                                           "remote"};
+  return level < FIBER_TOPOLOGY_LEVELS ? names[level] : "unknown";
+}
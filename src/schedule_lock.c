@@ -1,37 +1,258 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
 #include "schedule_lock.h"
-#include "fiber_rwlock.h"
-
-fiber_rwlock_t lock;
-int lock_using ;
-
-void add_lock(){
-    /* Logic to allocate hashtable entry for new lock*/
-    int val;
-    fiber_rwlock_rdlock(&lock);
-    val = lock_using;
-    fiber_rwlock_rdunlock(&lock);
-
-    if (val <0 ){ // add lock only if it hasnt been added before
-        fiber_rwlock_wrlock(&lock);
-        lock_using = 0; // sets this globally
-        fiber_rwlock_wrlock(&lock);
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+schedule_lock_entry_t* schedule_lock_create(void* lock) {
+  assert(lock);
+  schedule_lock_entry_t* entry = NULL;
+  if (posix_memalign((void**)&entry, FIBER_CACHELINE_SIZE, sizeof(*entry))) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(entry, 0, sizeof(*entry));
+  entry->lock = lock;
+  entry->slice_size = SCHEDULE_LOCK_MIN_SLICE;
+  return entry;
+}
+
+schedule_lock_entry_t* schedule_lock_create_shared(
+    void* lock, schedule_lock_entry_t* peer) {
+  schedule_lock_entry_t* const entry = schedule_lock_create(lock);
+  if (entry) {
+    entry->shared = 1;
+    if (peer) {
+      entry->peer = peer;
+      peer->peer = entry;
+    }
+  }
+  return entry;
+}
+
+void schedule_lock_destroy(schedule_lock_entry_t* entry) {
+  if (entry) {
+    if (entry->peer) {
+      entry->peer->peer = NULL;
     }
+    free(entry);
+  }
+}
+
+void schedule_lock_wait_out_ban(schedule_lock_entry_t* entry) {
+  assert(entry);
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager) {
+    return;
+  }
+  fiber_t* const this_fiber = manager->current_fiber;
+  lock_stats_t* const stats = this_fiber->fiber_stats;
+  uint64_t class_banned_until =
+      atomic_load_explicit(&entry->banned_until, memory_order_relaxed);
+  if (class_banned_until > fiber_manager_clock(manager)) {
+    // the whole class is banned; wait it out like a per-fiber ban
+    atomic_store_explicit(&stats->banned_until, class_banned_until,
+                          memory_order_relaxed);
+    stats->banned_lock = entry->lock;
+  } else if (class_banned_until) {
+    // expired, so later fibers needn't come here
+    atomic_compare_exchange_strong(&entry->banned_until, &class_banned_until,
+                                   0);
+  }
+  if (stats->banned_lock != entry->lock) {
+    return;
+  }
+
+  // a banned fiber still wants the lock
+  atomic_fetch_add(&entry->contenders, 1);
+  stats->contending = entry;
+  while (schedule_lock_fiber_is_banned(fiber_manager_get(), this_fiber)) {
+    fiber_yield();
+  }
+  stats->contending = NULL;
+  stats->banned_lock = NULL;
+  atomic_fetch_sub(&entry->contenders, 1);
+}
+
+// the number of fibers waiting for the lock, with waiting fibers of the other
+// class of a reader-writer lock counting as one
+static inline int schedule_lock_waiters(schedule_lock_entry_t* entry) {
+  int waiters = atomic_load_explicit(&entry->contenders, memory_order_acquire);
+  if (entry->peer &&
+      atomic_load_explicit(&entry->peer->contenders, memory_order_acquire)) {
+    ++waiters;
+  }
+  return waiters;
+}
+
+// the time now: read afresh if anyone waits for the lock, so they're charged
+// accurately, and the manager's cached clock otherwise
+static inline uint64_t schedule_lock_now(fiber_manager_t* manager, int timed) {
+  return timed ? fiber_manager_refresh_clock(manager)
+               : fiber_manager_clock(manager);
+}
+
+void schedule_lock_acquired(schedule_lock_entry_t* entry, int contended) {
+  if (!entry) {
+    return;
+  }
+  if (contended) {
+    atomic_fetch_sub(&entry->contenders, 1);
+  }
+
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager) {
+    return;
+  }
+  fiber_t* const this_fiber = manager->current_fiber;
+  entry->timed = contended || schedule_lock_waiters(entry);
+  const uint64_t now = schedule_lock_now(manager, entry->timed);
+  if (entry->slice_owner != this_fiber || now >= entry->slice_end) {
+    // start a new slice for this fiber
+    const uint64_t slice_size = this_fiber->fiber_stats->slice_size;
+    entry->slice_owner = this_fiber;
+    entry->slice_end = now + (slice_size ? slice_size : entry->slice_size);
+    entry->slice_usage = 0;
+  }
+  entry->acquired_at = now;
+  // only the holder counts, so this needn't be a read-modify-write
+  atomic_store_explicit(
+      &entry->acquire_count,
+      atomic_load_explicit(&entry->acquire_count, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+  atomic_store_explicit(&entry->owner, this_fiber, memory_order_release);
+}
+
+static inline void schedule_lock_update_slice(schedule_lock_entry_t* entry,
+                                              uint64_t held) {
+  if (entry->hold_ewma) {
+    entry->hold_ewma = entry->hold_ewma -
+                       (entry->hold_ewma >> SCHEDULE_LOCK_EWMA_SHIFT) +
+                       (held >> SCHEDULE_LOCK_EWMA_SHIFT);
+  } else {
+    entry->hold_ewma = held;
+  }
+  uint64_t slice_size = entry->hold_ewma * SCHEDULE_LOCK_SLICE_FACTOR;
+  if (slice_size < SCHEDULE_LOCK_MIN_SLICE) {
+    slice_size = SCHEDULE_LOCK_MIN_SLICE;
+  } else if (slice_size > SCHEDULE_LOCK_MAX_SLICE) {
+    slice_size = SCHEDULE_LOCK_MAX_SLICE;
+  }
+  entry->slice_size = slice_size;
+}
+
+void schedule_lock_released(schedule_lock_entry_t* entry) {
+  if (!entry) {
+    return;
+  }
+  fiber_t* const owner =
+      atomic_load_explicit(&entry->owner, memory_order_acquire);
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!owner || !manager) {
+    // acquired outside of a fiber (ie. before fiber_manager_init())
+    return;
+  }
+
+  const int waiters = schedule_lock_waiters(entry);
+  const int timed = entry->timed || waiters;
+  const uint64_t now = schedule_lock_now(manager, timed);
+  const uint64_t held =
+      now > entry->acquired_at ? now - entry->acquired_at : 0;
+  entry->slice_usage += held;
+  owner->fiber_stats->write_usage += held;
+  // a hold which others queued up behind is what the slice is sized for, even
+  // if nobody was waiting when it started
+  if (timed) {
+    schedule_lock_update_slice(entry, held);
+  }
+
+  if (waiters && now >= entry->slice_end) {
+    // ban the owner long enough for each waiter to get the same usage
+    lock_stats_t* const stats = owner->fiber_stats;
+    atomic_store_explicit(&stats->banned_until,
+                          now + entry->slice_usage * waiters,
+                          memory_order_relaxed);
+    stats->banned_lock = entry->lock;
+    atomic_fetch_add_explicit(&entry->ban_count, 1, memory_order_relaxed);
+    entry->slice_owner = NULL;
+  }
+  atomic_store_explicit(&entry->owner, NULL, memory_order_release);
 }
 
-void set_lock_status() {
-  fiber_rwlock_wrlock(&lock);
-  lock_using = 1;
-  fiber_rwlock_wrunlock(&lock);
+void schedule_lock_shared_acquired(schedule_lock_entry_t* entry,
+                                   int contended) {
+  if (!entry) {
+    return;
+  }
+  if (contended) {
+    atomic_fetch_sub(&entry->contenders, 1);
+  }
+
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager) {
+    return;
+  }
+  lock_stats_t* const stats = manager->current_fiber->fiber_stats;
+  const uint64_t now =
+      schedule_lock_now(manager, contended || schedule_lock_waiters(entry));
+  if (!stats->read_depth++) {
+    stats->read_acquired_at = now;
+  }
+  if (!atomic_fetch_add(&entry->holders, 1)) {
+    // the first reader starts a read phase. readers racing with the last
+    // reader of the previous phase may skew the timing slightly, which only
+    // affects how soon the class is banned.
+    if (now >= entry->slice_end) {
+      entry->slice_end = now + entry->slice_size;
+      entry->slice_usage = 0;
+    }
+    entry->acquired_at = now;
+  }
+  atomic_fetch_add_explicit(&entry->acquire_count, 1, memory_order_relaxed);
 }
 
-void init_scheduler_lock_data() { 
-    lock_using = -1; 
-   }
+void schedule_lock_shared_released(schedule_lock_entry_t* entry) {
+  if (!entry) {
+    return;
+  }
+  fiber_manager_t* const manager = fiber_manager_get();
+  if (!manager) {
+    return;
+  }
+  lock_stats_t* const stats = manager->current_fiber->fiber_stats;
+  if (!stats->read_depth) {
+    // acquired outside of a fiber (ie. before fiber_manager_init())
+    return;
+  }
+  const int writers_waiting =
+      entry->peer &&
+      atomic_load_explicit(&entry->peer->contenders, memory_order_acquire);
+  const uint64_t now = schedule_lock_now(manager, writers_waiting);
+  if (!--stats->read_depth && now > stats->read_acquired_at) {
+    stats->read_usage += now - stats->read_acquired_at;
+  }
+  if (atomic_fetch_sub(&entry->holders, 1) != 1) {
+    return;
+  }
 
-int is_lock_using() {
-  int val;
-  fiber_rwlock_rdlock(&lock);
-  val = lock_using;
-  fiber_rwlock_rdunlock(&lock);
-  return val;
-}  // we can pass in a particular lock we want toi look up
+  // the last reader ends the read phase
+  const uint64_t held =
+      now > entry->acquired_at ? now - entry->acquired_at : 0;
+  entry->slice_usage += held;
+  if (writers_waiting) {
+    schedule_lock_update_slice(entry, held);
+  }
+  if (now >= entry->slice_end) {
+    if (writers_waiting) {
+      // give the waiting writers as much time as the readers had
+      atomic_store_explicit(&entry->banned_until, now + entry->slice_usage,
+                            memory_order_relaxed);
+      atomic_fetch_add_explicit(&entry->ban_count, 1, memory_order_relaxed);
+    }
+    entry->slice_end = 0;
+  }
+}
@@ -129,3 +129,25 @@ void* wsd_work_stealing_deque_steal(wsd_work_stealing_deque_t* d) {
   }
   return ret;
 }
+
+size_t wsd_work_stealing_deque_steal_half(wsd_work_stealing_deque_t* d,
+                                          wsd_work_stealing_deque_t* to,
+                                          size_t max) {
+  assert(d);
+  assert(to);
+  assert(d != to);
+  size_t count = (wsd_work_stealing_deque_size(d) + 1) / 2;
+  if (count > max) {
+    count = max;
+  }
+  size_t stolen = 0;
+  while (stolen < count) {
+    void* const p = wsd_work_stealing_deque_steal(d);
+    if (p == WSD_EMPTY || p == WSD_ABORT) {
+      break;
+    }
+    wsd_work_stealing_deque_push_bottom(to, p);
+    ++stolen;
+  }
+  return stolen;
+}
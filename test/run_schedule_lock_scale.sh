@@ -0,0 +1,31 @@
+#!/bin/sh
+# SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+# SPDX-License-Identifier: MIT
+
+# usage: run_schedule_lock_scale.sh [max threads] [duration ms] [locks] [fibers per lock]
+THREADS=$1
+DURATION=$2
+LOCKS=$3
+FIBERS=$4
+if [ "$THREADS" = "" ]
+then
+    THREADS=4
+fi
+if [ "$DURATION" = "" ]
+then
+    DURATION=1000
+fi
+if [ "$LOCKS" = "" ]
+then
+    LOCKS=1
+fi
+if [ "$FIBERS" = "" ]
+then
+    FIBERS=8
+fi
+
+echo "lock threads acquisitions_per_second jain wait_p50_ns wait_p99_ns"
+for cur in `seq 1 $THREADS`
+do
+    ./bin/test_schedule_lock_scale $cur $DURATION $LOCKS $FIBERS
+done | awk '/^total:/ { print $2, $4, $9, $14, $17, $20 }'
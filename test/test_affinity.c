@@ -0,0 +1,112 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+#define NUM_THREADS 4
+#define NUM_PINNED 16
+#define NUM_FREE 64
+#define NUM_YIELDS 100
+
+_Atomic int away_count = 0;
+_Atomic int unpinned_count = 0;
+
+void* pinned_function(void* param) {
+  const int home = (intptr_t)param;
+  int i;
+  for (i = 0; i < NUM_YIELDS; ++i) {
+    fiber_manager_t* const manager = fiber_manager_get();
+    if (manager->id != home) {
+      atomic_fetch_add(&away_count, 1);
+    }
+    if (manager->cpu < 0) {
+      atomic_fetch_add(&unpinned_count, 1);
+    }
+    fiber_yield();
+  }
+  return NULL;
+}
+
+void* free_function(void* param) {
+  int i;
+  for (i = 0; i < NUM_YIELDS; ++i) {
+    fiber_yield();
+  }
+  return NULL;
+}
+
+void* move_function(void* param) {
+  // starts out pinned to the manager before its new home, and moves home the
+  // next time it yields, even with nothing else to run
+  fiber_manager_t* const manager = fiber_manager_get();
+  test_assert(manager->id == NUM_THREADS - 2);
+  const int home = NUM_THREADS - 1;
+  test_assert(fiber_set_home_manager(manager->current_fiber, home) ==
+              FIBER_SUCCESS);
+  // wait (without yielding) for main to join and every other manager to go
+  // idle, so the first yield below has nothing else to switch to
+  while (atomic_load(&fiber_manager_idle_count) < NUM_THREADS - 1) {
+    cpu_relax();
+  }
+  int i;
+  for (i = 0; i < NUM_YIELDS; ++i) {
+    fiber_yield();
+    if (fiber_manager_get()->id != home) {
+      atomic_fetch_add(&away_count, 1);
+    }
+  }
+  return (void*)(intptr_t)fiber_manager_get()->id;
+}
+
+int main() {
+  fiber_manager_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.pin_threads = 1;
+  test_assert(fiber_manager_init_with_options(NUM_THREADS, &options) ==
+              FIBER_SUCCESS);
+  test_assert(fiber_manager_get()->cpu >= 0);
+
+  fiber_t* const self = fiber_manager_get()->current_fiber;
+  test_assert(fiber_get_home_manager(self) == -1);
+  test_assert(fiber_set_home_manager(self, NUM_THREADS) == FIBER_ERROR);
+  test_assert(errno == EINVAL);
+
+  fiber_t* pinned[NUM_PINNED];
+  fiber_t* free_fibers[NUM_FREE];
+  int i;
+  for (i = 0; i < NUM_PINNED; ++i) {
+    const int home = i % NUM_THREADS;
+    pinned[i] = fiber_create_no_sched(20000, &pinned_function,
+                                      (void*)(intptr_t)home);
+    test_assert(fiber_set_home_manager(pinned[i], home) == FIBER_SUCCESS);
+    fiber_manager_schedule(fiber_manager_get(), pinned[i]);
+  }
+  // plenty of other work, so the managers steal from each other
+  for (i = 0; i < NUM_FREE; ++i) {
+    free_fibers[i] = fiber_create(20000, &free_function, NULL);
+  }
+  for (i = 0; i < NUM_PINNED; ++i) {
+    fiber_join(pinned[i], NULL);
+  }
+  for (i = 0; i < NUM_FREE; ++i) {
+    fiber_join(free_fibers[i], NULL);
+  }
+  // the queues are empty now, so the mover's yield finds nothing else to run
+  fiber_t* const mover = fiber_create_no_sched(20000, &move_function, NULL);
+  test_assert(fiber_set_home_manager(mover, NUM_THREADS - 2) == FIBER_SUCCESS);
+  fiber_manager_schedule(fiber_manager_get(), mover);
+  void* result = NULL;
+  fiber_join(mover, &result);
+  test_assert((intptr_t)result == NUM_THREADS - 1);
+
+  test_assert(away_count == 0);
+  test_assert(unpinned_count == 0);
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.sent_home_count > 0);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -47,6 +47,13 @@ int main(int argc, char* argv[]) {
 
   fiber_join(ping_fiber, NULL);
 
+  if (argc <= 1) {
+    // woken receivers run next instead of queueing behind other fibers
+    fiber_manager_stats_t stats;
+    fiber_manager_all_stats(&stats);
+    test_assert(stats.runnext_count > 0);
+  }
+
   fiber_bounded_channel_destroy(channel_one);
   fiber_bounded_channel_destroy(channel_two);
 
@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+#define NUM_FIBERS 16
+
+_Atomic int run_order = 0;
+int order[NUM_FIBERS];
+
+void* record_function(void* param) {
+  order[(intptr_t)param] = atomic_fetch_add(&run_order, 1);
+  return NULL;
+}
+
+int main() {
+  // one thread, so the order in which fibers run is up to the scheduler
+  test_assert(fiber_manager_init_with_scheduler(1, "edf") == FIBER_SUCCESS);
+  fiber_t* const self = fiber_manager_get()->current_fiber;
+  test_assert(!fiber_get_deadline(self));
+
+  // fibers inherit their creator's deadline. create them out of order.
+  const uint64_t now = fiber_manager_read_clock();
+  fiber_t* fibers[NUM_FIBERS];
+  int i;
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    const int rank = (i * 7) % NUM_FIBERS;
+    fiber_set_deadline(self, now + 1000000000ULL + rank * 1000000ULL);
+    fibers[rank] = fiber_create(20000, &record_function, (void*)(intptr_t)rank);
+    test_assert(fiber_get_deadline(fibers[rank]) == fiber_get_deadline(self));
+  }
+  fiber_set_deadline(self, 0);
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+  // earliest deadline first
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    test_assert(order[i] == i);
+  }
+
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  test_assert(!stats.deadline_miss_count);
+
+  // a fiber finishing after its deadline is counted
+  fiber_t* const late = fiber_create(20000, &record_function, NULL);
+  fiber_set_deadline(late, 1);
+  fiber_join(late, NULL);
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.deadline_miss_count == 1);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,73 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+#define NUM_THREADS 2
+#define NUM_FIBERS 1000
+
+void* stats_function(void* param) {
+  fiber_t* const this_fiber = fiber_manager_get()->current_fiber;
+  // the fiber and its lock stats share one cache-aligned block
+  test_assert((uintptr_t)this_fiber % FIBER_CACHELINE_SIZE == 0);
+  test_assert((char*)this_fiber->fiber_stats > (char*)this_fiber);
+  test_assert((char*)this_fiber->fiber_stats <
+              (char*)this_fiber + 2 * sizeof(*this_fiber));
+  test_assert(this_fiber->fiber_stats->banned_until == 0);
+  test_assert(this_fiber->fiber_stats->slice_size == 0);
+  // dirty the stats, a reused block has to come back zeroed
+  const uint64_t slice_size = 1000;
+  set_lock_stats(this_fiber, NULL, &slice_size);
+  return NULL;
+}
+
+// creates and joins fibers on manager (intptr_t)param. it runs on manager 0,
+// so that's where every fiber's block comes from.
+void* creator_function(void* param) {
+  const int manager = (intptr_t)param;
+  int i;
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    test_assert(fiber_manager_get()->id == 0);
+    fiber_t* const the_fiber =
+        fiber_manager_submit(manager, 20000, &stats_function, NULL);
+    test_assert(the_fiber);
+    fiber_join(the_fiber, NULL);
+  }
+  return NULL;
+}
+
+static void run_fibers(intptr_t manager) {
+  fiber_t* const creator =
+      fiber_manager_submit(0, 20000, &creator_function, (void*)manager);
+  test_assert(creator);
+  fiber_join(creator, NULL);
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  // fibers which finish where they were created are reused straight away
+  fiber_manager_stats_t before;
+  memset(&before, 0, sizeof(before));
+  fiber_manager_all_stats(&before);
+  run_fibers(0);
+  fiber_manager_stats_t after;
+  memset(&after, 0, sizeof(after));
+  fiber_manager_all_stats(&after);
+  test_assert(after.reused_fiber_count - before.reused_fiber_count >=
+              NUM_FIBERS - 1);
+
+  // fibers which finish elsewhere are sent back in batches, and reused once
+  // they're back
+  before = after;
+  run_fibers(1);
+  memset(&after, 0, sizeof(after));
+  fiber_manager_all_stats(&after);
+  test_assert(after.returned_fiber_count > before.returned_fiber_count);
+  test_assert(after.reused_fiber_count > before.reused_fiber_count);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
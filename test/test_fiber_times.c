@@ -0,0 +1,110 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <unistd.h>
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "fiber_mutex.h"
+#include "test_helper.h"
+
+#define WAIT_US (20000)
+// timers only have millisecond resolution, and the clock is read once per
+// scheduling round
+#define MIN_NS (WAIT_US * 1000ULL / 2)
+
+void* spin_function(void* param) {
+  const uint64_t until = fiber_manager_read_clock() + WAIT_US * 1000ULL;
+  while (fiber_manager_read_clock() < until) {
+  }
+  return NULL;
+}
+
+void* sleep_function(void* param) {
+  fiber_sleep(0, WAIT_US);
+  return NULL;
+}
+
+fiber_mutex_t mutex;
+
+void* lock_function(void* param) {
+  fiber_mutex_lock(&mutex);
+  fiber_mutex_unlock(&mutex);
+  return NULL;
+}
+
+int pipe_fds[2];
+
+void* io_function(void* param) {
+  test_assert(fiber_wait_for_event(pipe_fds[0], FIBER_POLL_IN));
+  return NULL;
+}
+
+static uint64_t time_in(fiber_t* the_fiber, fiber_time_kind_t kind) {
+  uint64_t times[FIBER_TIME_KINDS];
+  fiber_get_times(the_fiber, times);
+  return times[kind];
+}
+
+int main() {
+  test_assert(!strcmp(fiber_time_kind_name(FIBER_TIME_SLEEP), "sleep"));
+
+  fiber_manager_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.account_time = 1;
+  // one thread, so fibers which are ready have to wait for each other
+  test_assert(fiber_manager_init_with_options(1, &options) == FIBER_SUCCESS);
+
+  fiber_t* const spinner = fiber_create(20000, &spin_function, NULL);
+  fiber_t* const waiting = fiber_create(20000, &spin_function, NULL);
+  fiber_join(spinner, NULL);
+  fiber_join(waiting, NULL);
+  test_assert(time_in(spinner, FIBER_TIME_RUNNING) >= MIN_NS);
+  // one of them waited for the other to finish
+  test_assert(time_in(spinner, FIBER_TIME_READY) >= MIN_NS ||
+              time_in(waiting, FIBER_TIME_READY) >= MIN_NS);
+
+  fiber_t* const sleeper = fiber_create(20000, &sleep_function, NULL);
+  fiber_join(sleeper, NULL);
+  test_assert(time_in(sleeper, FIBER_TIME_SLEEP) >= MIN_NS);
+  test_assert(time_in(sleeper, FIBER_TIME_RUNNING) < MIN_NS);
+
+  fiber_mutex_init(&mutex);
+  fiber_mutex_lock(&mutex);
+  fiber_t* const locker = fiber_create(20000, &lock_function, NULL);
+  fiber_sleep(0, WAIT_US);
+  fiber_mutex_unlock(&mutex);
+  fiber_join(locker, NULL);
+  test_assert(time_in(locker, FIBER_TIME_LOCK) >= MIN_NS);
+
+  // the wait ends when the lock is released, not when its holder last
+  // started running
+  fiber_mutex_lock(&mutex);
+  fiber_t* const blocked = fiber_create(20000, &lock_function, NULL);
+  fiber_sleep(0, 1000);
+  spin_function(NULL);
+  fiber_mutex_unlock(&mutex);
+  fiber_join(blocked, NULL);
+  fiber_mutex_destroy(&mutex);
+  test_assert(time_in(blocked, FIBER_TIME_LOCK) >= MIN_NS);
+  test_assert(time_in(blocked, FIBER_TIME_LOCK) >
+              10 * time_in(blocked, FIBER_TIME_READY));
+
+  test_assert(!pipe(pipe_fds));
+  fiber_t* const reader = fiber_create(20000, &io_function, NULL);
+  fiber_sleep(0, WAIT_US);
+  test_assert(write(pipe_fds[1], "x", 1) == 1);
+  fiber_join(reader, NULL);
+  test_assert(time_in(reader, FIBER_TIME_IO) >= MIN_NS);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+
+  // the calling fiber is counted up to now, and joining is a plain wait
+  fiber_t* const self = fiber_manager_get()->current_fiber;
+  test_assert(time_in(self, FIBER_TIME_RUNNING) > 0);
+  test_assert(time_in(self, FIBER_TIME_WAIT) >= MIN_NS);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -28,12 +28,66 @@ static inline void fiber_manager_print_stats() {
          "\nsignal_spin_count: %" PRIu64 "\nmulti_signal_spin_count: %" PRIu64
          "\nwake_mpsc_spin_count: %" PRIu64 "\nwake_mpmc_spin_count: %" PRIu64
          "\npoll_count: %" PRIu64 "\nevent_wait_count: %" PRIu64
-         "\nlock_contention_count: %" PRIu64 "\n",
+         "\nlock_contention_count: %" PRIu64 "\npark_count: %" PRIu64
+         "\nrunnext_count: %" PRIu64 "\nrunnext_steal_count: %" PRIu64
+         "\nsleep_count: %" PRIu64 "\nwake_count: %" PRIu64
+         "\ndeadline_miss_count: %" PRIu64 "\npreempt_count: %" PRIu64
+         "\nsent_home_count: %" PRIu64 "\nidle_ns: %" PRIu64
+         "\nretire_count: %" PRIu64 "\ninjected_count: %" PRIu64
+         "\nreused_fiber_count: %" PRIu64 "\nreturned_fiber_count: %" PRIu64
+         "\nstack_copy_count: %" PRIu64 "\nstack_copied_bytes: %" PRIu64 "\n",
          stats.yield_count, stats.steal_count, stats.failed_steal_count,
          stats.spin_count, stats.signal_spin_count,
          stats.multi_signal_spin_count, stats.wake_mpsc_spin_count,
          stats.wake_mpmc_spin_count, stats.poll_count, stats.event_wait_count,
-         stats.lock_contention_count);
+         stats.lock_contention_count, stats.park_count, stats.runnext_count,
+         stats.runnext_steal_count, stats.sleep_count, stats.wake_count,
+         stats.deadline_miss_count, stats.preempt_count,
+         stats.sent_home_count, stats.idle_ns, stats.retire_count,
+         stats.injected_count, stats.reused_fiber_count,
+         stats.returned_fiber_count, stats.stack_copy_count,
+         stats.stack_copied_bytes);
+  int i;
+  for (i = 0; i < FIBER_TOPOLOGY_LEVELS; ++i) {
+    printf("%s_steal_count: %" PRIu64 "\n", fiber_topology_level_name(i),
+           stats.level_steal_count[i]);
+  }
+  for (i = 0; i < FIBER_MANAGER_HISTOGRAM_BUCKETS; ++i) {
+    if (!stats.run_length_histogram[i]) {
+      continue;
+    }
+    if (i + 1 < FIBER_MANAGER_HISTOGRAM_BUCKETS) {
+      printf("run_length_lt_%" PRIu64 "us: %" PRIu64 "\n", (uint64_t)1 << i,
+             stats.run_length_histogram[i]);
+    } else {
+      printf("run_length_ge_%" PRIu64 "us: %" PRIu64 "\n",
+             (uint64_t)1 << (i - 1), stats.run_length_histogram[i]);
+    }
+  }
+  for (i = 0; i < FIBER_MANAGER_HISTOGRAM_BUCKETS; ++i) {
+    if (!stats.latency_histogram[i]) {
+      continue;
+    }
+    if (i + 1 < FIBER_MANAGER_HISTOGRAM_BUCKETS) {
+      printf("sched_latency_lt_%" PRIu64 "us: %" PRIu64 "\n", (uint64_t)1 << i,
+             stats.latency_histogram[i]);
+    } else {
+      printf("sched_latency_ge_%" PRIu64 "us: %" PRIu64 "\n",
+             (uint64_t)1 << (i - 1), stats.latency_histogram[i]);
+    }
+  }
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    const char* const name = fiber_priority_name(i);
+    printf("%s_queue_depth: %" PRIu64 "\n%s_run_count: %" PRIu64
+           "\n%s_avg_latency_ns: %" PRIu64 "\n%s_max_latency_ns: %" PRIu64
+           "\n",
+           name, stats.class_queue_depth[i], name, stats.class_run_count[i],
+           name,
+           stats.class_run_count[i]
+               ? stats.class_latency_sum[i] / stats.class_run_count[i]
+               : 0,
+           name, stats.class_latency_max[i]);
+  }
 }
 
 #endif
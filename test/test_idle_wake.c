@@ -0,0 +1,81 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "fiber_signal.h"
+#include "test_helper.h"
+
+#define NUM_FIBERS 100
+#define NUM_ROUNDS 10
+#define NUM_THREADS 4
+
+_Atomic int run_count = 0;
+
+void* run_function(void* param) {
+  atomic_fetch_add(&run_count, 1);
+  fiber_yield();
+  return NULL;
+}
+
+fiber_signal_t wake_signal;
+_Atomic int signalled = 0;
+
+void* signalled_function(void* param) {
+  fiber_signal_wait(&wake_signal);
+  atomic_store(&signalled, 1);
+  return NULL;
+}
+
+int main() {
+  // nothing to wake before the event system is up
+  test_assert(!fiber_event_wake());
+
+  fiber_manager_init(NUM_THREADS);
+  test_assert(fiber_event_wake());
+
+  int round;
+  for (round = 0; round < NUM_ROUNDS; ++round) {
+    // give the other managers time to go idle
+    fiber_sleep(0, 10000);
+
+    fiber_t* fibers[NUM_FIBERS];
+    int i;
+    for (i = 0; i < NUM_FIBERS; ++i) {
+      fibers[i] = fiber_create(20000, &run_function, NULL);
+    }
+    for (i = 0; i < NUM_FIBERS; ++i) {
+      fiber_join(fibers[i], NULL);
+    }
+  }
+  test_assert(run_count == NUM_FIBERS * NUM_ROUNDS);
+
+  // the managers went idle between rounds and were woken for new fibers
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.sleep_count > 0);
+  test_assert(stats.wake_count > 0);
+  test_assert(atomic_load(&fiber_manager_idle_count) <= NUM_THREADS);
+
+  // a woken fiber waits in its waker's runnext slot. an idle manager steals
+  // it while the waker keeps running without yielding.
+  fiber_signal_init(&wake_signal);
+  fiber_t* const waiter = fiber_create(20000, &signalled_function, NULL);
+  // yields rather than sleeps, so no timer wakes the idle managers
+  while (atomic_load(&wake_signal.waiter) != waiter ||
+         atomic_load(&fiber_manager_idle_count) < NUM_THREADS - 1) {
+    fiber_yield();
+  }
+  test_assert(fiber_signal_raise(&wake_signal));
+  const uint64_t give_up = fiber_manager_read_clock() + 5000000000ULL;
+  while (!atomic_load(&signalled) && fiber_manager_read_clock() < give_up) {
+    cpu_relax();
+  }
+  test_assert(atomic_load(&signalled));
+  fiber_join(waiter, NULL);
+  fiber_signal_destroy(&wake_signal);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
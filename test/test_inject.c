@@ -0,0 +1,85 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "fiber_manager.h"
+#include "fiber_semaphore.h"
+#include "test_helper.h"
+
+#define NUM_THREADS 2
+#define NUM_INJECTORS 4
+#define PER_INJECTOR 100
+#define NUM_POSTERS 8
+
+_Atomic int run_count = 0;
+
+void* counting_function(void* param) {
+  atomic_fetch_add(&run_count, 1);
+  return NULL;
+}
+
+fiber_t* fibers[NUM_INJECTORS][PER_INJECTOR];
+
+// runs on a plain thread, which isn't a fiber manager
+void* injector_function(void* param) {
+  const intptr_t index = (intptr_t)param;
+  test_assert(!fiber_manager_get());
+  int i;
+  for (i = 0; i < PER_INJECTOR; ++i) {
+    fibers[index][i] = fiber_create(20000, &counting_function, NULL);
+    test_assert(fibers[index][i]);
+  }
+  return NULL;
+}
+
+fiber_semaphore_t semaphore;
+
+void* poster_function(void* param) {
+  // give the waiter time to block, so every manager is idle
+  usleep(10000);
+  fiber_semaphore_post(&semaphore);
+  return NULL;
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  // fibers created by other threads run on the managers
+  pthread_t threads[NUM_INJECTORS];
+  intptr_t i;
+  for (i = 0; i < NUM_INJECTORS; ++i) {
+    test_assert(!pthread_create(&threads[i], NULL, &injector_function,
+                                (void*)i));
+  }
+  for (i = 0; i < NUM_INJECTORS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  int j;
+  for (i = 0; i < NUM_INJECTORS; ++i) {
+    for (j = 0; j < PER_INJECTOR; ++j) {
+      fiber_join(fibers[i][j], NULL);
+    }
+  }
+  test_assert(run_count == NUM_INJECTORS * PER_INJECTOR);
+
+  // and other threads can wake a fiber while the managers are idle. each
+  // poster hands its hazard record on to the next one when it exits.
+  fiber_semaphore_init(&semaphore, 0);
+  for (i = 0; i < NUM_POSTERS; ++i) {
+    pthread_t poster;
+    test_assert(!pthread_create(&poster, NULL, &poster_function, NULL));
+    fiber_semaphore_wait(&semaphore);
+    pthread_join(poster, NULL);
+  }
+  fiber_semaphore_destroy(&semaphore);
+
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.injected_count >= NUM_INJECTORS * PER_INJECTOR);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
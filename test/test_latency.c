@@ -0,0 +1,103 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "fiber_mutex.h"
+#include "test_helper.h"
+
+#define NUM_FIBERS 100
+#define HOG_NS (2000000ULL)
+
+void* empty_function(void* param) { return NULL; }
+
+fiber_mutex_t mutex;
+
+void* lock_function(void* param) {
+  fiber_mutex_lock(&mutex);
+  fiber_mutex_unlock(&mutex);
+  return NULL;
+}
+
+int main() {
+  uint64_t histogram[FIBER_MANAGER_HISTOGRAM_BUCKETS];
+  memset(histogram, 0, sizeof(histogram));
+  test_assert(fiber_manager_histogram_percentile(histogram, 99) == 0);
+  histogram[0] = 90;
+  histogram[3] = 9;
+  histogram[FIBER_MANAGER_HISTOGRAM_BUCKETS - 1] = 1;
+  test_assert(fiber_manager_histogram_percentile(histogram, 0) == 1000);
+  test_assert(fiber_manager_histogram_percentile(histogram, 90) == 1000);
+  test_assert(fiber_manager_histogram_percentile(histogram, 91) == 8000);
+  test_assert(fiber_manager_histogram_percentile(histogram, 99) == 8000);
+  test_assert(fiber_manager_histogram_percentile(histogram, 100) ==
+              UINT64_MAX);
+
+  // one thread, so the new fiber waits for this one to stop hogging it
+  fiber_manager_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.track_latency = 1;
+  test_assert(fiber_manager_init_with_options(1, &options) == FIBER_SUCCESS);
+  fiber_t* const waiter = fiber_create(20000, &empty_function, NULL);
+  const uint64_t hog_until = fiber_manager_read_clock() + HOG_NS;
+  while (fiber_manager_read_clock() < hog_until) {
+  }
+  fiber_join(waiter, NULL);
+  test_assert(fiber_manager_latency_percentile(100) >= HOG_NS);
+
+  // a fiber's latency starts when it's woken, not when its waker last
+  // started running
+  fiber_mutex_init(&mutex);
+  fiber_mutex_lock(&mutex);
+  fiber_t* const locker = fiber_create(20000, &lock_function, NULL);
+  fiber_sleep(0, 1000);
+  fiber_manager_latency_histogram(histogram);
+  uint64_t slow_count = 0;
+  int i;
+  for (i = fiber_manager_histogram_bucket(HOG_NS);
+       i < FIBER_MANAGER_HISTOGRAM_BUCKETS; ++i) {
+    slow_count += histogram[i];
+  }
+  const uint64_t unlock_at = fiber_manager_read_clock() + HOG_NS;
+  while (fiber_manager_read_clock() < unlock_at) {
+  }
+  fiber_mutex_unlock(&mutex);
+  fiber_join(locker, NULL);
+  fiber_mutex_destroy(&mutex);
+  fiber_manager_latency_histogram(histogram);
+  for (i = fiber_manager_histogram_bucket(HOG_NS);
+       i < FIBER_MANAGER_HISTOGRAM_BUCKETS; ++i) {
+    slow_count -= histogram[i];
+  }
+  test_assert(slow_count == 0);
+
+  fiber_t* fibers[NUM_FIBERS];
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_create(20000, &empty_function, NULL);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+
+  // every fiber which ran was counted once
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  uint64_t run_count = 0;
+  uint64_t histogram_count = 0;
+  for (i = 0; i < FIBER_PRIORITY_CLASSES; ++i) {
+    run_count += stats.class_run_count[i];
+  }
+  fiber_manager_latency_histogram(histogram);
+  for (i = 0; i < FIBER_MANAGER_HISTOGRAM_BUCKETS; ++i) {
+    test_assert(histogram[i] == stats.latency_histogram[i]);
+    histogram_count += histogram[i];
+  }
+  test_assert(run_count >= NUM_FIBERS + 1);
+  test_assert(histogram_count == run_count);
+  test_assert(fiber_manager_latency_percentile(50) <=
+              fiber_manager_latency_percentile(100));
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+#define QUANTUM_NS (1000000)
+
+volatile int other_ran = 0;
+
+void* other_function(void* param) {
+  other_ran = 1;
+  return NULL;
+}
+
+void* spin_function(void* param) {
+  fiber_t* const other = fiber_create(20000, &other_function, NULL);
+  // only yields at the safe point once the preemption timer has marked it, so
+  // that's what lets the other fiber run
+  while (!other_ran) {
+    fiber_preempt_point();
+  }
+  fiber_join(other, NULL);
+  return NULL;
+}
+
+int main() {
+  // only running managers have timers
+  test_assert(fiber_manager_set_preemption(QUANTUM_NS) == FIBER_ERROR);
+  test_assert(errno == EINVAL);
+
+  // one thread, so the spinning fiber has it to itself
+  fiber_manager_init(1);
+  test_assert(fiber_manager_set_preemption(QUANTUM_NS) == FIBER_SUCCESS);
+
+  fiber_t* const spinner = fiber_create(20000, &spin_function, NULL);
+  fiber_join(spinner, NULL);
+  test_assert(other_ran);
+
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.preempt_count > 0);
+  // the spinner ran for at least a quantum before it was preempted
+  uint64_t long_runs = 0;
+  int i;
+  for (i = fiber_manager_histogram_bucket(QUANTUM_NS);
+       i < FIBER_MANAGER_HISTOGRAM_BUCKETS; ++i) {
+    long_runs += stats.run_length_histogram[i];
+  }
+  test_assert(long_runs > 0);
+
+  test_assert(fiber_manager_set_preemption(0) == FIBER_SUCCESS);
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
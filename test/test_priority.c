@@ -0,0 +1,98 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+#define NUM_FIBERS 8
+#define NUM_YIELDS 1000
+
+_Atomic int run_order = 0;
+int order[FIBER_PRIORITY_CLASSES][NUM_FIBERS];
+
+void* record_function(void* param) {
+  const fiber_priority_t priority =
+      fiber_get_priority(fiber_manager_get()->current_fiber);
+  order[priority][(intptr_t)param] = atomic_fetch_add(&run_order, 1);
+  return NULL;
+}
+
+volatile int hog_done = 0;
+
+void* hog_function(void* param) {
+  int i;
+  for (i = 0; i < NUM_YIELDS; ++i) {
+    fiber_yield();
+  }
+  hog_done = 1;
+  return NULL;
+}
+
+void* starved_function(void* param) {
+  // aging lets this run while the latency fibers still want the thread
+  return (void*)(intptr_t)!hog_done;
+}
+
+int main() {
+  test_assert(!strcmp(fiber_priority_name(FIBER_PRIORITY_BACKGROUND),
+                      "background"));
+
+  // one thread, so the order in which fibers run is up to the scheduler. the
+  // latency stats are checked too.
+  fiber_manager_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.track_latency = 1;
+  test_assert(fiber_manager_init_with_options(1, &options) == FIBER_SUCCESS);
+  fiber_t* const self = fiber_manager_get()->current_fiber;
+  test_assert(fiber_get_priority(self) == FIBER_PRIORITY_NORMAL);
+  test_assert(!fiber_create_with_priority(20000, &record_function, NULL,
+                                          FIBER_PRIORITY_CLASSES));
+  test_assert(errno == EINVAL);
+  test_assert(!fiber_set_priority(self, -1));
+
+  fiber_t* fibers[FIBER_PRIORITY_CLASSES][NUM_FIBERS];
+  int i;
+  int priority;
+  for (priority = FIBER_PRIORITY_CLASSES - 1; priority >= 0; --priority) {
+    for (i = 0; i < NUM_FIBERS; ++i) {
+      fibers[priority][i] = fiber_create_with_priority(
+          20000, &record_function, (void*)(intptr_t)i, priority);
+    }
+  }
+  for (priority = 0; priority < FIBER_PRIORITY_CLASSES; ++priority) {
+    for (i = 0; i < NUM_FIBERS; ++i) {
+      fiber_join(fibers[priority][i], NULL);
+    }
+  }
+  // higher classes ran first despite being created last
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    test_assert(order[FIBER_PRIORITY_LATENCY][i] < NUM_FIBERS);
+    test_assert(order[FIBER_PRIORITY_BACKGROUND][i] >= 2 * NUM_FIBERS);
+  }
+
+  // busy latency fibers don't starve a background fiber
+  fiber_t* const hog_one = fiber_create_with_priority(
+      20000, &hog_function, NULL, FIBER_PRIORITY_LATENCY);
+  fiber_t* const hog_two = fiber_create_with_priority(
+      20000, &hog_function, NULL, FIBER_PRIORITY_LATENCY);
+  fiber_t* const starved = fiber_create_with_priority(
+      20000, &starved_function, NULL, FIBER_PRIORITY_BACKGROUND);
+  void* result = NULL;
+  fiber_join(starved, &result);
+  test_assert(result);
+  fiber_join(hog_one, NULL);
+  fiber_join(hog_two, NULL);
+
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  for (priority = 0; priority < FIBER_PRIORITY_CLASSES; ++priority) {
+    test_assert(stats.class_run_count[priority] >= NUM_FIBERS);
+    test_assert(stats.class_latency_max[priority] *
+                    stats.class_run_count[priority] >=
+                stats.class_latency_sum[priority]);
+  }
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,121 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "fiber_semaphore.h"
+#include "test_helper.h"
+
+#define MAX_THREADS 4
+#define NUM_FIBERS 32
+#define MAX_WAITS 5000
+
+void* where_function(void* param) {
+  return (void*)(intptr_t)fiber_manager_get()->id;
+}
+
+fiber_semaphore_t semaphore;
+_Atomic int away_count = 0;
+
+void* blocked_function(void* param) {
+  fiber_semaphore_wait(&semaphore);
+  if (fiber_manager_get()->id != 0) {
+    atomic_fetch_add(&away_count, 1);
+  }
+  return NULL;
+}
+
+uint64_t give_up = 0;
+
+// busy until the auto-scaler adds a manager. the busy fibers can keep the
+// joining fiber from running, so they stop by themselves.
+void* busy_function(void* param) {
+  while (fiber_manager_get_kernel_thread_count() == 1 &&
+         fiber_manager_read_clock() < give_up) {
+    fiber_yield();
+  }
+  return NULL;
+}
+
+static int run_on(int manager) {
+  fiber_t* const the_fiber =
+      fiber_manager_submit(manager, 20000, &where_function, NULL);
+  test_assert(the_fiber);
+  void* result = NULL;
+  fiber_join(the_fiber, &result);
+  return (intptr_t)result;
+}
+
+static uint64_t retire_count() {
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  return stats.retire_count;
+}
+
+int main() {
+  fiber_manager_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.max_threads = MAX_THREADS;
+  test_assert(fiber_manager_init_with_options(2, &options) == FIBER_SUCCESS);
+  test_assert(fiber_manager_get_kernel_thread_count() == 2);
+  test_assert(!fiber_manager_set_thread_count(0));
+  test_assert(errno == EINVAL);
+  test_assert(!fiber_manager_set_thread_count(MAX_THREADS + 1));
+  test_assert(errno == EINVAL);
+  test_assert(!fiber_manager_submit(2, 20000, &where_function, NULL));
+  test_assert(errno == EINVAL);
+
+  // growing starts the remaining threads
+  test_assert(fiber_manager_set_thread_count(MAX_THREADS));
+  test_assert(fiber_manager_get_kernel_thread_count() == MAX_THREADS);
+  test_assert(run_on(MAX_THREADS - 1) == MAX_THREADS - 1);
+
+  // fibers homed on retired managers move to the one that's left
+  fiber_semaphore_init(&semaphore, 0);
+  fiber_t* fibers[NUM_FIBERS];
+  int i;
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_manager_submit(1 + i % (MAX_THREADS - 1), 20000,
+                                     &blocked_function, NULL);
+  }
+  test_assert(fiber_manager_set_thread_count(1));
+  for (i = 0; i < MAX_WAITS && retire_count() < MAX_THREADS - 1; ++i) {
+    fiber_sleep(0, 1000);
+  }
+  test_assert(retire_count() == MAX_THREADS - 1);
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_semaphore_post(&semaphore);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+  test_assert(away_count == 0);
+
+  // a retired manager can be activated again
+  test_assert(fiber_manager_set_thread_count(2));
+  test_assert(run_on(1) == 1);
+
+  // the auto-scaler adds managers while there's more work than managers...
+  test_assert(fiber_manager_set_thread_count(1));
+  test_assert(fiber_manager_autoscale(1, 1000000));
+  give_up = fiber_manager_read_clock() + 5000000000ULL;
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_create(20000, &busy_function, NULL);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+  test_assert(fiber_manager_get_kernel_thread_count() > 1);
+
+  // ...and retires them once they're idle
+  for (i = 0; i < MAX_WAITS && fiber_manager_get_kernel_thread_count() > 1;
+       ++i) {
+    fiber_sleep(0, 1000);
+  }
+  test_assert(fiber_manager_get_kernel_thread_count() == 1);
+  test_assert(fiber_manager_autoscale(0, 0));
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,236 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "schedule_lock.h"
+
+#include "fiber_manager.h"
+#include "fiber_mutex.h"
+#include "fiber_rwlock.h"
+#include "test_helper.h"
+
+#define PER_FIBER_COUNT 10000
+#define NUM_FIBERS 64
+#define NUM_LOCKS 8
+#define NUM_THREADS 4
+#define MANY_LOCKS 5000
+
+fiber_mutex_t lock_one;
+fiber_mutex_t lock_two;
+
+fiber_rwlock_t rwlock_one;
+fiber_rwlock_t rwlock_two;
+
+fiber_mutex_t locks[NUM_LOCKS];
+int volatile counters[NUM_LOCKS];
+
+static void spin_for_usec(uint64_t usec) {
+  const uint64_t end = fiber_manager_read_clock() + usec * 1000;
+  while (fiber_manager_read_clock() < end) {
+  }
+}
+
+volatile int hog_checked = 0;
+
+void* waiter_function(void* param) {
+  while (!schedule_lock_owner(lock_one.schedule_lock)) {
+    fiber_yield();
+  }
+  fiber_mutex_lock(&lock_one);
+  // releasing this short hold would pull the slice back down before the hog
+  // has looked at it
+  while (!hog_checked) {
+    fiber_yield();
+  }
+  fiber_mutex_unlock(&lock_one);
+  return NULL;
+}
+
+void* hog_function(void* param) {
+  fiber_t* const self = fiber_manager_get()->current_fiber;
+  schedule_lock_entry_t* const entry = lock_one.schedule_lock;
+  test_assert(entry);
+
+  fiber_mutex_lock(&lock_one);
+  test_assert(schedule_lock_owner(lock_one.schedule_lock) == self);
+  while (!atomic_load(&entry->contenders)) {
+    fiber_yield();
+  }
+  // hold the lock well past the slice while the waiter wants it
+  spin_for_usec(1000);
+  fiber_mutex_unlock(&lock_one);
+
+  // the slice grows to fit the long critical section, even though nobody
+  // waited when it began
+  test_assert(entry->slice_size == SCHEDULE_LOCK_MAX_SLICE);
+  test_assert(entry->ban_count == 1);
+  test_assert(get_lock_stats(self)->banned_lock == &lock_one);
+  hog_checked = 1;
+
+  // the ban on lock_one doesn't affect other locks
+  test_assert(!schedule_lock_fiber_is_banned(fiber_manager_get(), self));
+  fiber_mutex_lock(&lock_two);
+  test_assert(schedule_lock_owner(lock_two.schedule_lock) == self);
+  fiber_mutex_unlock(&lock_two);
+  test_assert(!schedule_lock_owner(lock_two.schedule_lock));
+  test_assert(get_lock_stats(self)->banned_lock == &lock_one);
+
+  return NULL;
+}
+
+void* writer_waiter_function(void* param) {
+  schedule_lock_entry_t* const readers = rwlock_one.read_schedule_lock;
+  while (!atomic_load(&readers->holders)) {
+    fiber_yield();
+  }
+  fiber_rwlock_wrlock(&rwlock_one);
+  fiber_rwlock_wrunlock(&rwlock_one);
+  return NULL;
+}
+
+void* reader_hog_function(void* param) {
+  fiber_t* const self = fiber_manager_get()->current_fiber;
+  schedule_lock_entry_t* const readers = rwlock_one.read_schedule_lock;
+  schedule_lock_entry_t* const writers = rwlock_one.write_schedule_lock;
+  test_assert(readers && writers);
+  test_assert(readers->peer == writers && writers->peer == readers);
+
+  fiber_rwlock_rdlock(&rwlock_one);
+  while (!atomic_load(&writers->contenders)) {
+    fiber_yield();
+  }
+  // a long read phase while a writer waits bans the whole read class
+  spin_for_usec(1000);
+  fiber_rwlock_rdunlock(&rwlock_one);
+
+  test_assert(readers->ban_count == 1);
+  test_assert(readers->banned_until > 0);
+  test_assert(get_lock_stats(self)->read_usage >= 1000000);
+  test_assert(!get_lock_stats(self)->read_depth);
+  return NULL;
+}
+
+void* reader_waiter_function(void* param) {
+  while (!schedule_lock_owner(rwlock_two.write_schedule_lock)) {
+    fiber_yield();
+  }
+  fiber_rwlock_rdlock(&rwlock_two);
+  fiber_rwlock_rdunlock(&rwlock_two);
+  return NULL;
+}
+
+void* writer_hog_function(void* param) {
+  fiber_t* const self = fiber_manager_get()->current_fiber;
+  schedule_lock_entry_t* const readers = rwlock_two.read_schedule_lock;
+  schedule_lock_entry_t* const writers = rwlock_two.write_schedule_lock;
+
+  fiber_rwlock_wrlock(&rwlock_two);
+  test_assert(schedule_lock_owner(rwlock_two.write_schedule_lock) == self);
+  while (!atomic_load(&readers->contenders)) {
+    fiber_yield();
+  }
+  spin_for_usec(1000);
+  fiber_rwlock_wrunlock(&rwlock_two);
+
+  // the writer is banned from writing only
+  test_assert(writers->ban_count == 1);
+  test_assert(get_lock_stats(self)->banned_lock == &rwlock_two);
+  test_assert(get_lock_stats(self)->write_usage >= 1000000);
+  test_assert(!schedule_lock_fiber_is_banned(fiber_manager_get(), self));
+  fiber_rwlock_rdlock(&rwlock_two);
+  fiber_rwlock_rdunlock(&rwlock_two);
+  test_assert(get_lock_stats(self)->banned_lock == &rwlock_two);
+  return NULL;
+}
+
+void* run_function(void* param) {
+  const intptr_t index = (intptr_t)param % NUM_LOCKS;
+  int i;
+  for (i = 0; i < PER_FIBER_COUNT; ++i) {
+    fiber_mutex_lock(&locks[index]);
+    ++counters[index];
+    fiber_mutex_unlock(&locks[index]);
+  }
+  return NULL;
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  fiber_mutex_init(&lock_one);
+  fiber_mutex_init(&lock_two);
+  test_assert(lock_one.schedule_lock);
+  test_assert(lock_two.schedule_lock);
+  test_assert(lock_one.schedule_lock != lock_two.schedule_lock);
+  test_assert(!schedule_lock_owner(lock_one.schedule_lock));
+
+  fiber_t* const hog = fiber_create(20000, &hog_function, NULL);
+  fiber_t* const waiter = fiber_create(20000, &waiter_function, NULL);
+  fiber_join(hog, NULL);
+  fiber_join(waiter, NULL);
+
+  fiber_mutex_destroy(&lock_one);
+  fiber_mutex_destroy(&lock_two);
+  test_assert(!lock_one.schedule_lock);
+  test_assert(!lock_two.schedule_lock);
+
+  fiber_rwlock_init(&rwlock_one);
+  fiber_rwlock_init(&rwlock_two);
+  fiber_t* const reader_hog = fiber_create(20000, &reader_hog_function, NULL);
+  fiber_t* const writer_waiter =
+      fiber_create(20000, &writer_waiter_function, NULL);
+  fiber_t* const writer_hog = fiber_create(20000, &writer_hog_function, NULL);
+  fiber_t* const reader_waiter =
+      fiber_create(20000, &reader_waiter_function, NULL);
+  fiber_join(reader_hog, NULL);
+  fiber_join(writer_waiter, NULL);
+  fiber_join(writer_hog, NULL);
+  fiber_join(reader_waiter, NULL);
+  fiber_rwlock_destroy(&rwlock_one);
+  fiber_rwlock_destroy(&rwlock_two);
+  test_assert(!rwlock_one.write_schedule_lock);
+  test_assert(!rwlock_one.read_schedule_lock);
+
+  int i;
+  for (i = 0; i < NUM_LOCKS; ++i) {
+    fiber_mutex_init(&locks[i]);
+  }
+
+  fiber_t* fibers[NUM_FIBERS];
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_create(20000, &run_function, (void*)(intptr_t)i);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+
+  for (i = 0; i < NUM_LOCKS; ++i) {
+    test_assert(counters[i] == (NUM_FIBERS / NUM_LOCKS) * PER_FIBER_COUNT);
+    test_assert(!schedule_lock_owner(locks[i].schedule_lock));
+    fiber_mutex_destroy(&locks[i]);
+  }
+
+  // any number of locks can be live, and taking one nobody wants doesn't
+  // count as contending
+  fiber_mutex_t* const many = calloc(MANY_LOCKS, sizeof(*many));
+  test_assert(many);
+  for (i = 0; i < MANY_LOCKS; ++i) {
+    test_assert(fiber_mutex_init(&many[i]));
+  }
+  for (i = 0; i < MANY_LOCKS; ++i) {
+    test_assert(many[i].schedule_lock);
+    fiber_mutex_lock(&many[i]);
+    test_assert(schedule_lock_owner(many[i].schedule_lock) ==
+                fiber_manager_get()->current_fiber);
+    test_assert(!atomic_load(&many[i].schedule_lock->contenders));
+    fiber_mutex_unlock(&many[i]);
+    test_assert(many[i].schedule_lock->acquire_count == 1);
+  }
+  for (i = 0; i < MANY_LOCKS; ++i) {
+    fiber_mutex_destroy(&many[i]);
+  }
+  free(many);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,104 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_manager.h"
+#include "fiber_mutex.h"
+#include "schedule_lock.h"
+#include "test_helper.h"
+
+// long enough that an early unpark can't be mistaken for the ban running out
+#define LONG_HOLD_USEC (50000)
+#define SHORT_HOLD_USEC (1000)
+
+fiber_mutex_t the_lock;
+fiber_t* volatile banned_fiber = NULL;
+volatile uint64_t banned_until = 0;
+volatile uint64_t resumed_at = 0;
+
+static void spin_for_usec(uint64_t usec) {
+  const uint64_t end = fiber_manager_read_clock() + usec * 1000;
+  while (fiber_manager_read_clock() < end) {
+  }
+}
+
+static uint64_t park_count() {
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  return stats.park_count;
+}
+
+// holds the lock past its slice while the holder waits for it, which bans
+// this fiber from the lock, then takes the lock again
+void* banned_function(void* param) {
+  fiber_t* const self = fiber_manager_get()->current_fiber;
+  banned_fiber = self;
+  fiber_mutex_lock(&the_lock);
+  while (!atomic_load(&the_lock.schedule_lock->contenders)) {
+    fiber_yield();
+  }
+  spin_for_usec((intptr_t)param);
+  fiber_mutex_unlock(&the_lock);
+  test_assert(get_lock_stats(self)->banned_lock == &the_lock);
+  banned_until = get_lock_stats(self)->banned_until;
+  test_assert(banned_until > 0);
+
+  fiber_mutex_lock(&the_lock);
+  resumed_at = fiber_manager_read_clock();
+  fiber_mutex_unlock(&the_lock);
+  return NULL;
+}
+
+// takes the lock from the banned fiber and keeps it until the banned fiber
+// is parked. with param set it then keeps holding it until the banned fiber
+// comes back on its own.
+void* holder_function(void* param) {
+  while (!schedule_lock_owner(the_lock.schedule_lock)) {
+    fiber_yield();
+  }
+  const uint64_t parked_before = park_count();
+  fiber_mutex_lock(&the_lock);
+  while (park_count() == parked_before) {
+    fiber_yield();
+  }
+  if (param) {
+    // the lock is still held, so only the ban running out lets it go
+    while (get_lock_stats(banned_fiber)->contending) {
+      fiber_yield();
+    }
+    test_assert(fiber_manager_read_clock() >= banned_until);
+  }
+  fiber_mutex_unlock(&the_lock);
+  return NULL;
+}
+
+static void run_round(uint64_t hold_usec, int wait_for_ban) {
+  fiber_t* const banned =
+      fiber_create(20000, &banned_function, (void*)(intptr_t)hold_usec);
+  fiber_t* const holder =
+      fiber_create(20000, &holder_function, (void*)(intptr_t)wait_for_ban);
+  fiber_join(banned, NULL);
+  fiber_join(holder, NULL);
+}
+
+int main() {
+  // one thread, so the banned fiber is popped (and parked) while the holder
+  // yields instead of spinning on a manager of its own
+  fiber_manager_init(1);
+  test_assert(fiber_mutex_init(&the_lock) == FIBER_SUCCESS);
+
+  // a banned fiber is parked, and resumes once its ban expires
+  const uint64_t parked_before = park_count();
+  run_round(SHORT_HOLD_USEC, 1);
+  test_assert(park_count() > parked_before);
+  test_assert(resumed_at >= banned_until);
+
+  // once nobody else holds or wants the lock, the ban stops mattering and
+  // the parked fiber is let go early
+  run_round(LONG_HOLD_USEC, 0);
+  test_assert(resumed_at < banned_until);
+
+  fiber_mutex_destroy(&the_lock);
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
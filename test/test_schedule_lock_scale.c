@@ -0,0 +1,198 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+/*
+    Fairness and throughput of scheduler-cooperative locks. Fibers with
+    different critical section lengths contend on a set of fiber_mutex_t
+    locks, first with the locks' SCL entries removed (a plain mutex) and then
+    with SCL enabled. usage: test_schedule_lock_scale [threads] [duration ms]
+    [locks] [fibers per lock]. See run_schedule_lock_scale.sh for a sweep
+    across thread counts.
+*/
+
+#include "fiber_mutex.h"
+#include "schedule_lock.h"
+#include "test_helper.h"
+
+int NUM_THREADS = 4;
+int DURATION_MS = 100;
+int NUM_LOCKS = 1;
+int FIBERS_PER_LOCK = 8;
+
+// each fiber's critical section is picked from these, in nanoseconds
+static const uint64_t critical_section_ns[] = {500, 1000, 2000, 4000};
+#define NUM_CRITICAL_SECTIONS \
+  (sizeof(critical_section_ns) / sizeof(*critical_section_ns))
+#define NON_CRITICAL_NS (1000)
+// percentiles are computed over the first MAX_SAMPLES waits of each fiber
+#define MAX_SAMPLES (16384)
+
+typedef struct fiber_data {
+  fiber_mutex_t* lock;
+  uint64_t critical_section;
+  uint64_t acquisitions;
+  uint64_t usage;
+  uint64_t sample_count;
+  uint64_t* waits;
+} __attribute__((__aligned__(FIBER_CACHELINE_SIZE))) fiber_data_t;
+
+fiber_mutex_t* locks = NULL;
+fiber_data_t* data = NULL;
+uint64_t volatile end_time = 0;
+
+static void spin_for(uint64_t ns) {
+  const uint64_t end = fiber_manager_read_clock() + ns;
+  while (fiber_manager_read_clock() < end) {
+  }
+}
+
+static int compare_uint64(const void* a, const void* b) {
+  const uint64_t x = *(const uint64_t*)a;
+  const uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+void* run_function(void* param) {
+  fiber_data_t* const my_data = param;
+  while (1) {
+    const uint64_t start = fiber_manager_read_clock();
+    if (start >= end_time) {
+      break;
+    }
+    fiber_mutex_lock(my_data->lock);
+    const uint64_t acquired = fiber_manager_read_clock();
+    spin_for(my_data->critical_section);
+    const uint64_t released = fiber_manager_read_clock();
+    fiber_mutex_unlock(my_data->lock);
+
+    my_data->usage += released - acquired;
+    if (my_data->sample_count < MAX_SAMPLES) {
+      my_data->waits[my_data->sample_count++] = acquired - start;
+    }
+    ++my_data->acquisitions;
+
+    spin_for(NON_CRITICAL_NS);
+    fiber_yield();
+  }
+  return NULL;
+}
+
+static void run_benchmark(const char* name, int use_scl) {
+  const int num_fibers = NUM_LOCKS * FIBERS_PER_LOCK;
+  int i;
+  for (i = 0; i < NUM_LOCKS; ++i) {
+    fiber_mutex_init(&locks[i]);
+    if (!use_scl) {
+      schedule_lock_destroy(locks[i].schedule_lock);
+      locks[i].schedule_lock = NULL;
+    }
+  }
+  for (i = 0; i < num_fibers; ++i) {
+    uint64_t* const waits = data[i].waits;
+    memset(&data[i], 0, sizeof(data[i]));
+    data[i].waits = waits;
+    data[i].lock = &locks[i % NUM_LOCKS];
+    data[i].critical_section =
+        critical_section_ns[(i / NUM_LOCKS) % NUM_CRITICAL_SECTIONS];
+  }
+
+  fiber_t** const fibers = calloc(num_fibers, sizeof(*fibers));
+  test_assert(fibers);
+  const uint64_t start = fiber_manager_read_clock();
+  end_time = start + (uint64_t)DURATION_MS * 1000000;
+  for (i = 0; i < num_fibers; ++i) {
+    fibers[i] = fiber_create(20000, &run_function, &data[i]);
+  }
+  for (i = 0; i < num_fibers; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+  const uint64_t elapsed = fiber_manager_read_clock() - start;
+  free(fibers);
+
+  uint64_t acquisitions = 0;
+  uint64_t sample_count = 0;
+  double usage_sum = 0;
+  double usage_sum_squares = 0;
+  for (i = 0; i < num_fibers; ++i) {
+    acquisitions += data[i].acquisitions;
+    sample_count += data[i].sample_count;
+    usage_sum += data[i].usage;
+    usage_sum_squares += (double)data[i].usage * data[i].usage;
+  }
+  test_assert(acquisitions > 0);
+
+  uint64_t* const waits = malloc(sample_count * sizeof(*waits));
+  test_assert(waits);
+  uint64_t offset = 0;
+  for (i = 0; i < num_fibers; ++i) {
+    memcpy(waits + offset, data[i].waits,
+           data[i].sample_count * sizeof(*waits));
+    offset += data[i].sample_count;
+  }
+  qsort(waits, sample_count, sizeof(*waits), &compare_uint64);
+  const uint64_t p50 = waits[sample_count / 2];
+  const uint64_t p99 = waits[sample_count * 99 / 100];
+  free(waits);
+
+  // Jain's fairness index of lock usage; 1 is perfectly fair
+  const double jain =
+      usage_sum_squares ? usage_sum * usage_sum /
+                              (num_fibers * usage_sum_squares)
+                        : 0;
+  test_assert(jain >= 0 && jain <= 1.0001);
+
+  for (i = 0; i < num_fibers; ++i) {
+    printf("%s fiber %d critical section %" PRIu64
+           " ns: %" PRIu64 " acquisitions, usage share %.2lf%%\n",
+           name, i, data[i].critical_section, data[i].acquisitions,
+           usage_sum ? 100.0 * data[i].usage / usage_sum : 0);
+  }
+  printf("total: %s threads %d locks %d fibers %d: %.0lf acquisitions per "
+         "second jain %.4lf wait p50 %" PRIu64 " ns p99 %" PRIu64 " ns\n",
+         name, NUM_THREADS, NUM_LOCKS, num_fibers,
+         acquisitions * 1000000000.0 / elapsed, jain, p50, p99);
+
+  for (i = 0; i < NUM_LOCKS; ++i) {
+    fiber_mutex_destroy(&locks[i]);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1) {
+    NUM_THREADS = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    DURATION_MS = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    NUM_LOCKS = atoi(argv[3]);
+  }
+  if (argc > 4) {
+    FIBERS_PER_LOCK = atoi(argv[4]);
+  }
+  test_assert(NUM_THREADS > 0 && DURATION_MS > 0 && NUM_LOCKS > 0 &&
+              FIBERS_PER_LOCK > 0);
+
+  fiber_manager_init(NUM_THREADS);
+
+  const int num_fibers = NUM_LOCKS * FIBERS_PER_LOCK;
+  locks = calloc(NUM_LOCKS, sizeof(*locks));
+  data = calloc(num_fibers, sizeof(*data));
+  test_assert(locks && data);
+  int i;
+  for (i = 0; i < num_fibers; ++i) {
+    data[i].waits = malloc(MAX_SAMPLES * sizeof(*data[i].waits));
+    test_assert(data[i].waits);
+  }
+
+  run_benchmark("mutex", 0);
+  run_benchmark("scl", 1);
+
+  for (i = 0; i < num_fibers; ++i) {
+    free(data[i].waits);
+  }
+  free(data);
+  free(locks);
+  fiber_shutdown();
+  return 0;
+}
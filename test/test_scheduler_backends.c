@@ -0,0 +1,67 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_manager.h"
+#include "fiber_mutex.h"
+#include "fiber_scheduler.h"
+#include "test_helper.h"
+
+#define PER_FIBER_COUNT 1000
+#define NUM_FIBERS 100
+#define NUM_THREADS 4
+
+fiber_mutex_t mutex;
+volatile int counter = 0;
+_Atomic int switch_count = 0;
+
+void* run_function(void* param) {
+  fiber_manager_t* const original_manager = fiber_manager_get();
+  int i;
+  for (i = 0; i < PER_FIBER_COUNT; ++i) {
+    if (fiber_manager_get() != original_manager) {
+      atomic_fetch_add(&switch_count, 1);
+    }
+    fiber_mutex_lock(&mutex);
+    ++counter;
+    fiber_mutex_unlock(&mutex);
+    fiber_yield();
+  }
+  return NULL;
+}
+
+int main() {
+  test_assert(fiber_scheduler_find("wsd") == &fiber_scheduler_wsd_ops);
+  test_assert(fiber_scheduler_find("dist") == &fiber_scheduler_dist_ops);
+  test_assert(fiber_scheduler_find("edf") == &fiber_scheduler_edf_ops);
+  test_assert(!fiber_scheduler_find("nope"));
+  test_assert(!fiber_scheduler_find(NULL));
+  test_assert(fiber_scheduler_select("nope") == FIBER_ERROR);
+  test_assert(errno == EINVAL);
+  test_assert(fiber_scheduler_ops == &fiber_scheduler_wsd_ops);
+
+  // the explicit parameter wins over the environment
+  setenv(FIBER_SCHEDULER_ENV, "wsd", 1);
+  test_assert(fiber_manager_init_with_scheduler(NUM_THREADS, "dist") ==
+              FIBER_SUCCESS);
+  test_assert(fiber_scheduler_ops == &fiber_scheduler_dist_ops);
+  test_assert(fiber_scheduler_select("wsd") == FIBER_ERROR);
+  test_assert(errno == EBUSY);
+
+  fiber_mutex_init(&mutex);
+  fiber_t* fibers[NUM_FIBERS];
+  int i;
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_create(20000, &run_function, NULL);
+    test_assert(fibers[i]);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+  test_assert(counter == NUM_FIBERS * PER_FIBER_COUNT);
+  fiber_mutex_destroy(&mutex);
+
+  printf("switch_count: %d\n", switch_count);
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,114 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "fiber_semaphore.h"
+#include "test_helper.h"
+
+#define NUM_THREADS 2
+#define NUM_FIBERS 200
+#define NUM_YIELDS 20
+#define MAX_WAITS 5000
+
+fiber_semaphore_t semaphore;
+
+// each fiber fills a differently sized buffer with its own pattern, which
+// has to survive being copied off of the shared stack and back
+static __attribute__((__noinline__)) int check_frames(intptr_t index,
+                                                      int depth) {
+  volatile char buffer[256];
+  int i;
+  for (i = 0; i < (int)sizeof(buffer); ++i) {
+    buffer[i] = (char)(index + depth + i);
+  }
+  int ok = 1;
+  if (depth > 0) {
+    ok = check_frames(index, depth - 1);
+  } else {
+    const int home = fiber_manager_get()->id;
+    for (i = 0; i < NUM_YIELDS; ++i) {
+      fiber_yield();
+      if (i == NUM_YIELDS / 2) {
+        fiber_sleep(0, 1000);
+      }
+      // pinned to the manager which created it
+      ok = ok && fiber_manager_get()->id == home;
+    }
+  }
+  for (i = 0; i < (int)sizeof(buffer); ++i) {
+    ok = ok && buffer[i] == (char)(index + depth + i);
+  }
+  return ok;
+}
+
+void* shared_function(void* param) {
+  const intptr_t index = (intptr_t)param;
+  return (void*)(intptr_t)check_frames(index, index % 16);
+}
+
+void* waiting_function(void* param) {
+  fiber_semaphore_wait(&semaphore);
+  return (void*)1;
+}
+
+// creates a fiber on manager 1's shared stack, which then waits until it's
+// posted from elsewhere
+void* creator_function(void* param) {
+  return fiber_create_shared(&waiting_function, NULL);
+}
+
+int main() {
+  fiber_manager_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.shared_stack_size = 256 * 1024;
+  fiber_manager_init_with_options(NUM_THREADS, &options);
+
+  fiber_t* fibers[NUM_FIBERS];
+  fibers[0] = fiber_create_shared(&shared_function, (void*)0);
+  if (!fibers[0]) {
+    // split stacks, or no assembly context switching
+    test_assert(errno == ENOTSUP);
+    fiber_shutdown();
+    return 0;
+  }
+  intptr_t i;
+  for (i = 1; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_create_shared(&shared_function, (void*)i);
+    test_assert(fibers[i]);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    void* result = NULL;
+    test_assert(fiber_join(fibers[i], &result));
+    test_assert(result == (void*)1);
+  }
+  fiber_manager_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.stack_copy_count >= NUM_FIBERS);
+
+  // shared stack fibers can't move, and their manager can't be retired
+  fiber_semaphore_init(&semaphore, 0);
+  fiber_t* const creator =
+      fiber_manager_submit(1, 20000, &creator_function, NULL);
+  fiber_t* waiter = NULL;
+  fiber_join(creator, (void**)&waiter);
+  test_assert(waiter);
+  test_assert(!fiber_set_home_manager(waiter, 0));
+  test_assert(errno == EINVAL);
+  test_assert(!fiber_manager_set_thread_count(1));
+  test_assert(errno == EBUSY);
+  fiber_semaphore_post(&semaphore);
+  void* result = NULL;
+  fiber_join(waiter, &result);
+  test_assert(result == (void*)1);
+  for (i = 0; i < MAX_WAITS && !fiber_manager_set_thread_count(1); ++i) {
+    fiber_sleep(0, 1000);
+  }
+  test_assert(fiber_manager_get_kernel_thread_count() == 1);
+  fiber_semaphore_destroy(&semaphore);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
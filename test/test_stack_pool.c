@@ -0,0 +1,145 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "fiber_manager.h"
+#include "fiber_stack_pool.h"
+#include "test_helper.h"
+
+#define NUM_STACKS 8
+#define NUM_FIBERS 1000
+
+void* touch_function(void* param) {
+  volatile char buffer[4096];
+  buffer[0] = 1;
+  return (void*)(intptr_t)buffer[0];
+}
+
+#define DEEP_SIZE (256 * 1024)
+
+static __attribute__((__noinline__)) char go_deep() {
+  volatile char buffer[DEEP_SIZE];
+  int i;
+  for (i = 0; i < DEEP_SIZE; i += 1024) {
+    buffer[i] = 1;
+  }
+  return buffer[DEEP_SIZE - 1024];
+}
+
+void* deep_function(void* param) {
+  test_assert(go_deep() == 1);
+  return (void*)fiber_trim_stack();
+}
+
+void* free_function(void* param) {
+  fiber_stack_pool_put(param, 2 * sysconf(_SC_PAGESIZE));
+  return NULL;
+}
+
+int main() {
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  fiber_stack_pool_stats_t before;
+  fiber_stack_pool_stats(&before);
+
+  // a stack has room for what was asked plus a guard page
+  size_t size = 0;
+  char* const stack = fiber_stack_pool_get(page_size, &size);
+  test_assert(stack);
+  test_assert(size == 2 * page_size);
+  stack[size - 1] = 1;
+  fiber_stack_pool_put(stack, size);
+
+  // freed stacks come back, from this thread's cache
+  char* const again = fiber_stack_pool_get(page_size / 2, &size);
+  test_assert(again == stack);
+  fiber_stack_pool_stats_t after;
+  fiber_stack_pool_stats(&after);
+  test_assert(after.hit_count == before.hit_count + 1);
+  test_assert(after.miss_count == before.miss_count + 1);
+
+  // another thread's frees go to the global pool when it exits
+  pthread_t thread;
+  test_assert(!pthread_create(&thread, NULL, &free_function, again));
+  pthread_join(thread, NULL);
+  test_assert(fiber_stack_pool_get(page_size, &size) == again);
+  fiber_stack_pool_stats(&after);
+  test_assert(after.global_hit_count == before.global_hit_count + 1);
+  fiber_stack_pool_put(again, size);
+
+  // stacks beyond the limits are unmapped
+  fiber_stack_pool_set_limits(2, 0);
+  char* stacks[NUM_STACKS];
+  int i;
+  for (i = 0; i < NUM_STACKS; ++i) {
+    stacks[i] = fiber_stack_pool_get(page_size, &size);
+    test_assert(stacks[i]);
+  }
+  for (i = 0; i < NUM_STACKS; ++i) {
+    fiber_stack_pool_put(stacks[i], size);
+  }
+  fiber_stack_pool_stats(&after);
+  test_assert(after.unmap_count > before.unmap_count);
+  test_assert(after.cached_count <= 2);
+  fiber_stack_pool_set_limits(FIBER_STACK_POOL_LOCAL_LIMIT,
+                              FIBER_STACK_POOL_GLOBAL_LIMIT);
+
+  // freed stacks which went deeper than usual give their pages back
+  fiber_stack_pool_set_reclaim(1, 0);
+  char* const deep = fiber_stack_pool_get(128 * page_size, &size);
+  memset(deep + page_size, 1, size - page_size);
+  fiber_stack_pool_put(deep, size);
+  char* const shallow = fiber_stack_pool_get(128 * page_size, &size);
+  test_assert(shallow == deep);
+  test_assert(shallow[page_size] == 0);
+  test_assert(shallow[size - page_size] == 1);
+  fiber_stack_pool_stats(&after);
+  test_assert(after.trim_count == before.trim_count + 1);
+  test_assert(after.trimmed_bytes >= size - 3 * page_size);
+  fiber_stack_pool_put(shallow, size);
+  fiber_stack_pool_set_reclaim(0, 0);
+
+  // too large to pool
+  char* const large = fiber_stack_pool_get(4 << 20, &size);
+  test_assert(large);
+  test_assert(size >= (4 << 20) + page_size);
+  large[size - 1] = 1;
+  fiber_stack_pool_put(large, size);
+
+  fiber_manager_init(1);
+  fiber_stack_pool_stats(&before);
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_t* const the_fiber = fiber_create(20000, &touch_function, NULL);
+    void* result = NULL;
+    fiber_join(the_fiber, &result);
+    test_assert(result == (void*)1);
+  }
+  fiber_stack_pool_stats(&after);
+
+  // fibers can trim their own stacks, if they're mmap'd
+  fiber_t* const deep_fiber =
+      fiber_create(2 * DEEP_SIZE, &deep_function, NULL);
+  void* trimmed = NULL;
+  fiber_join(deep_fiber, &trimmed);
+#ifdef FIBER_STACK_MMAP
+  test_assert((size_t)trimmed >= DEEP_SIZE - 2 * page_size);
+#else
+  test_assert(!trimmed);
+#endif
+
+#ifdef FIBER_STACK_MMAP
+  // fiber stacks come from the pool, so nearly every one is reused
+  test_assert(after.hit_count - before.hit_count >= NUM_FIBERS - 1);
+#endif
+  printf("hit_count: %" PRIu64 "\nglobal_hit_count: %" PRIu64
+         "\nmiss_count: %" PRIu64 "\nunmap_count: %" PRIu64
+         "\ncached_count: %" PRIu64 "\ntrim_count: %" PRIu64
+         "\ntrimmed_bytes: %" PRIu64 "\n",
+         after.hit_count, after.global_hit_count, after.miss_count,
+         after.unmap_count, after.cached_count, after.trim_count,
+         after.trimmed_bytes);
+
+  fiber_shutdown();
+  return 0;
+}
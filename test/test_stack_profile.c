@@ -0,0 +1,116 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include "fiber_stack_profile.h"
+#include "test_helper.h"
+
+#define NUM_THREADS 2
+#define NUM_FIBERS 200
+#define STACK_SIZE (64 * 1024)
+#define USED_SIZE (20 * 1024)
+#define MARGIN (8 * 1024)
+#define MAX_WAITS 5000
+
+void* deep_function(void* param) {
+  volatile char buffer[USED_SIZE];
+  int i;
+  for (i = 0; i < USED_SIZE; i += 64) {
+    buffer[i] = (char)i;
+  }
+  return (void*)(intptr_t)buffer[0];
+}
+
+void* shallow_function(void* param) { return NULL; }
+
+void* unused_function(void* param) { return NULL; }
+
+static void run_fibers(fiber_run_function_t run) {
+  fiber_t* fibers[NUM_FIBERS];
+  int i;
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_create(STACK_SIZE, run, NULL);
+    test_assert(fibers[i]);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+}
+
+// joined fibers are destroyed, and measured, a little later by the managers
+static uint64_t wait_for_samples(fiber_run_function_t run, uint64_t count) {
+  fiber_stack_profile_stats_t stats = {};
+  int i;
+  for (i = 0; i < MAX_WAITS; ++i) {
+    if (fiber_stack_profile_get(run, &stats) && stats.count >= count) {
+      break;
+    }
+    fiber_sleep(0, 1000);
+  }
+  return stats.count;
+}
+
+int main() {
+  fiber_manager_init(NUM_THREADS);
+
+  // nothing is measured until profiling is on
+  run_fibers(&deep_function);
+  fiber_stack_profile_stats_t stats;
+  test_assert(!fiber_stack_profile_get(&deep_function, &stats));
+
+  fiber_stack_profile_enable(1);
+  test_assert(fiber_stack_profile_enabled());
+  run_fibers(&deep_function);
+  run_fibers(&shallow_function);
+  if (!wait_for_samples(&deep_function, NUM_FIBERS)) {
+    // this build can't fill stacks with a canary
+    fiber_shutdown();
+    return 0;
+  }
+  test_assert(wait_for_samples(&shallow_function, NUM_FIBERS) == NUM_FIBERS);
+
+  // each site is told apart from the others
+  test_assert(fiber_stack_profile_get(&deep_function, &stats));
+  test_assert(stats.count == NUM_FIBERS);
+  test_assert(stats.max_depth >= USED_SIZE);
+  test_assert(stats.max_depth < STACK_SIZE);
+  test_assert(stats.p99_depth >= USED_SIZE);
+  test_assert(stats.p99_depth < STACK_SIZE);
+  test_assert(stats.auto_size);
+  const size_t deep_p99 = stats.p99_depth;
+  test_assert(fiber_stack_profile_get(&shallow_function, &stats));
+  test_assert(stats.count == NUM_FIBERS);
+  test_assert(stats.p99_depth < USED_SIZE);
+  fiber_run_function_t sites[4];
+  test_assert(fiber_stack_profile_sites(sites, 4) == 2);
+
+  // sizes only come from the profile once auto-sizing is on
+  test_assert(fiber_stack_profile_size(&deep_function, STACK_SIZE) ==
+              STACK_SIZE);
+  fiber_stack_profile_auto_size(1, MARGIN);
+  // the margin applies from the next time the percentile is worked out
+  run_fibers(&deep_function);
+  test_assert(wait_for_samples(&deep_function, 2 * NUM_FIBERS) ==
+              2 * NUM_FIBERS);
+  test_assert(fiber_stack_profile_get(&deep_function, &stats));
+  test_assert(stats.p99_depth == deep_p99);
+  test_assert(stats.auto_size == deep_p99 + MARGIN);
+  test_assert(fiber_stack_profile_size(&deep_function, 1024 * 1024) ==
+              deep_p99 + MARGIN);
+  // sites without enough samples get what they ask for
+  test_assert(fiber_stack_profile_size(&unused_function, STACK_SIZE) ==
+              STACK_SIZE);
+
+  // fibers given the smaller stack still run
+  run_fibers(&deep_function);
+  fiber_stack_profile_auto_size(0, 0);
+  fiber_stack_profile_enable(0);
+
+  fiber_stack_profile_reset();
+  test_assert(!fiber_stack_profile_get(&deep_function, &stats));
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
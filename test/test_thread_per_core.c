@@ -0,0 +1,90 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_manager.h"
+#include "fiber_semaphore.h"
+#include "test_helper.h"
+
+#define NUM_THREADS 4
+#define NUM_ROUNDS 1000
+
+_Atomic int away_count = 0;
+
+typedef struct pair {
+  fiber_semaphore_t ping;
+  fiber_semaphore_t pong;
+} pair_t;
+
+pair_t pairs[NUM_THREADS];
+
+static void check_home(int home) {
+  if (fiber_manager_get()->id != home) {
+    atomic_fetch_add(&away_count, 1);
+  }
+}
+
+// each manager pings the next one, so every wake crosses to another manager
+void* ping_function(void* param) {
+  const int home = (intptr_t)param;
+  pair_t* const pair = &pairs[home];
+  int i;
+  for (i = 0; i < NUM_ROUNDS; ++i) {
+    check_home(home);
+    fiber_semaphore_post(&pair->ping);
+    fiber_semaphore_wait(&pair->pong);
+  }
+  return NULL;
+}
+
+void* pong_function(void* param) {
+  const int home = (intptr_t)param;
+  pair_t* const pair = &pairs[(home + NUM_THREADS - 1) % NUM_THREADS];
+  int i;
+  for (i = 0; i < NUM_ROUNDS; ++i) {
+    fiber_semaphore_wait(&pair->ping);
+    check_home(home);
+    fiber_semaphore_post(&pair->pong);
+  }
+  return NULL;
+}
+
+int main() {
+  fiber_manager_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.thread_per_core = 1;
+  test_assert(fiber_manager_init_with_options(NUM_THREADS, &options) ==
+              FIBER_SUCCESS);
+  test_assert(fiber_scheduler_ops == &fiber_scheduler_tpc_ops);
+  test_assert(!fiber_manager_submit(NUM_THREADS, 20000, &ping_function, NULL));
+  test_assert(errno == EINVAL);
+
+  fiber_t* pings[NUM_THREADS];
+  fiber_t* pongs[NUM_THREADS];
+  int i;
+  for (i = 0; i < NUM_THREADS; ++i) {
+    fiber_semaphore_init(&pairs[i].ping, 0);
+    fiber_semaphore_init(&pairs[i].pong, 0);
+  }
+  for (i = 0; i < NUM_THREADS; ++i) {
+    pings[i] = fiber_manager_submit(i, 20000, &ping_function,
+                                    (void*)(intptr_t)i);
+    pongs[i] = fiber_manager_submit(i, 20000, &pong_function,
+                                    (void*)(intptr_t)i);
+  }
+  for (i = 0; i < NUM_THREADS; ++i) {
+    fiber_join(pings[i], NULL);
+    fiber_join(pongs[i], NULL);
+  }
+  test_assert(away_count == 0);
+  // main is back where it started
+  test_assert(fiber_manager_get()->id == 0);
+
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  test_assert(stats.steal_count == 0);
+  test_assert(stats.sent_home_count >= NUM_THREADS);
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
@@ -0,0 +1,98 @@
+// SPDX-FileCopyrightText: 2012-2023 Brian Watling <brian@oxbo.dev>
+// SPDX-License-Identifier: MIT
+
+#include "fiber_topology.h"
+
+#include "fiber_manager.h"
+#include "fiber_scheduler.h"
+#include "test_helper.h"
+
+#define PER_FIBER_COUNT 100
+#define NUM_FIBERS 100
+#define NUM_THREADS 4
+
+void* run_function(void* param) {
+  int i;
+  for (i = 0; i < PER_FIBER_COUNT; ++i) {
+    fiber_yield();
+  }
+  return NULL;
+}
+
+int main() {
+  test_assert(fiber_topology_init());
+  test_assert(fiber_topology_init());
+  const int num_cpus = fiber_topology_cpu_count();
+  test_assert(num_cpus > 0);
+
+  int a;
+  for (a = 0; a < num_cpus; ++a) {
+    test_assert(fiber_topology_distance(a, a) == FIBER_TOPOLOGY_SMT);
+    int b;
+    for (b = 0; b < num_cpus; ++b) {
+      test_assert(fiber_topology_distance(a, b) ==
+                  fiber_topology_distance(b, a));
+      // nearer levels imply the farther ones
+      if (fiber_topology_distance(a, b) <= FIBER_TOPOLOGY_NODE &&
+          fiber_topology_node(a) >= 0) {
+        test_assert(fiber_topology_node(a) == fiber_topology_node(b));
+      }
+    }
+    printf("cpu %d node %d\n", a, fiber_topology_node(a));
+  }
+  test_assert(fiber_topology_distance(-1, 0) == FIBER_TOPOLOGY_REMOTE);
+  test_assert(fiber_topology_distance(0, num_cpus) == FIBER_TOPOLOGY_REMOTE);
+  test_assert(fiber_topology_node(-1) == -1);
+  test_assert(!strcmp(fiber_topology_level_name(FIBER_TOPOLOGY_LLC), "llc"));
+
+  // the per-level steal counts and the victim order are wsd's
+  fiber_manager_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.scheduler = "wsd";
+  // pinned, so the managers' CPUs don't change under the victim order
+  options.pin_threads = 1;
+  test_assert(fiber_manager_init_with_options(NUM_THREADS, &options) ==
+              FIBER_SUCCESS);
+  fiber_t* fibers[NUM_FIBERS];
+  int i;
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fibers[i] = fiber_create(20000, &run_function, NULL);
+  }
+  for (i = 0; i < NUM_FIBERS; ++i) {
+    fiber_join(fibers[i], NULL);
+  }
+
+  // every steal is attributed to exactly one level
+  fiber_manager_stats_t stats;
+  fiber_manager_all_stats(&stats);
+  uint64_t level_total = 0;
+  for (i = 0; i < FIBER_TOPOLOGY_LEVELS; ++i) {
+    level_total += stats.level_steal_count[i];
+  }
+  test_assert(level_total == stats.steal_count);
+
+  // victims are tried nearest first: SMT siblings, then the same LLC, the
+  // same node and remote CPUs
+  int cpu = -1;
+  size_t victims[NUM_THREADS - 1];
+  int victim_cpus[NUM_THREADS - 1];
+  const size_t num_victims = fiber_scheduler_wsd_victims(
+      fiber_manager_get()->scheduler, &cpu, victims, victim_cpus);
+  test_assert(num_victims == NUM_THREADS - 1);
+  test_assert(cpu == fiber_manager_get()->cpu);
+  int seen[NUM_THREADS] = {0};
+  seen[fiber_manager_get()->id] = 1;
+  for (i = 0; i < (int)num_victims; ++i) {
+    test_assert(victims[i] < NUM_THREADS);
+    test_assert(!seen[victims[i]]);
+    seen[victims[i]] = 1;
+    if (i > 0) {
+      test_assert(fiber_topology_distance(cpu, victim_cpus[i - 1]) <=
+                  fiber_topology_distance(cpu, victim_cpus[i]));
+    }
+  }
+
+  fiber_manager_print_stats();
+  fiber_shutdown();
+  return 0;
+}
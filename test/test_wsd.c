@@ -14,42 +14,52 @@ size_t run_func_count[NUM_THREADS] = {};
 uint64_t total = 0;
 int done = 0;
 
+void record(intptr_t threadId, void* ret) {
+  __sync_add_and_fetch(&results[threadId][(intptr_t)ret], 1);
+  __sync_add_and_fetch(&total, (intptr_t)ret);
+  ++run_func_count[threadId];
+}
+
 void* run_func(void* p) {
   intptr_t threadId = (intptr_t)p;
   while (!done) {
     void* ret = wsd_work_stealing_deque_steal(wsd_d2);
     if (ret != WSD_EMPTY && ret != WSD_ABORT) {
-      __sync_add_and_fetch(&results[threadId][(intptr_t)ret], 1);
-      __sync_add_and_fetch(&total, (intptr_t)ret);
-      ++run_func_count[threadId];
+      record(threadId, ret);
     }
   }
   return NULL;
 }
 
-int main(int argc, char* argv[]) {
-  wsd_circular_array_t* wsd_a = wsd_circular_array_create(8);
-  test_assert(wsd_a);
-  test_assert(wsd_circular_array_size(wsd_a) == 256);
-  wsd_circular_array_put(wsd_a, 1, (void*)1);
-  test_assert((void*)1 == wsd_circular_array_get(wsd_a, 1));
-  wsd_circular_array_destroy(wsd_a);
-
-  wsd_work_stealing_deque_t* wsd_d = wsd_work_stealing_deque_create();
-  int i;
-  for (i = 0; i < 1000; ++i) {
-    wsd_work_stealing_deque_push_bottom(wsd_d, (void*)(intptr_t)i);
-  }
-  for (i = 1000; i > 0; --i) {
-    void* item = wsd_work_stealing_deque_pop_bottom(wsd_d);
-    test_assert((intptr_t)item == i - 1);
+// steals in batches into a private deque, then drains it
+void* run_func_half(void* p) {
+  intptr_t threadId = (intptr_t)p;
+  wsd_work_stealing_deque_t* const local = wsd_work_stealing_deque_create();
+  test_assert(local);
+  while (!done) {
+    wsd_work_stealing_deque_steal_half(wsd_d2, local, 16);
+    void* ret;
+    while ((ret = wsd_work_stealing_deque_pop_bottom(local)) != WSD_EMPTY) {
+      test_assert(ret != WSD_ABORT);
+      record(threadId, ret);
+    }
   }
-  wsd_work_stealing_deque_destroy(wsd_d);
+  wsd_work_stealing_deque_destroy(local);
+  return NULL;
+}
 
+// the owner pushes SHARED_COUNT items, popping some of them itself, while the
+// other threads steal with reader_func. every item must be taken exactly once.
+void run_phase(void* (*reader_func)(void*)) {
+  memset(results, 0, sizeof(results));
+  memset(run_func_count, 0, sizeof(run_func_count));
+  total = 0;
+  done = 0;
   wsd_d2 = wsd_work_stealing_deque_create();
   pthread_t reader[NUM_THREADS];
+  int i;
   for (i = 1; i < NUM_THREADS; ++i) {
-    pthread_create(&reader[i], NULL, &run_func, (void*)(intptr_t)i);
+    pthread_create(&reader[i], NULL, reader_func, (void*)(intptr_t)i);
   }
 
   for (i = 0; i < SHARED_COUNT; ++i) {
@@ -93,5 +103,49 @@ int main(int argc, char* argv[]) {
   for (i = 0; i < NUM_THREADS; ++i) {
     test_assert(run_func_count[i] > 0);
   }
+}
+
+int main(int argc, char* argv[]) {
+  wsd_circular_array_t* wsd_a = wsd_circular_array_create(8);
+  test_assert(wsd_a);
+  test_assert(wsd_circular_array_size(wsd_a) == 256);
+  wsd_circular_array_put(wsd_a, 1, (void*)1);
+  test_assert((void*)1 == wsd_circular_array_get(wsd_a, 1));
+  wsd_circular_array_destroy(wsd_a);
+
+  wsd_work_stealing_deque_t* wsd_d = wsd_work_stealing_deque_create();
+  int i;
+  for (i = 0; i < 1000; ++i) {
+    wsd_work_stealing_deque_push_bottom(wsd_d, (void*)(intptr_t)i);
+  }
+  for (i = 1000; i > 0; --i) {
+    void* item = wsd_work_stealing_deque_pop_bottom(wsd_d);
+    test_assert((intptr_t)item == i - 1);
+  }
+  wsd_work_stealing_deque_destroy(wsd_d);
+
+  // steal half takes the oldest half, rounded up, capped at max
+  wsd_d = wsd_work_stealing_deque_create();
+  wsd_work_stealing_deque_t* const thief = wsd_work_stealing_deque_create();
+  for (i = 0; i < 9; ++i) {
+    wsd_work_stealing_deque_push_bottom(wsd_d, (void*)(intptr_t)i);
+  }
+  test_assert(wsd_work_stealing_deque_steal_half(wsd_d, thief, 100) == 5);
+  test_assert(wsd_work_stealing_deque_size(wsd_d) == 4);
+  test_assert(wsd_work_stealing_deque_size(thief) == 5);
+  for (i = 5; i > 0; --i) {
+    test_assert((intptr_t)wsd_work_stealing_deque_pop_bottom(thief) == i - 1);
+  }
+  test_assert(wsd_work_stealing_deque_steal_half(wsd_d, thief, 1) == 1);
+  test_assert((intptr_t)wsd_work_stealing_deque_pop_bottom(thief) == 5);
+  while (wsd_work_stealing_deque_pop_bottom(wsd_d) != WSD_EMPTY) {
+  }
+  test_assert(wsd_work_stealing_deque_steal_half(wsd_d, thief, 100) == 0);
+  wsd_work_stealing_deque_destroy(thief);
+  wsd_work_stealing_deque_destroy(wsd_d);
+
+  // single item steals, then the same with thieves stealing in batches
+  run_phase(&run_func);
+  run_phase(&run_func_half);
   return 0;
 }